@@ -0,0 +1,81 @@
+#include "stdafx.h"
+
+#include "macro.h"
+#include "bitstream.h"
+#include "bitreader.h"
+
+void FastBitReader::refillSlow()
+{
+    while (mBitsInCache<=56)
+    {
+        uint8_t byte=0; // zeros are read after the end
+        if (mBytePos<mEndPos)
+        {
+            byte=mData[mBytePos];
+            if (byte==0xFF)
+            {
+                size_t next=mBytePos+1;
+                while (next<mEndPos && mData[next]==0xFF) next++; // fill bytes
+                const uint8_t marker=next<mEndPos?mData[next]:0xD9; // a truncated marker ends the data
+                if (marker==0)
+                {
+                    // stuffed zero: produce a 0xFF byte
+                    mBytePos=next;
+                }
+                else if (marker>=0xD0 && marker<=0xD7)
+                {
+                    // RSTn: keep this mark but drop 0xFF
+                    byte=marker;
+                    mBytePos=next;
+                }
+                else
+                {
+                    mEndPos=mBytePos;
+                    byte=0;
+                }
+            }
+        }
+        if (mBytePos>=mEndPos) mPadded=true;
+        mBytePos++;
+        mCache|=(uint64_t)byte<<(56-mBitsInCache);
+        mBitsInCache+=8;
+    }
+}
+
+bool test_bitreader()
+{
+    // must read the same bits as BitStream in stuffed mode
+    uint8_t data[300];
+    uint32_t seed=12345;
+    for (size_t i=0;i<sizeof(data);i++)
+    {
+        seed=seed*1103515245+12345;
+        const uint8_t r=seed>>24;
+        data[i]=r<0x30?0xFF:r; // frequent 0xFF bytes
+        if (data[i]==0xFF && i+1<sizeof(data)-20)
+            data[++i]=r<0x08?0xD0+(r&7):(r<0x10?0xFF:0); // RSTn, fill byte or stuffed zero
+    }
+    data[sizeof(data)-2]=0xFF;
+    data[sizeof(data)-1]=0xD9; // EOI
+    BitStream ref;
+    ref.attachStuffed(data,sizeof(data));
+    ref.cacheInit();
+    FastBitReader strm(data,sizeof(data));
+    for (int i=0;i<1000;i++)
+    {
+        const int n=1+(i*7)%32;
+        assert(strm.cachedFrontBits(n)==ref.cachedFrontBits(n));
+        const int skip=1+(i*5)%n;
+        strm.cachedSkipBits(skip);
+        ref.cachedSkipBits(skip);
+        assert(strm.cacheEof()==ref.cacheEof());
+        assert(!strm.cacheEof() || strm.paddingLoaded());
+        if (i%97==0)
+        {
+            strm.cacheAlignToByte();
+            ref.cacheAlignToByte();
+        }
+    }
+    assert(strm.cacheEof() && strm.paddingLoaded());
+    return true;
+}
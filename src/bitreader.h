@@ -0,0 +1,118 @@
+#ifndef BITREADER_H_INCLUDED
+#define BITREADER_H_INCLUDED
+
+#ifdef __BMI2__
+    #include <immintrin.h>
+#endif
+
+// Reads JPEG entropy-coded data from memory, byte stuffing included, through the same
+// cached interface as BitStream. The 64-bit cache is refilled to at least 56 bits by one
+// unaligned 8-byte load; only loads containing a 0xFF byte take the byte-wise slow path,
+// which drops stuffing and fill bytes, reduces RSTn to its second byte and ends the data
+// at any other marker. Zeros are read after the end; decoders only check cacheEof() once
+// paddingLoaded() tells that the cache holds some, i.e. for the last MCUs of the data.
+class FastBitReader
+{
+public:
+    FastBitReader(const uint8_t * data, const size_t len):mData(data),mEndPos(len)
+    {
+    }
+
+    // source position of the first byte not taken into the cache, at most the end of the data
+    size_t getCurrentPos() const
+    {
+        return min(mBytePos,mEndPos);
+    }
+
+    // source position of the byte holding the next unread bit, stuffed bytes in the cache
+    // are not counted, so it may be a few bytes early
+    size_t getReadPos() const
+    {
+        return min(mBytePos-((mBitsInCache+7)>>3),mEndPos);
+    }
+
+    // true if whole bytes of data are left to read, e.g. after the last MCU
+    bool hasBytesLeft() const
+    {
+        return mBytePos<mEndPos || (mBitsInCache>=8 && ((mBytePos-mEndPos)<<3)<(size_t)mBitsInCache-7);
+    }
+
+    // true once zeros after the end of the data have been loaded into the cache,
+    // which cacheEof() needs before it can be true
+    bool paddingLoaded() const
+    {
+        return mPadded;
+    }
+
+    // true once bits after the end of the data have been consumed
+    bool cacheEof() const
+    {
+        return mBytePos>mEndPos && ((mBytePos-mEndPos)<<3)>(size_t)mBitsInCache;
+    }
+
+    // numBits <= 32
+    uint32_t cachedFrontBits(const int numBits)
+    {
+        vassert(numBits<=32);
+        if (mBitsInCache<numBits) refill();
+        return mCache>>(64-numBits);
+    }
+
+    void cachedSkipBits(const int numBits)
+    {
+        mCache<<=numBits;
+        mBitsInCache-=numBits;
+        vassert(mBitsInCache>=0);
+    }
+
+    uint32_t cachedNextBits(const int numBits)
+    {
+        const uint32_t result=cachedFrontBits(numBits);
+        cachedSkipBits(numBits);
+        return result;
+    }
+
+    void cacheAlignToByte()
+    {
+        cachedSkipBits(mBitsInCache&7);
+    }
+
+private:
+    const uint8_t *mData;
+    size_t mEndPos;
+    size_t mBytePos=0;
+    uint64_t mCache=0; // bits below the cached ones are always zero
+    int mBitsInCache=0;
+    bool mPadded=false;
+
+    void refill()
+    {
+        if (mBytePos+8<=mEndPos)
+        {
+            uint64_t word;
+            memcpy(&word,&mData[mBytePos],8);
+            if (((~word-0x0101010101010101ULL)&word&0x8080808080808080ULL)==0)
+            {
+                // no 0xFF byte: take as many whole bytes as fit
+                mCache|=bswap64(word)>>mBitsInCache;
+                mBytePos+=(63-mBitsInCache)>>3;
+                mBitsInCache|=56;
+                // drop the bits of the bytes that were loaded but not taken
+            #ifdef __BMI2__
+                mCache-=_bzhi_u64(mCache,64-mBitsInCache);
+            #else
+                mCache&=~0ULL<<(64-mBitsInCache);
+            #endif
+                return;
+            }
+        }
+        refillSlow();
+    }
+
+    void refillSlow();
+};
+
+// unit tests
+bool test_bitreader();
+
+#endif // BITREADER_H_INCLUDED
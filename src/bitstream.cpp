@@ -25,7 +25,57 @@ size_t BitStream::append(const uint8_t * src, const size_t len)
     return len;
 }
 
+uint32_t BitStream::nextStuffedWordSlow()
+{
+    uint32_t word=0;
+    for (int i=0;i<4;i++)
+    {
+        uint8_t byte=0; // zeros are read after the end
+        if (mBytePos<mEndPos)
+        {
+            byte=mBitReservoir[mBytePos];
+            if (byte==0xFF)
+            {
+                size_t next=mBytePos+1;
+                while (next<mEndPos && mBitReservoir[next]==0xFF) next++; // fill bytes
+                const uint8_t marker=next<mEndPos?mBitReservoir[next]:0xD9; // a truncated marker ends the data
+                if (marker==0)
+                {
+                    // stuffed zero: produce a 0xFF byte
+                    mBytePos=next;
+                }
+                else if (marker>=0xD0 && marker<=0xD7)
+                {
+                    // RSTn: keep this mark but drop 0xFF
+                    byte=marker;
+                    mBytePos=next;
+                }
+                else
+                {
+                    mEndPos=mBytePos;
+                    byte=0;
+                }
+            }
+        }
+        mBytePos++;
+        word=(word<<8)|byte;
+    }
+    return word;
+}
+
 bool test_bitstream()
 {
+    // reading stuffed data in place must match reading the unstuffed bytes
+    const uint8_t stuffed[]={0x12,0xFF,0x00,0x34,0x56,0x78,0x9A,0xFF,0xFF,0xD3,0xBC,0xFF,0x00,0xFF,0xD9,0xDE};
+    const uint8_t plain[]={0x12,0xFF,0x34,0x56,0x78,0x9A,0xD3,0xBC,0xFF,0,0,0,0};
+    BitStream strm;
+    strm.attachStuffed(stuffed,sizeof(stuffed));
+    strm.cacheInit();
+    for (size_t i=0;i<sizeof(plain);i++)
+    {
+        assert(strm.cachedNextBits(8)==plain[i]);
+        assert(strm.cacheEof()==(i>=9));
+    }
+    assert(strm.getEndPos()==13); // stopped at EOI
     return true;
 }
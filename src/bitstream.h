@@ -95,10 +95,33 @@ public:
         clear();
         if (mBitReservoir!=NULL)
         {
-            delete[] mBitReservoir;
+            if (mOwnsData) delete[] mBitReservoir;
             mBitReservoir=NULL;
             mCapacity=0;
         }
+        mOwnsData=true;
+        mStuffed=false;
+    }
+
+    // read from external memory without copying it (the data is not freed by the stream)
+    // the caller must keep at least 4 readable bytes after the end for cached reads
+    void attach(const uint8_t * data, const size_t len)
+    {
+        free();
+        mBitReservoir=const_cast<uint8_t*>(data);
+        mCapacity=len;
+        mEndPos=len;
+        mOwnsData=false;
+        rewind();
+    }
+
+    // read entropy-coded data in place: cached reads remove byte stuffing, reduce RSTn markers
+    // to their second byte and stop at any other marker, which becomes the end of the data
+    // nothing is read past len, and positions count the stuffed bytes
+    void attachStuffed(const uint8_t * data, const size_t len)
+    {
+        attach(data,len);
+        mStuffed=true;
     }
 
     void trim()
@@ -138,7 +161,8 @@ public:
             uint8_t * const newMem=new uint8_t[newCap+4]; // realloc
             moveDataTo(newMem); // move data with trimming
             mCapacity=newCap; // update capacity
-            if (oldMem) delete[] oldMem; // delete old buffer
+            if (oldMem && mOwnsData) delete[] oldMem; // delete old buffer
+            mOwnsData=true;
             return true;
         }
         else
@@ -337,9 +361,15 @@ public:
         if (mBitsInCache<numBits)
         {
             // read in another 32 bits
-            mCache|=((uint64_t)bswap32(*(uint32_t*)&mBitReservoir[mBytePos]))<<(64-32-mBitsInCache);
+            if (mStuffed)
+            {
+                mCache|=((uint64_t)nextStuffedWord())<<(64-32-mBitsInCache);
+            }else
+            {
+                mCache|=((uint64_t)bswap32(*(uint32_t*)&mBitReservoir[mBytePos]))<<(64-32-mBitsInCache);
+                mBytePos+=4;
+            }
             mBitsInCache+=32;
-            mBytePos+=4;
         }
         return mCache>>(64-numBits);
     }
@@ -364,9 +394,29 @@ public:
         cachedSkipBits(mBitsInCache&7);
     }
 
+    // absolute position of the next cached bit, counted from the start of the reservoir
+    size_t cachedTell() const
+    {
+        return (mBytePos<<3)-mBitsInCache;
+    }
+
+    void cachedSeek(const size_t bitPos)
+    {
+        vassert(mBitPos==0 && (bitPos>>3)<=mEndPos);
+        cacheInit();
+        mBytePos=bitPos>>3;
+        if (bitPos&7)
+        {
+            cachedFrontBits(8);
+            cachedSkipBits(bitPos&7);
+        }
+    }
+
 private:
     uint8_t* mBitReservoir=NULL;
     size_t mCapacity=0;
+    bool mOwnsData=true;
+    bool mStuffed=false;
     size_t mEndPos;
     size_t mBytePos;
     uint8_t mBitPos;
@@ -374,6 +424,23 @@ private:
     uint64_t mCache;
     int mBitsInCache;
 
+    uint32_t nextStuffedWord()
+    {
+        if (mBytePos+4<=mEndPos)
+        {
+            uint32_t word=*(uint32_t*)&mBitReservoir[mBytePos];
+            // no 0xFF byte, nothing to unstuff
+            if (((~word-0x01010101)&word&0x80808080)==0)
+            {
+                mBytePos+=4;
+                return bswap32(word);
+            }
+        }
+        return nextStuffedWordSlow();
+    }
+
+    uint32_t nextStuffedWordSlow();
+
     // adjust pointer when eof is reached, and return current window size
     size_t fixPosition()
     {
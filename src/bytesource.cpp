@@ -0,0 +1,141 @@
+#include "stdafx.h"
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#include "macro.h"
+#include "bytesource.h"
+
+#ifdef _WIN32
+static const uint8_t * map_file(const char * path, size_t &size, void * &mapping)
+{
+    HANDLE file=CreateFileA(path,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+    if (file==INVALID_HANDLE_VALUE) return NULL;
+    const uint8_t *data=NULL;
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file,&file_size) && file_size.QuadPart>0 && (uint64_t)file_size.QuadPart<=(size_t)-1)
+    {
+        mapping=CreateFileMappingA(file,NULL,PAGE_READONLY,0,0,NULL);
+        if (mapping!=NULL)
+        {
+            data=(const uint8_t*)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+            if (data!=NULL)
+                size=(size_t)file_size.QuadPart;
+            else
+            {
+                CloseHandle(mapping);
+                mapping=NULL;
+            }
+        }
+    }
+    CloseHandle(file); // the mapping keeps the file open
+    return data;
+}
+
+static void unmap_file(const uint8_t * data, const size_t size, void * mapping)
+{
+    UnmapViewOfFile(data);
+    CloseHandle(mapping);
+}
+#else
+static const uint8_t * map_file(const char * path, size_t &size, void * &)
+{
+    const int fd=::open(path,O_RDONLY);
+    if (fd<0) return NULL;
+    const uint8_t *data=NULL;
+    struct stat st;
+    if (fstat(fd,&st)==0 && st.st_size>0)
+    {
+        void *addr=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if (addr!=MAP_FAILED)
+        {
+            // the decoder reads the file front to back
+            madvise(addr,st.st_size,MADV_SEQUENTIAL);
+            data=(const uint8_t*)addr;
+            size=st.st_size;
+        }
+    }
+    ::close(fd); // the mapping keeps the file open
+    return data;
+}
+
+static void unmap_file(const uint8_t * data, const size_t size, void *)
+{
+    munmap((void*)data,size);
+}
+#endif // _WIN32
+
+bool ByteSource::open(const char * path, const bool map)
+{
+    close();
+    if (map)
+    {
+        mData=map_file(path,mSize,mMapping);
+        if (mData!=NULL) return true;
+        logputs("[!] unable to map the file, reading it instead");
+    }
+    mFile=fopen(path,"rb");
+    if (mFile==NULL) return false;
+    fseek(mFile,0,SEEK_END);
+    mSize=ftell(mFile);
+    rewind(mFile);
+    return true;
+}
+
+void ByteSource::open(const uint8_t * data, const size_t len)
+{
+    close();
+    mData=data;
+    mSize=len;
+    mBorrowed=true;
+}
+
+void ByteSource::close()
+{
+    if (mData!=NULL)
+    {
+        if (!mBorrowed) unmap_file(mData,mSize,mMapping);
+        mData=NULL;
+        mMapping=NULL;
+        mBorrowed=false;
+    }
+    if (mFile!=NULL)
+    {
+        fclose(mFile);
+        mFile=NULL;
+    }
+    mSize=0;
+    mPos=0;
+}
+
+size_t ByteSource::readSome(void * dst, const size_t len)
+{
+    if (mFile!=NULL)
+        return fread(dst,1,len,mFile);
+    const size_t n=min(len,mSize-mPos);
+    memcpy(dst,&mData[mPos],n);
+    mPos+=n;
+    return n;
+}
+
+bool ByteSource::skip(const long delta)
+{
+    if (mFile!=NULL)
+        return 0==fseek(mFile,delta,SEEK_CUR);
+    if (delta<0 && (size_t)-delta>mPos) return false;
+    return seek(mPos+delta);
+}
+
+bool ByteSource::seek(const size_t pos)
+{
+    if (mFile!=NULL)
+        return 0==fseek(mFile,(long)pos,SEEK_SET);
+    if (pos>mSize) return false;
+    mPos=pos;
+    return true;
+}
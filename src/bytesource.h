@@ -0,0 +1,69 @@
+#ifndef BYTESOURCE_H_INCLUDED
+#define BYTESOURCE_H_INCLUDED
+
+// Input of the decoder: a file read with stdio or mapped into memory, or a buffer of the caller.
+// A mapped file or a buffer is read in place: mappedData() gives the whole input, so the
+// entropy-coded data can be decoded without copying it into a buffer first.
+class ByteSource
+{
+public:
+    ByteSource()
+    {
+    }
+
+    ~ByteSource()
+    {
+        close();
+    }
+
+    // falls back to stdio if the file can't be mapped
+    bool open(const char * path, const bool map);
+    // read from memory owned by the caller, which must stay valid until close()
+    void open(const uint8_t * data, const size_t len);
+    void close();
+
+    // read exactly len bytes
+    bool read(void * dst, const size_t len)
+    {
+        return readSome(dst,len)==len;
+    }
+
+    size_t readSome(void * dst, const size_t len);
+    // move relative to the current position
+    bool skip(const long delta);
+    bool seek(const size_t pos);
+
+    size_t tell() const
+    {
+        return mFile!=NULL?(size_t)ftell(mFile):mPos;
+    }
+
+    size_t size() const
+    {
+        return mSize;
+    }
+
+    bool isMapped() const
+    {
+        return mData!=NULL;
+    }
+
+    // the whole input if it is in memory, NULL otherwise
+    const uint8_t * mappedData() const
+    {
+        return mData;
+    }
+
+private:
+    FILE *mFile=NULL;
+    const uint8_t *mData=NULL;
+    size_t mSize=0;
+    size_t mPos=0;
+    void *mMapping=NULL; // mapping handle on Windows
+    bool mBorrowed=false; // mData belongs to the caller
+
+    ByteSource(const ByteSource&) = delete;
+    ByteSource& operator = (const ByteSource&) = delete;
+};
+
+#endif // BYTESOURCE_H_INCLUDED
@@ -0,0 +1,285 @@
+#include "stdafx.h"
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <cpuid.h>
+#endif
+
+#include "macro.h"
+#include "jpeg.h"
+#include "cpu.h"
+
+const CPU_KERNELS *cpu_kernels=&cpu_kernels_scalar;
+
+static const CPU_KERNELS * const all_kernels[ISA_COUNT]=
+{
+    &cpu_kernels_scalar,
+    &cpu_kernels_sse2,
+    &cpu_kernels_sse41,
+    &cpu_kernels_avx2,
+    &cpu_kernels_avx512
+};
+
+static const char * const isa_names[ISA_COUNT]={"scalar","sse2","sse4.1","avx2","avx512"};
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+static void cpuid(const int leaf, const int subleaf, uint32_t regs[4])
+{
+    int info[4];
+    __cpuidex(info,leaf,subleaf);
+    for (int i=0;i<4;i++)
+        regs[i]=info[i];
+}
+
+static uint64_t read_xcr0()
+{
+    return _xgetbv(0);
+}
+#define HAVE_CPUID
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+static void cpuid(const int leaf, const int subleaf, uint32_t regs[4])
+{
+    if (!__get_cpuid_count(leaf,subleaf,&regs[0],&regs[1],&regs[2],&regs[3]))
+        regs[0]=regs[1]=regs[2]=regs[3]=0;
+}
+
+// xgetbv is used through its opcode bytes for assemblers that don't know it
+static uint64_t read_xcr0()
+{
+    uint32_t eax, edx;
+    __asm__ volatile(".byte 0x0f, 0x01, 0xd0" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx<<32)|eax;
+}
+#define HAVE_CPUID
+#endif
+
+static CpuIsa probe_cpu_isa()
+{
+#ifdef HAVE_CPUID
+    uint32_t regs[4]; // eax, ebx, ecx, edx
+    cpuid(0,0,regs);
+    const uint32_t max_leaf=regs[0];
+    cpuid(1,0,regs);
+    if (!(regs[3]&(1<<26))) return ISA_SCALAR;
+    if (!(regs[2]&(1<<19))) return ISA_SSE2;
+    // AVX registers must also be saved by the OS: OSXSAVE, then XMM and YMM state in XCR0
+    if (!(regs[2]&(1<<27)) || !(regs[2]&(1<<28)) || max_leaf<7) return ISA_SSE41;
+    const uint64_t xcr0=read_xcr0();
+    if ((xcr0&0x06)!=0x06) return ISA_SSE41;
+    cpuid(7,0,regs);
+    if (!(regs[1]&(1<<5))) return ISA_SSE41;
+    // AVX-512F, with the opmask and ZMM state
+    if (!(regs[1]&(1<<16)) || (xcr0&0xE6)!=0xE6) return ISA_AVX2;
+    return ISA_AVX512;
+#else
+    return ISA_SCALAR;
+#endif
+}
+
+CpuIsa detect_cpu_isa()
+{
+    static const CpuIsa isa=probe_cpu_isa();
+    return isa;
+}
+
+const char* cpu_isa_name(const CpuIsa isa)
+{
+    return isa>=ISA_SCALAR && isa<ISA_COUNT?isa_names[isa]:"unknown";
+}
+
+CpuIsa parse_cpu_isa(const char *name)
+{
+    for (int i=0;i<ISA_COUNT;i++)
+    {
+        if (!strcmp(name,isa_names[i]))
+            return (CpuIsa)i;
+    }
+    return ISA_COUNT;
+}
+
+const CPU_KERNELS* select_cpu_kernels(const CpuIsa max_isa)
+{
+    const CpuIsa detected=detect_cpu_isa();
+    if (max_isa!=ISA_COUNT && max_isa>detected)
+        printf("[!] this CPU doesn't support %s\n",cpu_isa_name(max_isa));
+    int isa=min(max_isa,detected);
+    while (isa>ISA_SCALAR && !all_kernels[isa]->compiled)
+        isa--;
+    cpu_kernels=all_kernels[isa];
+    return cpu_kernels;
+}
+
+int usable_cpu_kernels(const CPU_KERNELS *kernels[ISA_COUNT])
+{
+    int count=0;
+    for (int isa=detect_cpu_isa();isa>=ISA_SCALAR;isa--)
+    {
+        if (all_kernels[isa]->compiled)
+            kernels[count++]=all_kernels[isa];
+    }
+    return count;
+}
+
+// an MCU row of 5 MCUs of random samples, with the sampling factors of Y
+static void make_test_row(JPG_DATA &jpg, const int sampling_factor, coef_t (*blocks)[64], uint32_t &seed)
+{
+    memset(&jpg,0,sizeof(jpg));
+    jpg.frame_info.channel_info[0].sampling_factor=sampling_factor;
+    jpg.frame_info.channel_info[1].sampling_factor=0x11;
+    jpg.frame_info.channel_info[2].sampling_factor=0x11;
+    jpg.blks_per_mcu[0]=(sampling_factor>>4)*(sampling_factor&0xF);
+    jpg.blks_per_mcu[1]=jpg.blks_per_mcu[2]=1;
+    jpg.tot_blks_per_mcu=jpg.blks_per_mcu[0]+2;
+    jpg.mcu_width=(sampling_factor>>4)*8;
+    jpg.mcu_height=(sampling_factor&0xF)*8;
+    jpg.mcu_count_w=5;
+    for (int blk=0;blk<jpg.mcu_count_w*jpg.tot_blks_per_mcu;blk++)
+    {
+        for (int i=0;i<64;i++)
+        {
+            seed=seed*1103515245+12345;
+            blocks[blk][i]=(coef_t)((int)((seed>>8)%512)-256); // the range of the IDCT output
+        }
+    }
+}
+
+// a chroma sample of the image of test_fancy_upsampling(), repeated past its edges
+static int test_chroma_sample(const JPG_DATA &jpg, coef_t (* const *rows)[64], const int c, const int x, const int y)
+{
+    const int cw=(jpg.frame_info.img_width+1)/2;
+    const int ch=(jpg.frame_info.channel_info[0].sampling_factor&0xF)==2?(jpg.frame_info.img_height+1)/2:jpg.frame_info.img_height;
+    const int cx=min(max(x,0),cw-1), cy=min(max(y,0),ch-1);
+    const int n=rows[cy>>3][(cx>>3)*jpg.tot_blks_per_mcu+jpg.tot_blks_per_mcu-2+c][((cy&7)<<3)|(cx&7)];
+    return min(max(n,-128),127);
+}
+
+// convert_mcu_row_fancy() on the 3 MCU rows of a cropped image against libjpeg's formulas sample by sample;
+// the upsampled chroma goes into 4:4:4 blocks so that convert_mcu_row() gives the expected pixels
+static void test_fancy_upsampling(const CPU_KERNELS * const *kernels, const int num_kernels, const int sampling_factor, uint32_t &seed)
+{
+    JPG_DATA jpg, full;
+    coef_t (*rows[3])[64];
+    for (int my=0;my<3;my++)
+    {
+        rows[my]=new coef_t[5*6][64];
+        make_test_row(jpg,sampling_factor,rows[my],seed);
+    }
+    jpg.mcu_count_h=3;
+    jpg.frame_info.img_width=(uint16_t)(jpg.mcu_width*jpg.mcu_count_w-3);
+    jpg.frame_info.img_height=(uint16_t)(jpg.mcu_height*jpg.mcu_count_h-5);
+    const bool v2=(sampling_factor&0xF)==2;
+    const int width=jpg.mcu_width*jpg.mcu_count_w;
+    coef_t (*full_row)[64]=new coef_t[10*3][64];
+    make_test_row(full,0x11,full_row,seed);
+    full.mcu_count_w=10;
+    uint32_t *expected=new uint32_t[16*80];
+    uint32_t *out=new uint32_t[16*80];
+    uint32_t *lines[16];
+    for (int my=0;my<3;my++)
+    {
+        for (int band=0;band<jpg.mcu_height/8;band++)
+        {
+            for (int i=0;i<8*width;i++)
+            {
+                const int px=i%width, py=band*8+i/width, gy=my*jpg.mcu_height+py;
+                coef_t *sample=&full_row[(px>>3)*3][((py&7)<<3)|(px&7)];
+                sample[0]=rows[my][(px>>4)*jpg.tot_blks_per_mcu+(py>>3)*(sampling_factor>>4)+((px>>3)&1)][((py&7)<<3)|(px&7)];
+                for (int c=0;c<2;c++)
+                {
+                    const int cx=px>>1;
+                    int nearest[3], farther[3]; // columns cx-1, cx, cx+1
+                    for (int k=0;k<3;k++)
+                    {
+                        nearest[k]=test_chroma_sample(jpg,rows,c,cx+k-1,v2?gy>>1:gy);
+                        farther[k]=v2?test_chroma_sample(jpg,rows,c,cx+k-1,(gy>>1)+((gy&1)?1:-1)):0;
+                    }
+                    int value;
+                    if (v2)
+                    {
+                        const int cs=3*nearest[1]+farther[1];
+                        value=(px&1)?(3*cs+3*nearest[2]+farther[2]+7)>>4:(3*cs+3*nearest[0]+farther[0]+8)>>4;
+                    }
+                    else
+                        value=(px&1)?(3*nearest[1]+nearest[2]+2)>>2:(3*nearest[1]+nearest[0]+1)>>2;
+                    sample[64*(c+1)]=(coef_t)value;
+                }
+            }
+            for (int y=0;y<8;y++)
+                lines[y]=&expected[(band*8+y)*width];
+            const bool converted=cpu_kernels_scalar.convert_mcu_row(full,full_row,lines);
+            assert(converted);
+        }
+        for (int y=0;y<jpg.mcu_height;y++)
+            lines[y]=&out[y*width];
+        const MCU_ROW_CONTEXT context={my,my>0?rows[my-1]:NULL,my<2?rows[my+1]:NULL};
+        for (int k=0;k<num_kernels;k++)
+        {
+            memset(out,0,sizeof(uint32_t)*width*jpg.mcu_height);
+            const bool converted=kernels[k]->convert_mcu_row_fancy(jpg,rows[my],context,lines);
+            assert(converted);
+            assert(!memcmp(out,expected,sizeof(uint32_t)*width*jpg.mcu_height));
+        }
+    }
+    for (int my=0;my<3;my++)
+        delete[] rows[my];
+    delete[] full_row;
+    delete[] expected;
+    delete[] out;
+}
+
+bool test_cpu_kernels()
+{
+    // the colour conversion of every kernel must match the scalar one
+    const CPU_KERNELS *kernels[ISA_COUNT];
+    const int num_kernels=usable_cpu_kernels(kernels);
+    const int sampling_factors[]={0x11,0x22,0x21,0x12};
+    coef_t (*blocks)[64]=new coef_t[5*6][64];
+    uint32_t *expected=new uint32_t[16*80];
+    uint32_t *out=new uint32_t[16*80];
+    uint32_t *expected_lines[16], *out_lines[16];
+    uint32_t seed=11;
+    for (size_t s=0;s<COUNT_OF(sampling_factors);s++)
+    {
+        JPG_DATA jpg;
+        make_test_row(jpg,sampling_factors[s],blocks,seed);
+        const int width=jpg.mcu_width*jpg.mcu_count_w;
+        for (int y=0;y<jpg.mcu_height;y++)
+        {
+            expected_lines[y]=&expected[y*width];
+            out_lines[y]=&out[y*width];
+        }
+        bool converted=cpu_kernels_scalar.convert_mcu_row(jpg,blocks,expected_lines);
+        assert(converted);
+        if (sampling_factors[s]==0x11)
+        {
+            // the fixed-point conversion stays within 1 of the exact formula
+            for (int mx=0;mx<jpg.mcu_count_w;mx++)
+            {
+                for (int i=0;i<64;i++)
+                {
+                    const double Y=blocks[3*mx][i]+128, U=blocks[3*mx+1][i], V=blocks[3*mx+2][i];
+                    const double exact[3]={Y+1.402*V,Y-0.34414*U-0.71414*V,Y+1.772*U};
+                    const uint32_t pixel=expected_lines[i>>3][8*mx+(i&7)];
+                    for (int c=0;c<3;c++)
+                    {
+                        const double e=exact[c]<0?0:(exact[c]>255?255:exact[c]);
+                        assert(fabs((double)((pixel>>(16-8*c))&0xFF)-e)<=1);
+                    }
+                }
+            }
+        }
+        for (int k=0;k<num_kernels;k++)
+        {
+            memset(out,0,sizeof(uint32_t)*width*jpg.mcu_height);
+            converted=kernels[k]->convert_mcu_row(jpg,blocks,out_lines);
+            assert(converted);
+            assert(!memcmp(out,expected,sizeof(uint32_t)*width*jpg.mcu_height));
+        }
+    }
+    test_fancy_upsampling(kernels,num_kernels,0x22,seed);
+    test_fancy_upsampling(kernels,num_kernels,0x21,seed);
+    delete[] blocks;
+    delete[] expected;
+    delete[] out;
+    return true;
+}
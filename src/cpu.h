@@ -0,0 +1,68 @@
+#ifndef CPU_H_INCLUDED
+#define CPU_H_INCLUDED
+
+// instruction sets with their own kernels, each one including the previous ones
+enum CpuIsa
+{
+    ISA_SCALAR,
+    ISA_SSE2,
+    ISA_SSE41,
+    ISA_AVX2,
+    ISA_AVX512,
+    ISA_COUNT
+};
+
+struct JPG_DATA;
+
+// the MCU rows next to the one converted by convert_mcu_row_fancy(), after the IDCT;
+// NULL at the top and the bottom of the image
+struct MCU_ROW_CONTEXT
+{
+    int row; // index of the MCU row being converted
+    const coef_t (*above)[64];
+    const coef_t (*below)[64];
+};
+
+// The stages that are compiled once for every instruction set (see kernels.inc), so that
+// one binary runs the best variant the CPU supports. select_cpu_kernels() binds them.
+struct CPU_KERNELS
+{
+    CpuIsa isa;
+    bool compiled; // false if the compiler couldn't target the instruction set
+    // copy scan bytes up to the next 0xFF, for unstuff_scan_data() which feeds the bit readers;
+    // stops at the 0xFF or before the last partial vector, the scalar kernel copies nothing
+    void (*copy_until_ff)(uint8_t *dst, size_t &out, const uint8_t *src, size_t &in, const size_t len);
+    // Fast_IDCT_Blocks()
+    void (*idct_blocks)(coef_t (*blocks)[64], const uint8_t *eob, const int count);
+    // Float_IDCT_Blocks(), same results for every instruction set
+    void (*idct_blocks_float)(coef_t (*blocks)[64], const uint8_t *eob, const int count);
+    // YCbCr to 0x00RRGGBB for an MCU row after the IDCT, scanlines[y] receiving row y of every MCU;
+    // false if the sampling factors are not supported
+    bool (*convert_mcu_row)(const JPG_DATA &jpg, const coef_t (*row_blocks)[64], uint32_t * const *scanlines);
+    // the same with libjpeg's fancy upsampling of h2v1 and h2v2 chroma, which needs the chroma rows
+    // next to the MCU row; other sampling factors are converted by convert_mcu_row()
+    bool (*convert_mcu_row_fancy)(const JPG_DATA &jpg, const coef_t (*row_blocks)[64], const MCU_ROW_CONTEXT &context, uint32_t * const *scanlines);
+};
+
+extern const CPU_KERNELS cpu_kernels_scalar;
+extern const CPU_KERNELS cpu_kernels_sse2;
+extern const CPU_KERNELS cpu_kernels_sse41;
+extern const CPU_KERNELS cpu_kernels_avx2;
+extern const CPU_KERNELS cpu_kernels_avx512;
+
+// the kernels in use, scalar until select_cpu_kernels() is called
+extern const CPU_KERNELS *cpu_kernels;
+
+// the best instruction set of this CPU, probed with CPUID once
+CpuIsa detect_cpu_isa();
+const char* cpu_isa_name(const CpuIsa isa);
+// "scalar", "sse2", "sse4.1", "avx2" or "avx512", ISA_COUNT for anything else
+CpuIsa parse_cpu_isa(const char *name);
+// bind the best kernels the CPU supports, at most max_isa, ISA_COUNT for no limit
+const CPU_KERNELS* select_cpu_kernels(const CpuIsa max_isa);
+// the kernels this CPU can run, best first; returns their number
+int usable_cpu_kernels(const CPU_KERNELS *kernels[ISA_COUNT]);
+
+bool test_cpu_kernels();
+
+#endif // CPU_H_INCLUDED
@@ -1,14 +1,12 @@
 #include "stdafx.h"
+#include <chrono>
 
 #include "macro.h"
+#include "zigzag.h"
 #include "idct.h"
+#include "cpu.h"
 
-#define W1 2841 /* 2048*sqrt(2)*cos(1*pi/16) */
-#define W2 2676 /* 2048*sqrt(2)*cos(2*pi/16) */
-#define W3 2408 /* 2048*sqrt(2)*cos(3*pi/16) */
-#define W5 1609 /* 2048*sqrt(2)*cos(5*pi/16) */
-#define W6 1108 /* 2048*sqrt(2)*cos(6*pi/16) */
-#define W7 565  /* 2048*sqrt(2)*cos(7*pi/16) */
+extern ZigZag<8,8> zigzag_table;
 
 static int iclip[1024];
 static int *iclp;
@@ -22,7 +20,7 @@ void Initialize_Fast_IDCT()
         iclp[i] = (i<-256) ? -256 : ((i>255) ? 255 : i);
 }
 
-void Fast_IDCT(int * block)
+void Fast_IDCT_Scalar(coef_t * block)
 {
     int i;
 
@@ -33,7 +31,7 @@ void Fast_IDCT(int * block)
         idctcol(block+i);
 }
 
-void idctrow(int * blk)
+void idctrow(coef_t * blk)
 {
     int x0, x1, x2, x3, x4, x5, x6, x7, x8;
     //intcut
@@ -79,7 +77,7 @@ void idctrow(int * blk)
     blk[7] = (x7-x1)>>8;
 }
 //////////////////////////////////////////////////////////////////////////////
-void idctcol(int * blk)
+void idctcol(coef_t * blk)
 {
     int x0, x1, x2, x3, x4, x5, x6, x7, x8;
     //intcut
@@ -125,3 +123,211 @@ void idctcol(int * blk)
     blk[8*6] = iclp[(x3-x2)>>14];
     blk[8*7] = iclp[(x7-x1)>>14];
 }
+
+void Fast_IDCT_Blocks(coef_t (*blocks)[64], const uint8_t *eob, const int count)
+{
+    cpu_kernels->idct_blocks(blocks,eob,count);
+}
+
+void Float_IDCT_Blocks(coef_t (*blocks)[64], const uint8_t *eob, const int count)
+{
+    cpu_kernels->idct_blocks_float(blocks,eob,count);
+}
+
+// 1 + zig-zag index of the last non-zero coefficient, as the entropy decoder records it
+static uint8_t find_eob(const coef_t *block)
+{
+    int k=64;
+    while (k>1 && block[zigzag_table[k-1]]==0)
+        k--;
+    return k;
+}
+
+static double time_idct(void (*idct)(coef_t (*)[64], const uint8_t *, const int), const coef_t (*blocks)[64], const uint8_t *eob, const int count, coef_t (*work)[64], const int rounds)
+{
+    double best=0;
+    for (int round=0;round<rounds;round++)
+    {
+        memcpy(work,blocks,sizeof(coef_t)*64*count);
+        const auto start=std::chrono::steady_clock::now();
+        idct(work,eob,count);
+        const double seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        if (round==0 || seconds<best) best=seconds;
+    }
+    return max(best,1e-9);
+}
+
+// random blocks of quantized coefficients, fewer and smaller towards the high frequencies,
+// dequantized with the luminance table of Annex K scaled to the quality like libjpeg does:
+// the table itself at 50, mostly 1 to 5 at 95; some DC terms go past the range of the samples
+static void make_quantized_blocks(coef_t (*blocks)[64], const int count, const int quality)
+{
+    static const uint8_t luminance[64]=
+    {
+        16, 11, 10, 16, 24, 40, 51, 61,
+        12, 12, 14, 19, 26, 58, 60, 55,
+        14, 13, 16, 24, 40, 57, 69, 56,
+        14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68,109,103, 77,
+        24, 35, 55, 64, 81,104,113, 92,
+        49, 64, 78, 87,103,121,120,101,
+        72, 92, 95, 98,112,100,103, 99
+    };
+    const int scale=quality<50?5000/quality:200-2*quality;
+    uint32_t seed=3;
+    for (int blk=0;blk<count;blk++)
+    {
+        memset(blocks[blk],0,sizeof(blocks[blk]));
+        for (int k=0;k<64;k++)
+        {
+            seed=seed*1103515245+12345;
+            const int r=(seed>>8)&0xFFFF;
+            const int pos=zigzag_table[k];
+            const int q=max((luminance[pos]*scale+50)/100,1);
+            // the same range of samples whatever the table
+            const int range=(k==0?(blk%8?64:150):(k<6?8:(k<20?3:1)))*luminance[pos]/q;
+            if (k==0 || (r&63)<(k<20?32:8))
+                blocks[blk][pos]=(coef_t)((r%(2*range+1)-range)*q);
+        }
+    }
+}
+
+// PSNR of the samples of the float AAN IDCT against those of the integer IDCT, in dB
+static double fast_idct_psnr(const coef_t (*blocks)[64], const int count)
+{
+    coef_t block[64], fast_block[1][64];
+    double error=0;
+    for (int blk=0;blk<count;blk++)
+    {
+        memcpy(block,blocks[blk],sizeof(block));
+        Fast_IDCT_Scalar(block);
+        memcpy(fast_block[0],blocks[blk],sizeof(block));
+        cpu_kernels_scalar.idct_blocks_float(fast_block,NULL,1);
+        for (int i=0;i<64;i++)
+        {
+            const int diff=clamp255(block[i]+128)-clamp255(fast_block[0][i]+128);
+            error+=diff*diff;
+        }
+    }
+    const double mse=error/(64.0*count);
+    return mse>0?10*log10(255*255/mse):99;
+}
+
+void bench_idct(const coef_t (*blocks)[64], const int count)
+{
+    if (count<=0) return;
+    const int rounds=5;
+    coef_t (*work)[64]=new coef_t[count][64];
+    uint8_t *eob=new uint8_t[count];
+    int num_class[IDCT_FULL+1]={0};
+    for (int i=0;i<count;i++)
+    {
+        eob[i]=find_eob(blocks[i]);
+        num_class[idct_class(eob[i])]++;
+    }
+    printf("[ ] IDCT benchmark: %d blocks (%.0f%% DC only, %.0f%% 2x2, %.0f%% 4x4, %.0f%% full), best of %d rounds\n",count,
+           100.0*num_class[IDCT_DC_ONLY]/count,100.0*num_class[IDCT_2X2]/count,100.0*num_class[IDCT_4X4]/count,100.0*num_class[IDCT_FULL]/count,rounds);
+    const CPU_KERNELS *kernels[ISA_COUNT];
+    const int num_kernels=usable_cpu_kernels(kernels);
+    for (int k=0;k<num_kernels;k++)
+    {
+        const double full=time_idct(kernels[k]->idct_blocks,blocks,NULL,count,work,rounds);
+        const double by_class=time_idct(kernels[k]->idct_blocks,blocks,eob,count,work,rounds);
+        printf("[ ] %s: %.1f M blocks/s, by class %.1f M blocks/s\n",cpu_isa_name(kernels[k]->isa),count/full/1e6,count/by_class/1e6);
+    }
+    // the same blocks through the float IDCT, whatever their quantization tables
+    for (int k=0;k<num_kernels;k++)
+    {
+        const double full=time_idct(kernels[k]->idct_blocks_float,blocks,NULL,count,work,rounds);
+        const double by_class=time_idct(kernels[k]->idct_blocks_float,blocks,eob,count,work,rounds);
+        printf("[ ] %s float: %.1f M blocks/s, by class %.1f M blocks/s\n",cpu_isa_name(kernels[k]->isa),count/full/1e6,count/by_class/1e6);
+    }
+    const int psnr_count=2000;
+    coef_t (*quantized)[64]=new coef_t[psnr_count][64];
+    for (int quality=50;quality<=95;quality+=45)
+    {
+        make_quantized_blocks(quantized,psnr_count,quality);
+        printf("[ ] float IDCT: %.1f dB PSNR against the integer IDCT (Annex K luminance table, quality %d)\n",fast_idct_psnr(quantized,psnr_count),quality);
+    }
+    delete[] quantized;
+    delete[] work;
+    delete[] eob;
+}
+
+// the float IDCT against the integer IDCT in test_idct()
+const double FAST_IDCT_MIN_PSNR=55;
+
+bool test_idct()
+{
+    Initialize_Fast_IDCT();
+    // the kernel of every instruction set must match the scalar code bit for bit,
+    // with and without the classes of the blocks
+    // blocks of every class, sparse blocks like in photos, then dense blocks; the
+    // results stay within the range of iclp, with some of them clipped
+    const int count=2001; // not a multiple of the batch sizes
+    const int class_limit[]={1,3,10}; // coefficients in zig-zag order for each class
+    coef_t (*ref)[64]=new coef_t[count][64];
+    coef_t (*expected)[64]=new coef_t[count][64];
+    coef_t (*out)[64]=new coef_t[count][64];
+    uint8_t *eob=new uint8_t[count];
+    uint32_t seed=7;
+    for (int blk=0;blk<count;blk++)
+    {
+        const int kind=blk%6;
+        const bool sparse=kind<4;
+        const int dc_range=sparse?2400:1200;
+        const int ac_range=sparse?32:20;
+        const int density=kind<3?48:(sparse?8:64);
+        const int limit=kind<3?class_limit[kind]:64;
+        memset(ref[blk],0,sizeof(ref[blk]));
+        for (int k=0;k<limit;k++)
+        {
+            seed=seed*1103515245+12345;
+            const int r=(seed>>8)&0xFFFF;
+            const int range=k==0?dc_range:ac_range;
+            if (k==0 || (r&63)<density)
+                ref[blk][zigzag_table[k]]=(coef_t)(r%(2*range+1)-range);
+        }
+        eob[blk]=find_eob(ref[blk]);
+    }
+    memcpy(expected,ref,sizeof(coef_t)*64*count);
+    for (int blk=0;blk<count;blk++)
+        Fast_IDCT_Scalar(expected[blk]);
+    const CPU_KERNELS *kernels[ISA_COUNT];
+    const int num_kernels=usable_cpu_kernels(kernels);
+    for (int k=0;k<num_kernels;k++)
+    {
+        for (int with_eob=0;with_eob<2;with_eob++)
+        {
+            memcpy(out,ref,sizeof(coef_t)*64*count);
+            kernels[k]->idct_blocks(out,with_eob?eob:NULL,count);
+            assert(!memcmp(out,expected,sizeof(coef_t)*64*count));
+        }
+    }
+
+    // the float IDCT on blocks of a coarse and of a fine table: the same for every
+    // instruction set, and close enough to the integer IDCT
+    for (int quality=50;quality<=95;quality+=45)
+    {
+        make_quantized_blocks(ref,count,quality);
+        for (int blk=0;blk<count;blk++)
+            eob[blk]=find_eob(ref[blk]);
+        assert(fast_idct_psnr(ref,count)>=FAST_IDCT_MIN_PSNR);
+        memcpy(expected,ref,sizeof(coef_t)*64*count);
+        cpu_kernels_scalar.idct_blocks_float(expected,NULL,count);
+        for (int k=0;k<num_kernels;k++)
+        {
+            for (int with_eob=0;with_eob<2;with_eob++)
+            {
+                memcpy(out,ref,sizeof(coef_t)*64*count);
+                kernels[k]->idct_blocks_float(out,with_eob?eob:NULL,count);
+                assert(!memcmp(out,expected,sizeof(coef_t)*64*count));
+            }
+        }
+    }
+    delete[] ref;
+    delete[] expected;
+    delete[] out;
+    delete[] eob;
+    return true;
+}
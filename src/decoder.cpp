@@ -2,41 +2,84 @@
 
 #include "macro.h"
 #include "jpeg.h"
+#include "bytesource.h"
 #include "bmp.h"
 #include "bitstream.h"
+#include "bitreader.h"
 #include "huffman.h"
+#include "huffcache.h"
 #include "zigzag.h"
 #include "idct.h"
+#include "decoder.h"
+#include "entropy.h"
+#include "scan.h"
+#include "cpu.h"
+#include "parser.h"
 
 //#define USE_CPU_ONLY
 
-const int DEFAULT_ARY=16;
-typedef HuffmanTree<DEFAULT_ARY,uint8_t> HufTree;
-
 ZigZag<8,8> zigzag_table;
 
-bool is_supported_file(const JPG_DATA &jpg)
+DECODER_OPTIONS decoder_options={HUFFMAN_LOOKUP,BIT_READER_STREAM,1,false,false,false,false,1,false,IDCT_EXACT,PIXEL_BGRA,UPSAMPLE_REPLICATE};
+bool decoder_messages=true;
+
+bool is_valid_file(const JPG_DATA &jpg)
 {
     if (jpg.frame_info.bit_depth!=8)
     {
-        puts("[X] unsupported bit depth");
+        logputs("[X] unsupported bit depth");
+        return false;
+    }
+    if (jpg.frame_info.num_channels<1 || jpg.frame_info.num_channels>3)
+    {
+        logputs("[X] unsupported number of components");
+        return false;
+    }
+    // one scan with every component, in frame order, is all the entropy decoder knows
+    if (jpg.scan_info.num_channels!=jpg.frame_info.num_channels)
+    {
+        logputs("[X] unsupported number of components in the scan");
         return false;
     }
-    if (jpg.frame_info.num_channels!=3 || jpg.scan_info.num_channels!=3)
+    int blocks=0;
+    for (uint8_t i=0;i<jpg.frame_info.num_channels;i++)
+    {
+        const int h=jpg.frame_info.channel_info[i].sampling_factor>>4;
+        const int v=jpg.frame_info.channel_info[i].sampling_factor&0xF;
+        if (h<1 || h>4 || v<1 || v>4)
+        {
+            logputs("[X] invalid sampling factors");
+            return false;
+        }
+        if (jpg.scan_info.channel_data[i].id!=jpg.frame_info.channel_info[i].id)
+        {
+            logputs("[X] scan components out of frame order");
+            return false;
+        }
+        if (jpg.frame_info.channel_info[i].quant_tbl_id>3 || (jpg.scan_info.channel_data[i].huff_tbl_id&0xF)>3 || \
+            (jpg.scan_info.channel_data[i].huff_tbl_id>>4)>3)
+        {
+            logputs("[X] invalid table selector");
+            return false;
+        }
+        blocks+=h*v;
+    }
+    // a single component scan has one block per MCU whatever its sampling factors
+    if (jpg.frame_info.num_channels>1 && blocks>10)
     {
-        puts("[X] unsupported number of components");
+        logputs("[X] too many blocks per MCU");
         return false;
     }
     if (jpg.frame_info.img_width<=0 || jpg.frame_info.img_height<=0)
     {
-        puts("[X] invalid dimensions");
+        logputs("[X] invalid dimensions");
         return false;
     }
     for (uint8_t i=0;i<jpg.frame_info.num_channels;i++)
     {
         if (NULL==jpg.quantization_table[jpg.frame_info.channel_info[i].quant_tbl_id])
         {
-            puts("[X] corrupted file. missing quantization table.");
+            logputs("[X] corrupted file. missing quantization table.");
             return false;
         }
     }
@@ -46,15 +89,27 @@ bool is_supported_file(const JPG_DATA &jpg)
         const uint8_t dcid=jpg.scan_info.channel_data[i].huff_tbl_id>>4;
         if (NULL==jpg.huffman_table[dcid])
         {
-            puts("[X] corrupted file. missing huffman table for DC component.");
+            logputs("[X] corrupted file. missing huffman table for DC component.");
             return false;
         }
         if (NULL==jpg.huffman_table[acid|0x10])
         {
-            puts("[X] corrupted file. missing huffman table for AC component.");
+            logputs("[X] corrupted file. missing huffman table for AC component.");
             return false;
         }
     }
+    return true;
+}
+
+bool is_supported_file(const JPG_DATA &jpg)
+{
+    if (!is_valid_file(jpg))
+        return false;
+    if (jpg.frame_info.num_channels!=3)
+    {
+        logputs("[X] sorry, grayscale images are not supported");
+        return false;
+    }
     if (jpg.frame_info.channel_info[0].sampling_factor==0x22 && \
         jpg.frame_info.channel_info[1].sampling_factor==0x11 && \
         jpg.frame_info.channel_info[2].sampling_factor==0x11)
@@ -65,100 +120,69 @@ bool is_supported_file(const JPG_DATA &jpg)
         jpg.frame_info.channel_info[2].sampling_factor==0x11)
         return true;
 
-    puts("[X] sorry, currently only supports 8-bit YUV 4:1:1 or 4:4:4 format");
+    logputs("[X] sorry, currently only supports 8-bit YUV 4:1:1 or 4:4:4 format");
     return false;
 }
 
-static int inline convert_number(int value, const uint8_t nbits)
-{
-    if (!(value>>(nbits-1))) // sign bit
-    {
-        // negative
-        ++value;
-        value-=1<<nbits;
-        vassert(value!=0);
-    }
-    return value;
-}
-
-static int inline read_number(BitStream& strm, const uint8_t bits)
-{
-    if (bits)
-    {
-        int value=strm.cachedNextBits(bits);
-        return convert_number(value,bits);
-    }else
-    return 0;
-}
+// stuffed data is read from the file in blocks of this size,
+// data for the longest possible MCU is kept in the stream while decoding
+const size_t SCAN_BUFFER_SIZE=4096;
+static_assert(SCAN_BUFFER_SIZE>=SCAN_DATA_PADDING,"the scan buffer must hold the longest MCU");
 
 template <size_t buffer_size>
-static bool read_more_data(BitStream& strm, FILE * const fp)
+static bool read_more_data(BitStream& strm, ByteSource& src)
 {
-    if (strm.getSize()<buffer_size)
+    while (strm.getSize()<buffer_size)
     {
-        uint8_t buffer[buffer_size+1];
-        const size_t tot=fread(buffer,1,buffer_size,fp);
-
-        // for convenience
-        buffer[tot]=0xFF;
-        // find all 0xFFs in the buffer
-        for (size_t left=0;left<tot;left++)
+        uint8_t buffer[buffer_size];
+        size_t tot=src.readSome(buffer,buffer_size);
+        if (tot==0) return false; // end of file
+        size_t len;
+        // unstuff in place
+        size_t consumed=unstuff_scan_data(buffer,&len,buffer,tot,NULL);
+        strm.append(buffer,len);
+        while (tot>0 && consumed==tot-1)
         {
-            const uint8_t* next_ff=(uint8_t*)memchr(&buffer[left],0xFF,tot-left);
-            if (next_ff!=NULL)
-            {
-check_again:
-                const size_t right=next_ff-&buffer[0];
-                switch (*(next_ff+1))
-                {
-                case 0: // produce a 0xFF byte
-                    strm.append(&buffer[left],next_ff+1);
-                    left=right+1;
-                    break;
-                case 0xD9: // EOI
-                    strm.append(&buffer[left],next_ff);
-                    fseek(fp,right-tot,SEEK_CUR);
-                    return false;
-                case 0xFF: // need to read another byte
-                    strm.append(&buffer[left],next_ff);
-                    left=right; // next iteration will start at next_ff+1
-                    if (right==tot-1)
-                    {
-                        // expect one more byte from file
-                        left=tot-1;
-                        next_ff=(uint8_t*)&buffer[tot-1];
-                        if (1==fread(&buffer[tot],1,1,fp))
-                            goto check_again;
-                        else
-                            return false;
-                    }
-                    break;
-                case 0xD0:
-                case 0xD1:
-                case 0xD2:
-                case 0xD3:
-                case 0xD4:
-                case 0xD5:
-                case 0xD6:
-                case 0xD7: // RSTn: keep this mark but drop 0xFF
-                    strm.append(&buffer[left],next_ff);
-                    left=right;
-                    break;
-                default:
-                    return false; // error
-                }
-            }else
-            {
-                // no 0xFF occurred
-                strm.append(&buffer[left],tot-left);
-                break;
-            }
+            // 0xFF at the end of the buffer, the next byte tells what it is
+            buffer[0]=0xFF;
+            if (!src.read(&buffer[1],1)) return false;
+            tot=2;
+            consumed=unstuff_scan_data(buffer,&len,buffer,tot,NULL);
+            strm.append(buffer,len);
+        }
+        if (consumed<tot)
+        {
+            // EOI or another marker: leave it for the parser
+            src.skip((long)consumed-(long)tot);
+            return false;
         }
     }
     return true;
 }
 
-bool decode_init(JPG_DATA &jpg)
+// the entropy decoder has a loop with a fixed block schedule for these layouts
+static McuLayout find_mcu_layout(const JPG_DATA &jpg)
+{
+    const SOF0 &frame=jpg.frame_info;
+    if (jpg.scan_info.num_channels==1 && jpg.blks_per_mcu[0]==1)
+        return MCU_LAYOUT_GRAY;
+    if (jpg.scan_info.num_channels!=3 || frame.num_channels!=3 || \
+        frame.channel_info[1].sampling_factor!=0x11 || frame.channel_info[2].sampling_factor!=0x11)
+        return MCU_LAYOUT_GENERIC;
+    switch (frame.channel_info[0].sampling_factor)
+    {
+    case 0x11:
+        return MCU_LAYOUT_444;
+    case 0x22:
+        return MCU_LAYOUT_420;
+    case 0x21:
+        return MCU_LAYOUT_422;
+    default:
+        return MCU_LAYOUT_GENERIC;
+    }
+}
+
+void init_mcu_layout(JPG_DATA &jpg)
 {
     const SOF0 &frame=jpg.frame_info;
     jpg.mcu_width=0;
@@ -166,8 +190,9 @@ bool decode_init(JPG_DATA &jpg)
     jpg.tot_blks_per_mcu=0;
     for (int i=0;i<frame.num_channels;i++)
     {
-        const int h=frame.channel_info[i].sampling_factor>>4;
-        const int v=frame.channel_info[i].sampling_factor&0xF;
+        // the MCU of a single component scan is one block
+        const int h=frame.num_channels>1?frame.channel_info[i].sampling_factor>>4:1;
+        const int v=frame.num_channels>1?frame.channel_info[i].sampling_factor&0xF:1;
         jpg.mcu_width=max(jpg.mcu_width,h);
         jpg.mcu_height=max(jpg.mcu_height,v);
         jpg.blks_per_mcu[i]=h*v;
@@ -190,7 +215,25 @@ bool decode_init(JPG_DATA &jpg)
     jpg.mcu_count_h=(frame.img_height-1)/jpg.mcu_height+1;
     jpg.mcu_count=jpg.mcu_count_w*jpg.mcu_count_h;
     jpg.blk_count=jpg.tot_blks_per_mcu*jpg.mcu_count;
-    jpg.mcu_data=new coef_t[jpg.mcu_count*jpg.tot_blks_per_mcu][64];
+    jpg.mcu_layout=find_mcu_layout(jpg);
+}
+
+bool decode_init(JPG_DATA &jpg)
+{
+    init_mcu_layout(jpg);
+    // blocks decoded on the device stay dense
+    const bool sparse=decoder_options.sparse_blocks && !decoder_options.device_entropy;
+    if (sparse)
+    {
+        jpg.sparse_data=new SPARSE_BLOCKS;
+        jpg.sparse_data->offset.resize(jpg.blk_count+1);
+        jpg.sparse_data->eob.resize(jpg.blk_count);
+    }
+    else
+    {
+        jpg.mcu_data=new coef_t[jpg.mcu_count*jpg.tot_blks_per_mcu][64];
+        jpg.mcu_eob=new uint8_t[jpg.blk_count];
+    }
 	static_assert(sizeof(jpg.mcu_data) == sizeof(void*) && 64 * sizeof(coef_t) == sizeof(jpg.mcu_data[0]), "inappropratite type");
 #ifdef _MINGW_GCC
 	static_assert(64 * sizeof(coef_t) == ((char*)&jpg.mcu_data[1][0] - (char*)&jpg.mcu_data[0][0]));
@@ -204,11 +247,11 @@ bool decode_init(JPG_DATA &jpg)
         if (!clidct_create()) return false;
 
         puts("[C] clidct_allocate_memory()");
-        if (!clidct_allocate_memory(jpg.blk_count,jpg.frame_info.img_width,jpg.frame_info.img_height,jpg.mcu_width,jpg.mcu_height)) return false;
+        if (!clidct_allocate_memory(jpg.blk_count,jpg.frame_info.img_width,jpg.frame_info.img_height,jpg.mcu_width,jpg.mcu_height,decoder_options.output)) return false;
 
         // build cl program
         puts("[C] clidct_build()");
-        if (!clidct_build(jpg.color_space))
+        if (!clidct_build(jpg.color_space,sparse,jpg.idct_mode,decoder_options.output,decoder_options.upsampling))
         {
             puts("[X] fatal error: failed to build opencl program. check the source code.");
             return false;
@@ -218,156 +261,153 @@ bool decode_init(JPG_DATA &jpg)
     return true;
 }
 
-static bool decode_huffman_block(BitStream& strm, coef_t& last_dc, coef_t coef[64], const HufTree& dc, const HufTree& ac)
+// feed the stream from the file while decoding, unless the whole scan is in memory
+static void inline fetch_scan_data(BitStream &strm, ByteSource &src, bool &not_eof)
 {
-    int count=0;
-    int value;
-    // read in dc component
-    const auto hnode=dc.findCodeInCache(strm);
-    if (hnode==NULL) return false;
-
-    const auto hval=*hnode;
-    assert(hval<=25);
-    value=read_number(strm,hval);
-
-    coef[count++]=(last_dc+=value);
-
-    // read in 63 ac components
-    while (count<64)
+    if (not_eof)
     {
-        const auto hnode=ac.findCodeInCache(strm);
-        if (hnode==NULL) return false;
-
-        const int num_leading_0=(*hnode)>>4;
-        const uint8_t len_val=(*hnode)&0xF;
+        not_eof=read_more_data<SCAN_BUFFER_SIZE>(strm,src);
+    }
+}
 
-        count+=num_leading_0; // skip repeated zeroes
-        assert(count+1<=64);
+static void inline fetch_scan_data(FastBitReader &, ByteSource &, bool &)
+{
+}
 
-        if (len_val==0) // value is 0 in this case
-        {
-            if (num_leading_0==0)
-                break;
-            else
-                count++;
-        }else // value is non-zero
-        {
-            int value=read_number(strm,len_val);
-            coef[count++]=value;
-        }
+template <class HuffDecoder, class Reader, class BlockSink>
+static bool decode_scan(const JPG_DATA &jpg, Reader &strm, ByteSource &src, bool not_eof, BlockSink &sink)
+{
+    // create huffman decoders
+    const HuffDecoderSet<HuffDecoder> htree(jpg);
+    const SCAN_TABLES<HuffDecoder> tables(jpg,htree);
+    SCAN_STATE state;
+    init_scan_state(state);
+    // get more data from file before every MCU, enough for a whole MCU
+    auto next=[&]()
+    {
+        fetch_scan_data(strm,src,not_eof);
+        return true;
+    };
+    if (!decode_mcus(jpg,tables,strm,state,sink,next))
+        return false;
+    if (strm.cacheEof())
+    {
+        printf("[X] data incomplete. (%d/%d mcu)\n",state.mcu_idx,jpg.mcu_count);
+        return false;
     }
-    return count<=64;
+    return true;
 }
 
-bool decode_huffman_data(const JPG_DATA &jpg, FILE * const fp)
+// BitStream reads the scan from the file as it goes, or in place if the file is mapped;
+// FastBitReader reads it from memory, from the mapping or after loading all of it
+template <class HuffDecoder, class BlockSink>
+static bool decode_scan_from(const JPG_DATA &jpg, ByteSource &src, BlockSink &sink)
 {
-    const size_t MIN_BUFFER_SIZE=2048;
-    // create huffman trees
-    HufTree* htree[32]={NULL};
-    for (uint8_t i=0;i<32;i++)
+    const uint8_t * const mapped=src.mappedData();
+    const size_t scan_start=src.tell();
+    const size_t len=src.size()-min(scan_start,src.size());
+    bool ret;
+    if (decoder_options.bit_reader==BIT_READER_FAST)
     {
-        if (jpg.huffman_table[i]!=NULL)
+        uint8_t *buffer=NULL;
+        if (mapped==NULL)
         {
-            htree[i]=new HufTree(jpg.huffman_table[i]->codeword,jpg.huffman_table[i]->value,jpg.huffman_table[i]->num_codeword);
-        }
-    }
-    // init
-    BitStream strm(MIN_BUFFER_SIZE*4);
-    const int& num_channels=jpg.scan_info.num_channels; // here we refer to scan_info because it's releated to huffman decoding
-    bool not_eof=true;
-    int mcu_idx,ch_idx,blk_idx,overall_block_idx=0;
-    int dri_mcu_counter=0,dri_counter=0;
-    // allocate memory for DC coeffs
-    coef_t *dc_coef=new coef_t[num_channels];
-    memset(dc_coef,0,sizeof(coef_t)*num_channels);
-    // init streaming cache
-    strm.cacheInit();
-    // now we can start
-    for (mcu_idx=0;mcu_idx<jpg.mcu_count;mcu_idx++)
-    {
-        // handle DRI
-        if (jpg.dri_info.restart_interval>0 && dri_mcu_counter++==jpg.dri_info.restart_interval)
-        {
-            if (not_eof)
+            buffer=new uint8_t[len+1];
+            if (!src.read(buffer,len))
             {
-                not_eof=read_more_data<MIN_BUFFER_SIZE>(strm,fp);
-            }
-            // read DRI mark
-            strm.cacheAlignToByte();
-            const uint8_t RST=strm.cachedNextBits(8);
-            if (RST!=(uint8_t)0xD0+(dri_counter&7))
-            {
-                printf("[X] expected RST%d (interval = %d; %d/%d mcu)",dri_counter&7,jpg.dri_info.restart_interval,mcu_idx,jpg.mcu_count);
+                puts("[X] failed to read the scan");
+                delete[] buffer;
                 return false;
             }
-            dri_mcu_counter-=jpg.dri_info.restart_interval;
-            dri_counter++;
-            // reset DC coefficients
-            memset(dc_coef,0,sizeof(coef_t)*num_channels);
         }
-        for (ch_idx=0;ch_idx<num_channels;ch_idx++)
+        const uint8_t * const data=mapped!=NULL?mapped+scan_start:buffer;
+        FastBitReader strm(data,len);
+        ret=decode_scan<HuffDecoder>(jpg,strm,src,false,sink);
+        // leave the source at the marker following the scan
+        const size_t pos=strm.getCurrentPos();
+        src.seek(scan_start+pos+find_scan_end(data+pos,len-pos));
+        delete[] buffer;
+    }
+    else
+    {
+        BitStream strm(SCAN_BUFFER_SIZE*4);
+        if (mapped!=NULL)
         {
-            if ((mcu_idx>0 || ch_idx>0) && strm.cacheEof())
-            {
-                printf("[X] data incomplete or buffer too small. (%d/%d mcu)\n",mcu_idx,jpg.mcu_count);
-                return false;
-            }
-            const coef_t * const qt=jpg.quantization_table[jpg.frame_info.channel_info[ch_idx].quant_tbl_id];
-            for (blk_idx=0;blk_idx<jpg.blks_per_mcu[ch_idx];blk_idx++)
-            {
-                // get more data from file
-                if (not_eof)
-                {
-                    not_eof=read_more_data<MIN_BUFFER_SIZE>(strm,fp);
-                }
+            // a mapped file is decoded in place
+            strm.attachStuffed(mapped+scan_start,len);
+        }
+        strm.cacheInit();
+        ret=decode_scan<HuffDecoder>(jpg,strm,src,mapped==NULL,sink);
+        if (mapped!=NULL)
+        {
+            // leave the source at the marker following the scan
+            const size_t pos=min(strm.getCurrentPos(),strm.getEndPos());
+            src.seek(scan_start+pos+find_scan_end(mapped+scan_start+pos,len-pos));
+        }
+    }
+    return ret;
+}
 
-                // determine which huffman tree to use
-                const auto dc=htree[jpg.scan_info.channel_data[ch_idx].huff_tbl_id>>4];
-                const auto ac=htree[0x10|(jpg.scan_info.channel_data[ch_idx].huff_tbl_id&0xF)];
-                vassert(dc!=NULL && ac!=NULL);
+template <class BlockSink>
+static bool decode_scan_into(const JPG_DATA &jpg, ByteSource &src, BlockSink &sink)
+{
+    switch (decoder_options.huffman_decoder)
+    {
+    case HUFFMAN_TREE:
+        return decode_scan_from<HufTree>(jpg,src,sink);
+    case HUFFMAN_LOOKUP:
+    default:
+        return decode_scan_from<HufTable>(jpg,src,sink);
+    }
+}
 
-                coef_t mat[64]={0};
-                coef_t zziq_mat[64];
-                if (!decode_huffman_block(strm,dc_coef[ch_idx],mat,*dc,*ac))
-                {
-                    printf("[X] data corrupted. (%d/%d mcu %d/%d ch %d/%d blk)\n",mcu_idx,jpg.mcu_count,ch_idx,num_channels,blk_idx,jpg.blks_per_mcu[ch_idx]);
-                    goto corrupted;
-                }
-                else
-                {
-                    for (int pos=0;pos<64;pos++)
-                    {
-                        zziq_mat[zigzag_table[pos]]=mat[pos]*qt[pos]; // zig-zag & inverse quantizatize
-                    }
-                    memcpy(&jpg.mcu_data[overall_block_idx++],zziq_mat,sizeof(zziq_mat));
-                }
-            }
+bool decode_huffman_data(const JPG_DATA &jpg, ByteSource &src)
+{
+    bool ret;
+    bool on_device=false;
+    if (decoder_options.threads!=1 || decoder_options.device_entropy || decoder_options.interleave>1 || decoder_options.benchmark)
+    {
+        ret=decode_huffman_data_parallel(jpg,src,on_device);
+    }
+    else
+    {
+        if (jpg.sparse_data!=NULL)
+        {
+            SparseBlockSink sink(*jpg.sparse_data,jpg.sparse_data->value,jpg.sparse_data->pos);
+            ret=decode_scan_into(jpg,src,sink);
+            if (ret) finish_sparse_blocks(*jpg.sparse_data);
+        }
+        else
+        {
+            DenseBlockSink sink(jpg.mcu_data,jpg.mcu_eob);
+            ret=decode_scan_into(jpg,src,sink);
         }
     }
-    goto finished;
-corrupted:
-
-    goto cleanup;
-finished:
+    if (ret && decoder_options.benchmark && jpg.mcu_data!=NULL)
+        bench_idct(jpg.mcu_data,jpg.blk_count);
     #ifndef USE_CPU_ONLY
-        puts("[C] clidct_send()");
-        clock_t timestamp;
-        timestamp=clock();
-        clidct_transfer_data_to_device(jpg.mcu_data,0,jpg.blk_count);
-        printf("Time elapsed for writing data to device: %ld\n",clock()-timestamp);
+        if (ret && !on_device)
+            transfer_blocks_to_device(jpg);
     #endif
-cleanup:
-    // clean
-    for (uint8_t i=0;i<32;i++)
-        if (htree[i]!=NULL)
-            delete htree[i];
-    return mcu_idx==jpg.mcu_count;
+    return ret;
 }
 
-uint32_t YUV_to_RGB32(coef_t Y, coef_t U, coef_t V)
+#ifndef USE_CPU_ONLY
+void transfer_blocks_to_device(const JPG_DATA &jpg)
 {
-    return RGBClamp32((int)(Y+1.402*V+128),(int)(Y-0.34414*U-0.71414*V+128),(int)(Y+1.772*U+128));
+    puts("[C] clidct_send()");
+    clock_t timestamp;
+    timestamp=clock();
+    if (jpg.sparse_data!=NULL)
+    {
+        const SPARSE_BLOCKS &sparse=*jpg.sparse_data;
+        clidct_transfer_sparse_data_to_device(&sparse.offset[0],sparse.eob.data(),sparse.value.data(),sparse.pos.data(),jpg.blk_count,sparse.value.size());
+    }
+    else
+        clidct_transfer_data_to_device(jpg.mcu_data,jpg.mcu_eob,0,jpg.blk_count);
+    printf("Time elapsed for writing data to device: %ld\n",clock()-timestamp);
 }
+#endif
 
 FILE* bmp_create(const char* path, const int width, const int height)
 {
@@ -394,114 +434,257 @@ FILE* bmp_create(const char* path, const int width, const int height)
 	return bmp;
 }
 
-bool decode_mcu_data(const JPG_DATA &jpg, FILE * const fp)
+bool save_bmp(const char* path, const int width, const int height, const uint32_t* pixels)
 {
-    clock_t timestamp;
-    char* image_data=NULL;
-    const size_t image_size=(size_t)jpg.frame_info.img_width*(size_t)jpg.frame_info.img_height*4;
-    #ifndef USE_CPU_ONLY
-        // run IDCT on GPU
-        timestamp=clock();
-        puts("[C] clidct_run()");
-        if (!clidct_run(jpg.color_space)) return false;
-        puts("[C] clidct_wait()");
-        if (!clidct_wait_for_completion()) return false;
-        printf("Time elapsed for running the IDCT kernel: %ld\n",clock()-timestamp);
-        // retrieve output (transformed blocks)
-        timestamp=clock();
-        puts("[C] clidct_recv()");
-        image_data=new char[image_size];
-        if (!clidct_retrieve_image_from_device(image_data,jpg.frame_info.img_width,jpg.frame_info.img_height)) return false;
-        // if (!clidct_retrieve_data_from_device(jpg.mcu_data)) return false;
-        printf("Time elapsed for reading data from device: %ld\n",clock()-timestamp);
-    #endif
+    FILE *bmp=bmp_create(path,width,height);
+    if (bmp==NULL) return false;
+    const bool written=1==fwrite(pixels,(size_t)width*(size_t)height*sizeof(uint32_t),1,bmp);
+    fclose(bmp);
+    return written;
+}
 
-    // creating bmp file
-    FILE *bmp=bmp_create("m:\\output.bmp",jpg.frame_info.img_width,jpg.frame_info.img_height);
-    // allocating memory
-    uint32_t **mcu_scanline=new uint32_t*[jpg.mcu_height];
-    for (int i=0;i<jpg.mcu_height;i++)
+const char* save_image(const DECODED_IMAGE &image)
+{
+    static const char * const paths[]=
     {
-        mcu_scanline[i]=new uint32_t[jpg.mcu_width*jpg.mcu_count_w]; // possibly larger than real width
+        "m:\\output.bmp",
+        "m:\\output.rgba",
+        "m:\\output.rgb",
+        "m:\\output.gray",
+        "m:\\output.yuv",
+        "m:\\output.nv12"
+    };
+    const char *path=paths[image.format];
+    if (image.format==PIXEL_BGRA)
+        return save_bmp(path,image.width,image.height,(const uint32_t*)image.pixels)?path:NULL;
+    // the planes follow each other without padding
+    FILE *fp=fopen(path,"wb");
+    if (fp==NULL) return NULL;
+    const bool written=1==fwrite(image.pixels,image.size,1,fp);
+    fclose(fp);
+    return written?path:NULL;
+}
+
+#ifdef USE_CPU_ONLY
+static inline uint8_t to_sample(const int v)
+{
+    return (uint8_t)min(max(v+128,0),255);
+}
+
+// a scanline of 0x00RRGGBB words from convert_mcu_row() in one of the packed formats
+static void store_scanline(const PixelFormat format, uint8_t *out, const uint32_t *in, const int width)
+{
+    switch (format)
+    {
+    case PIXEL_RGBA:
+        for (int x=0;x<width;x++)
+            ((uint32_t*)out)[x]=((in[x]>>16)&0xFF)|(in[x]&0xFF00)|((in[x]&0xFF)<<16)|0xFF000000u;
+        break;
+    case PIXEL_RGB24:
+        for (int x=0;x<width;x++)
+        {
+            out[x*3]=(uint8_t)(in[x]>>16);
+            out[x*3+1]=(uint8_t)(in[x]>>8);
+            out[x*3+2]=(uint8_t)in[x];
+        }
+        break;
+    default:
+        memcpy(out,in,sizeof(uint32_t)*width);
+        break;
     }
-    /*const*/ coef_t (*mat)[64]=NULL;
-    int overall_block_idx=0;
-    #ifdef USE_CPU_ONLY
-        // initializing
-        const int sample_Y_h=jpg.frame_info.channel_info[0].sampling_factor>>4;
-        const int sample_Y_v=jpg.frame_info.channel_info[0].sampling_factor&0xF;
-        const int sample_Y_n=sample_Y_h*sample_Y_v;
-        const int sample_U_h=jpg.frame_info.channel_info[1].sampling_factor>>4;
-        const int sample_U_v=jpg.frame_info.channel_info[1].sampling_factor&0xF;
-        const int sample_V_h=jpg.frame_info.channel_info[2].sampling_factor>>4;
-        const int sample_V_v=jpg.frame_info.channel_info[2].sampling_factor&0xF;
-        const int sample_YU_h=sample_Y_h/sample_U_h;
-        const int sample_YU_v=sample_Y_v/sample_U_v;
-        const int sample_YV_h=sample_Y_h/sample_V_h;
-        const int sample_YV_v=sample_Y_v/sample_V_v;
-        // iterating through MCUs
-        for (int my=0;my<jpg.mcu_count_h;my++)
+}
+
+// the samples of a block after the IDCT, at (x,y) of a plane and clipped to it
+static void store_block_samples(const coef_t *block, uint8_t *plane, const int pitch, const int x, const int y, const int width, const int height)
+{
+    const int w=min(8,width-x), h=min(8,height-y);
+    if (w==8 && h==8)
+    {
+        // fixed bounds for the compiler to vectorize
+        for (int i=0;i<8;i++)
+        {
+            uint8_t *out=plane+(size_t)(y+i)*pitch+x;
+            for (int j=0;j<8;j++)
+                out[j]=to_sample(block[(i<<3)+j]);
+        }
+        return;
+    }
+    for (int i=0;i<h;i++)
+    {
+        uint8_t *out=plane+(size_t)(y+i)*pitch+x;
+        for (int j=0;j<w;j++)
+            out[j]=to_sample(block[(i<<3)+j]);
+    }
+}
+
+// the planes of an MCU row at the sampling factors of the file: Y for PIXEL_GRAY and PIXEL_NV12,
+// Y Cb Cr for PIXEL_YCBCR
+static void store_mcu_row_planes(const JPG_DATA &jpg, const coef_t (*row_blocks)[64], const int my, DECODED_IMAGE &image)
+{
+    const int num_planes=image.format==PIXEL_YCBCR?image.num_planes:1;
+    int first_blk=0;
+    for (int c=0;c<num_planes;c++)
+    {
+        const int h=jpg.frame_info.channel_info[c].sampling_factor>>4;
+        const int v=jpg.frame_info.channel_info[c].sampling_factor&0xF;
+        for (int mx=0;mx<jpg.mcu_count_w;mx++)
+        {
+            const coef_t (*mat)[64]=&row_blocks[mx*jpg.tot_blks_per_mcu+first_blk];
+            for (int by=0;by<v;by++)
+            {
+                for (int bx=0;bx<h;bx++)
+                    store_block_samples(mat[by*h+bx],image.plane[c],image.pitch[c],(mx*h+bx)<<3,(my*v+by)<<3,image.plane_width[c],image.plane_height[c]);
+            }
+        }
+        first_blk+=jpg.blks_per_mcu[c];
+    }
+}
+
+// the NV12 Cb Cr pairs of an MCU row, each the average of the chroma under its 2x2 pixels, which
+// is the chroma itself with 4:2:0; past the right and bottom edges the padding of the MCUs is averaged in
+static void store_mcu_row_nv12(const JPG_DATA &jpg, const coef_t (*row_blocks)[64], const int my, DECODED_IMAGE &image)
+{
+    const int h_max=jpg.mcu_width>>3, v_max=jpg.mcu_height>>3;
+    const int pairs=jpg.mcu_width>>1; // per MCU and row
+    const int first_row=my*(jpg.mcu_height>>1);
+    const int rows=min(jpg.mcu_height>>1,image.plane_height[1]-first_row);
+    for (int c=1;c<3;c++)
+    {
+        const int h=jpg.frame_info.channel_info[c].sampling_factor>>4;
+        const int v=jpg.frame_info.channel_info[c].sampling_factor&0xF;
+        const coef_t *blocks=row_blocks[jpg.blks_per_mcu[0]+(c==2?jpg.blks_per_mcu[1]:0)];
+        // where the samples under the left and right pixels of every pair are in the blocks of an MCU
+        int col[2][16];
+        for (int x=0;x<(pairs<<1);x++)
+        {
+            const int cx=x*h/h_max;
+            col[x&1][x>>1]=((cx>>3)<<6)|(cx&7);
+        }
+        for (int y=0;y<rows;y++)
         {
-            for (int mx=0;mx<jpg.mcu_count_w;mx++)
+            int row[2];
+            for (int k=0;k<2;k++)
             {
-                mat=&jpg.mcu_data[overall_block_idx];
-                for (int blk=0;blk<jpg.tot_blks_per_mcu;blk++)
+                const int cy=((y<<1)+k)*v/v_max;
+                row[k]=(((cy>>3)*h)<<6)|((cy&7)<<3);
+            }
+            uint8_t *out=image.plane[1]+(size_t)(first_row+y)*image.pitch[1]+c-1;
+            for (int x=0,mx=0;x<image.plane_width[1];mx++)
+            {
+                const coef_t *mat=blocks+(size_t)mx*jpg.tot_blks_per_mcu*64;
+                if (h<<1==h_max && v<<1==v_max)
                 {
-                    Fast_IDCT(mat[blk]);
-                    overall_block_idx++;
+                    // 4:2:0, one sample under the 2x2 pixels
+                    for (int i=0;i<pairs && x<image.plane_width[1];i++,x++)
+                        out[x<<1]=to_sample(mat[row[0]+col[0][i]]);
+                    continue;
                 }
-                // perform color space conversion block by block
-                if (jpg.blks_per_mcu[1]==1 && jpg.blks_per_mcu[2]==1)
+                for (int i=0;i<pairs && x<image.plane_width[1];i++,x++)
                 {
-                    // WARNING: the following code only works in ?:1:1 mode
-                    if (jpg.blks_per_mcu[0]==1)
-                    {
-                        assert(jpg.mcu_width==8 && jpg.mcu_height==8 && sample_Y_n==1);
-                        int pos=0;
-                        for (int y=0;y<jpg.mcu_height;y++)
-                        {
-                            for (int x=0;x<jpg.mcu_width;x++)
-                            {
-                                int Y=mat[0][pos];
-                                int U=mat[1][pos];
-                                int V=mat[2][pos];
-                                mcu_scanline[y][x+(mx<<3)]=YUV_to_RGB32(Y,U,V);
-                                pos++;
-                            }
-                        }
-                    }else
-                    {
-                        for (int y=0;y<jpg.mcu_height;y++)
-                        {
-                            for (int x=0;x<jpg.mcu_width;x++)
-                            {
-                                int Y=mat[(y>>3)*sample_Y_h+(x>>3)][((y&7)<<3)|(x&7)];
-                                int U=mat[sample_Y_n][((y/sample_YU_v)<<3)+x/sample_YU_h];
-                                int V=mat[sample_Y_n+1][((y/sample_YV_v)<<3)+x/sample_YV_h];
-                                mcu_scanline[y][x+mx*jpg.mcu_width]=YUV_to_RGB32(Y,U,V);
-                            }
-                        }
-                    }
-
-                }else
-                {
-                    printf("[X] Unsupported color space.\n");
-                    goto failed;
+                    const int sum=to_sample(mat[row[0]+col[0][i]])+to_sample(mat[row[0]+col[1][i]])+
+                        to_sample(mat[row[1]+col[0][i]])+to_sample(mat[row[1]+col[1][i]]);
+                    out[x<<1]=(uint8_t)((sum+2)>>2);
                 }
             }
-            // write scanline
-            for (int i=0;i<jpg.mcu_height;i++)
-                fwrite(mcu_scanline[i],sizeof(uint32_t),jpg.frame_info.img_width,bmp);
         }
-    #else
-        // GPU Accelerated
-        if (1!=fwrite(image_data,image_size,1,bmp))
+    }
+}
+
+// the blocks of MCU row my after the IDCT; dense rows are transformed in place, unless keep is set because
+// the row is only read for its chroma and will be transformed again, sparse rows are scattered into buffer
+static auto transform_mcu_row(const JPG_DATA &jpg, const int my, coef_t (*buffer)[64], const bool keep) -> coef_t (*)[64]
+{
+    const int blks_per_row=jpg.mcu_count_w*jpg.tot_blks_per_mcu;
+    const int first_blk=my*blks_per_row;
+    coef_t (*row_blocks)[64]=buffer;
+    const uint8_t *row_eob=NULL; // picks the IDCT variant of every block
+    if (jpg.sparse_data!=NULL)
+    {
+        // scatter the coefficients of this MCU row
+        const SPARSE_BLOCKS &sparse=*jpg.sparse_data;
+        memset(buffer,0,sizeof(coef_t)*64*blks_per_row);
+        for (int blk=0;blk<blks_per_row;blk++)
         {
-            puts("[X] Write file error");
+            for (uint32_t i=sparse.offset[first_blk+blk];i<sparse.offset[first_blk+blk+1];i++)
+                buffer[blk][sparse.pos[i]]=sparse.value[i];
+        }
+        row_eob=&sparse.eob[first_blk];
+    }
+    else
+    {
+        if (keep)
+            memcpy(buffer,&jpg.mcu_data[first_blk],sizeof(coef_t)*64*blks_per_row);
+        else
+            row_blocks=&jpg.mcu_data[first_blk];
+        row_eob=&jpg.mcu_eob[first_blk];
+    }
+    // the blocks of an MCU row go through the IDCT together, which lets it work on batches
+    if (jpg.idct_mode==IDCT_FAST)
+        Float_IDCT_Blocks(row_blocks,row_eob,blks_per_row);
+    else
+        Fast_IDCT_Blocks(row_blocks,row_eob,blks_per_row);
+    return row_blocks;
+}
+
+int mcu_rows_read_ahead(const JPG_DATA &jpg, const PixelFormat format)
+{
+    const bool packed=format==PIXEL_BGRA || format==PIXEL_RGBA || format==PIXEL_RGB24;
+    return packed && decoder_options.upsampling==UPSAMPLE_FANCY && jpg.frame_info.channel_info[0].sampling_factor==0x22
+        && jpg.blks_per_mcu[1]==1 && jpg.blks_per_mcu[2]==1?1:0;
+}
+
+bool decode_mcu_rows(const JPG_DATA &jpg, const int first_row, const int end_row, DECODED_IMAGE &image)
+{
+    const bool packed=image.format==PIXEL_BGRA || image.format==PIXEL_RGBA || image.format==PIXEL_RGB24;
+    const bool fancy=decoder_options.upsampling==UPSAMPLE_FANCY;
+    // with fancy upsampling of h2v2 chroma, every MCU row is converted with the rows above and below it
+    const int ahead=mcu_rows_read_ahead(jpg,image.format);
+    // allocating memory
+    uint32_t **mcu_scanline=new uint32_t*[jpg.mcu_height];
+    for (int i=0;i<jpg.mcu_height;i++)
+    {
+        mcu_scanline[i]=new uint32_t[jpg.mcu_width*jpg.mcu_count_w]; // possibly larger than real width
+    }
+    const int blks_per_row=jpg.mcu_count_w*jpg.tot_blks_per_mcu;
+    // sparse MCU rows, and dense ones kept for the next call, are transformed in a buffer;
+    // a row and the rows next to it never share one
+    const int num_buffers=ahead?3:(jpg.sparse_data!=NULL?1:0);
+    coef_t (*buffer)[64]=num_buffers>0?new coef_t[num_buffers*blks_per_row][64]:NULL;
+    auto row_buffer=[&](const int my)
+    {
+        return &buffer[((my-first_row+3)%num_buffers)*blks_per_row];
+    };
+    coef_t (*row_blocks)[64]=NULL, (*above)[64]=NULL, (*below)[64]=NULL;
+    // the row above has been converted by an earlier call and, when dense, transformed in place
+    if (ahead && first_row>0)
+        above=jpg.sparse_data!=NULL?transform_mcu_row(jpg,first_row-1,row_buffer(first_row-1),false):&jpg.mcu_data[(first_row-1)*blks_per_row];
+    // iterating through MCUs
+    int my;
+    for (my=first_row;my<end_row;my++)
+    {
+        row_blocks=my==first_row || !ahead?transform_mcu_row(jpg,my,num_buffers>0?row_buffer(my):NULL,false):below;
+        if (ahead)
+            below=my+1<jpg.mcu_count_h?transform_mcu_row(jpg,my+1,row_buffer(my+1),my+1>=end_row):NULL;
+        if (!packed)
+        {
+            // the YCbCr samples as they are
+            store_mcu_row_planes(jpg,row_blocks,my,image);
+            if (image.format==PIXEL_NV12)
+                store_mcu_row_nv12(jpg,row_blocks,my,image);
+            continue;
+        }
+        // perform color space conversion
+        const MCU_ROW_CONTEXT context={my,above,below};
+        if (!(fancy?cpu_kernels->convert_mcu_row_fancy(jpg,row_blocks,context,mcu_scanline):cpu_kernels->convert_mcu_row(jpg,row_blocks,mcu_scanline)))
+        {
+            printf("[X] Unsupported color space.\n");
             goto failed;
         }
-        overall_block_idx=jpg.blk_count;
-    #endif // USE_CPU_ONLY
+        above=row_blocks;
+        // copy scanlines, the last row of MCUs may extend past the image
+        for (int i=0;i<jpg.mcu_height && my*jpg.mcu_height+i<image.height;i++)
+            store_scanline(image.format,image.plane[0]+(size_t)(my*jpg.mcu_height+i)*image.pitch[0],mcu_scanline[i],image.width);
+    }
     goto finished;
 failed:
 
@@ -510,14 +693,37 @@ finished:
 
 cleanup:
     // clean
-    fclose(bmp);
     for (int i=0;i<jpg.mcu_height;i++)
         delete[] mcu_scanline[i];
     delete[] mcu_scanline;
-    if (image_data) delete[] image_data;
-    #ifndef USE_CPU_ONLY
+    delete[] buffer;
+    return my==end_row;
+}
+#endif // USE_CPU_ONLY
+
+bool decode_mcu_data(const JPG_DATA &jpg, DECODED_IMAGE &image)
+{
+    #ifdef USE_CPU_ONLY
+        return decode_mcu_rows(jpg,0,jpg.mcu_count_h,image);
+    #else
+        // run IDCT on GPU
+        clock_t timestamp=clock();
+        puts("[C] clidct_run()");
+        bool ret=clidct_run(jpg.color_space);
+        puts("[C] clidct_wait()");
+        ret=ret && clidct_wait_for_completion();
+        printf("Time elapsed for running the IDCT kernel: %ld\n",clock()-timestamp);
+        // retrieve output (transformed blocks)
+        if (ret)
+        {
+            timestamp=clock();
+            puts("[C] clidct_recv()");
+            ret=clidct_retrieve_image_from_device(image);
+            // if (!clidct_retrieve_data_from_device(jpg.mcu_data)) return false;
+            printf("Time elapsed for reading data from device: %ld\n",clock()-timestamp);
+        }
         puts("[C] clidct_clean_up()");
         clidct_clean_up();
-    #endif
-    return overall_block_idx==jpg.blk_count;
+        return ret;
+    #endif // USE_CPU_ONLY
 }
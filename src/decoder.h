@@ -1,9 +1,83 @@
 #ifndef DECODER_H_INCLUDED
 #define DECODER_H_INCLUDED
 
+enum HuffmanDecoderType
+{
+    HUFFMAN_TREE,   // 16-ary HuffmanTree, walked one nibble at a time
+    HUFFMAN_LOOKUP  // canonical decoder with a flat lookahead table
+};
+
+enum BitReaderType
+{
+    BIT_READER_STREAM, // BitStream, fed from the file or reading a mapped file in place
+    BIT_READER_FAST    // FastBitReader over the whole scan in memory
+};
+
+struct DECODER_OPTIONS
+{
+    HuffmanDecoderType huffman_decoder;
+    BitReaderType bit_reader; // used by the serial decoder
+    int threads; // threads used for entropy decoding: 1 = serial, 0 = one per core
+    bool device_entropy; // decode Huffman data with OpenCL
+    bool verify_device; // also decode on the CPU and compare the coefficients
+    bool sparse_blocks; // keep only the non-zero coefficients of every block
+    bool map_input; // map the input file and decode the scan in place
+    int interleave; // segments decoded in lockstep by every thread, 1 to MAX_INTERLEAVE
+    bool benchmark; // time the entropy decoder with every interleave factor and the CPU IDCT variants
+    IdctMode idct; // integer IDCT, or the float AAN IDCT
+    PixelFormat output; // layout of the decoded image, colour conversion is skipped for the YCbCr formats
+    ChromaUpsampling upsampling; // of 4:2:0 chroma when converting to RGB
+};
+
+const int MAX_INTERLEAVE=4;
+
+struct DECODED_IMAGE;
+
+extern DECODER_OPTIONS decoder_options;
+
+enum ScanError
+{
+    SCAN_OK,
+    SCAN_BAD_RESTART,   // RSTn missing or out of sequence
+    SCAN_BAD_CODE,      // invalid Huffman code or a run past the end of a block
+    SCAN_TRUNCATED      // the data ended before the last MCU
+};
+
+// everything carried from one MCU to the next, so that a scan can be suspended at any MCU boundary
+struct SCAN_STATE
+{
+    ScanError error; // why decode_mcu() failed
+    int mcu_idx;
+    int overall_block_idx;
+    int dri_mcu_counter;
+    int dri_counter;
+    coef_t dc_coef[3];
+};
+
+// a baseline frame and scan the entropy decoder can walk: 1 to 3 components, any sampling factors
+bool is_valid_file(const JPG_DATA &jpg);
+// a valid file the decoder can also turn into an image
 bool is_supported_file(const JPG_DATA &jpg);
+// MCU size and counts, nothing is allocated
+void init_mcu_layout(JPG_DATA &jpg);
 bool decode_init(JPG_DATA &jpg);
-bool decode_huffman_data(const JPG_DATA &jpg, FILE * const strm);
-bool decode_mcu_data(const JPG_DATA &jpg, FILE * const strm);
+bool decode_huffman_data(const JPG_DATA &jpg, ByteSource &strm);
+bool decode_huffman_data_parallel(const JPG_DATA &jpg, ByteSource &strm, bool &on_device);
+// the image is allocated by alloc_image() with the size of the frame
+bool decode_mcu_data(const JPG_DATA &jpg, DECODED_IMAGE &image);
+#ifdef USE_CPU_ONLY
+// IDCT and color space conversion of the MCU rows [first_row,end_row)
+bool decode_mcu_rows(const JPG_DATA &jpg, const int first_row, const int end_row, DECODED_IMAGE &image);
+// MCU rows past end_row that decode_mcu_rows() reads: 1 for the chroma below the last row with fancy
+// upsampling of h2v2 chroma, unless end_row is the last one
+int mcu_rows_read_ahead(const JPG_DATA &jpg, const PixelFormat format);
+#else
+// send the coefficients decoded on the CPU to the IDCT kernel
+void transfer_blocks_to_device(const JPG_DATA &jpg);
+#endif
+// 32-bit top-down bitmap
+bool save_bmp(const char *path, const int width, const int height, const uint32_t *pixels);
+// PIXEL_BGRA images as a bitmap, the others as their raw planes; returns the name of the file or NULL
+const char* save_image(const DECODED_IMAGE &image);
 
 #endif // DECODER_H_INCLUDED
@@ -0,0 +1,567 @@
+#ifndef ENTROPY_H_INCLUDED
+#define ENTROPY_H_INCLUDED
+
+// Huffman decoding of DCT coefficient blocks, shared by the serial and the parallel decoders
+
+const int DEFAULT_ARY=16;
+typedef HuffmanTree<DEFAULT_ARY,uint8_t> HufTree;
+
+extern ZigZag<8,8> zigzag_table;
+
+static int inline convert_number(int value, const uint8_t nbits)
+{
+    if (!(value>>(nbits-1))) // sign bit
+    {
+        // negative
+        ++value;
+        value-=1<<nbits;
+        vassert(value!=0);
+    }
+    return value;
+}
+
+template <class Reader>
+static int inline read_number(Reader& strm, const uint8_t bits)
+{
+    if (bits)
+    {
+        int value=strm.cachedNextBits(bits);
+        return convert_number(value,bits);
+    }else
+    return 0;
+}
+
+template <class HuffDecoder>
+static HuffDecoder* create_huffman_decoder(void *mem, const HUFFMAN_TABLE &tbl, const bool ac);
+
+template <>
+HufTree* create_huffman_decoder<HufTree>(void *mem, const HUFFMAN_TABLE &tbl, const bool)
+{
+    return new (mem) HufTree(tbl.codeword,tbl.length,tbl.value,tbl.num_codeword);
+}
+
+template <>
+HufTable* create_huffman_decoder<HufTable>(void *mem, const HUFFMAN_TABLE &tbl, const bool ac)
+{
+    HufTable *table=new (mem) HufTable(tbl.count_by_length,tbl.value);
+    if (ac) table->buildFastAC();
+    return table;
+}
+
+// shared decoders are only kept for lookup tables
+template <class HuffDecoder>
+static const HuffDecoder* acquire_cached_huffman_decoder(const HUFFMAN_TABLE &, const bool)
+{
+    return NULL;
+}
+
+template <>
+const HufTable* acquire_cached_huffman_decoder<HufTable>(const HUFFMAN_TABLE &tbl, const bool ac)
+{
+    return huffman_cache_acquire(tbl,ac);
+}
+
+template <class HuffDecoder>
+static void release_cached_huffman_decoder(const HuffDecoder *)
+{
+}
+
+template <>
+void release_cached_huffman_decoder<HufTable>(const HufTable *decoder)
+{
+    huffman_cache_release(decoder);
+}
+
+// decoders for all huffman tables of an image, held from the cache until the set goes;
+// tables the cache cannot hold are built in a single allocation owned by the set
+template <class HuffDecoder>
+class HuffDecoderSet
+{
+public:
+    HuffDecoderSet(const JPG_DATA &jpg):mNum(0)
+    {
+        int num_uncached=0;
+        for (int i=0;i<32;i++)
+        {
+            mDecoder[i]=NULL;
+            mCached[i]=false;
+            if (jpg.huffman_table[i]!=NULL)
+            {
+                mDecoder[i]=acquire_cached_huffman_decoder<HuffDecoder>(*jpg.huffman_table[i],(i&0x10)!=0);
+                mCached[i]=mDecoder[i]!=NULL;
+                if (!mCached[i]) num_uncached++;
+            }
+        }
+        mStorage=(HuffDecoder*)::operator new(sizeof(HuffDecoder)*(num_uncached?num_uncached:1));
+        for (int i=0;i<32;i++)
+        {
+            if (jpg.huffman_table[i]!=NULL && mDecoder[i]==NULL)
+                mDecoder[i]=create_huffman_decoder<HuffDecoder>(&mStorage[mNum++],*jpg.huffman_table[i],(i&0x10)!=0);
+        }
+    }
+
+    ~HuffDecoderSet()
+    {
+        for (int i=0;i<32;i++)
+        {
+            if (mCached[i])
+                release_cached_huffman_decoder<HuffDecoder>(mDecoder[i]);
+        }
+        for (int i=0;i<mNum;i++)
+            mStorage[i].~HuffDecoder();
+        ::operator delete(mStorage);
+    }
+
+    // id: bit 4 is set for AC tables
+    const HuffDecoder* operator [](const int id) const
+    {
+        return mDecoder[id];
+    }
+
+private:
+    HuffDecoder *mStorage;
+    const HuffDecoder *mDecoder[32];
+    bool mCached[32];
+    int mNum;
+
+    HuffDecoderSet(const HuffDecoderSet&) = delete;
+    HuffDecoderSet& operator = (const HuffDecoderSet&) = delete;
+};
+
+// Decoded coefficients are passed to an output as out(zig-zag index, value);
+// zero coefficients are only passed for DC.
+
+// dequantized coefficients in natural order, into a zero-filled block
+struct DenseOutput
+{
+    coef_t *block;
+    const coef_t *qt;
+    int eob;
+    void operator ()(const int k, const coef_t value)
+    {
+        block[zigzag_table[k]]=value*qt[k];
+        eob=k+1;
+    }
+};
+
+// dequantized non-zero coefficients with their positions in natural order
+struct SparseOutput
+{
+    std::vector<coef_t> &value;
+    std::vector<uint8_t> &pos;
+    const coef_t *qt;
+    int eob;
+    void operator ()(const int k, const coef_t v)
+    {
+        if (v==0) return;
+        value.push_back(v*qt[k]);
+        pos.push_back(zigzag_table[k]);
+        eob=k+1;
+    }
+};
+
+// only the DC predictor is updated
+struct DiscardOutput
+{
+    void operator ()(const int, const coef_t) {}
+};
+
+// fused run/size/magnitude decoding, only lookup tables support it
+template <class Reader, class HuffDecoder, class Output>
+static bool inline decode_fast_ac(Reader&, const HuffDecoder&, int&, Output&)
+{
+    return false;
+}
+
+template <class Reader, int lookahead, class Output>
+static bool inline decode_fast_ac(Reader& strm, const CanonicalHuffmanTable<lookahead>& ac, int& count, Output& out)
+{
+    const FastACEntry &fac=ac.fastAC(strm);
+    if (fac.length==0 || count+fac.run>=64) return false;
+    strm.cachedSkipBits(fac.length);
+    count+=fac.run;
+    out(count++,fac.value);
+    return true;
+}
+
+template <class Reader, class HuffDecoder, class Output>
+static bool decode_huffman_block(Reader& strm, coef_t& last_dc, Output& out, const HuffDecoder& dc, const HuffDecoder& ac)
+{
+    int count=0;
+    int value;
+    // read in dc component
+    const int hval=dc.decodeInCache(strm);
+    if (hval<0) return false;
+
+    assert(hval<=25);
+    value=read_number(strm,hval);
+
+    out(count++,last_dc+=value);
+
+    // read in 63 ac components
+    while (count<64)
+    {
+        if (decode_fast_ac(strm,ac,count,out)) continue;
+
+        const int hval=ac.decodeInCache(strm);
+        if (hval<0) return false;
+
+        const int num_leading_0=hval>>4;
+        const uint8_t len_val=hval&0xF;
+
+        count+=num_leading_0; // skip repeated zeroes
+        if (count>63) return false; // run past the end of the block
+
+        if (len_val==0) // value is 0 in this case
+        {
+            if (num_leading_0==0)
+                break;
+            else
+                count++;
+        }else // value is non-zero
+        {
+            int value=read_number(strm,len_val);
+            out(count++,value);
+        }
+    }
+    return count<=64;
+}
+
+enum SymbolResult
+{
+    SYMBOL_ERROR,
+    SYMBOL_MORE,      // the block goes on
+    SYMBOL_BLOCK_END
+};
+
+// decode_huffman_block() one symbol at a time: the DC coefficient when count is 0, an AC
+// run/value otherwise. Several independent streams can be advanced in lockstep this way,
+// so that their dependency chains overlap.
+template <class Reader, class HuffDecoder, class Output>
+static SymbolResult inline decode_huffman_symbol(Reader& strm, coef_t& last_dc, Output& out, const HuffDecoder& dc, const HuffDecoder& ac, int& count)
+{
+    if (count==0)
+    {
+        const int hval=dc.decodeInCache(strm);
+        if (hval<0) return SYMBOL_ERROR;
+        assert(hval<=25);
+        out(count++,last_dc+=read_number(strm,hval));
+        return SYMBOL_MORE;
+    }
+    if (!decode_fast_ac(strm,ac,count,out))
+    {
+        const int hval=ac.decodeInCache(strm);
+        if (hval<0) return SYMBOL_ERROR;
+
+        const int num_leading_0=hval>>4;
+        const uint8_t len_val=hval&0xF;
+
+        count+=num_leading_0; // skip repeated zeroes
+        if (count>63) return SYMBOL_ERROR; // run past the end of the block
+
+        if (len_val==0) // value is 0 in this case
+        {
+            if (num_leading_0==0)
+                return SYMBOL_BLOCK_END;
+            count++;
+        }else // value is non-zero
+        {
+            out(count++,read_number(strm,len_val));
+        }
+    }
+    return count<64?SYMBOL_MORE:SYMBOL_BLOCK_END;
+}
+
+// decode one block into dequantized coefficients in natural order,
+// eob is 1 + the zig-zag index of the last coefficient
+template <class Reader, class HuffDecoder>
+static bool inline decode_block(Reader &strm, coef_t &last_dc, const HuffDecoder &dc, const HuffDecoder &ac, const coef_t * const qt, coef_t block[64], uint8_t &eob)
+{
+    memset(block,0,sizeof(coef_t)*64);
+    DenseOutput out={block,qt,0};
+    if (!decode_huffman_block(strm,last_dc,out,dc,ac))
+        return false;
+    eob=out.eob;
+    return true;
+}
+
+// where decoded blocks and their end-of-block indices are stored, by their index in the image
+class DenseBlockSink
+{
+public:
+    DenseBlockSink(coef_t (*blocks)[64], uint8_t *eob):mBlocks(blocks),mEob(eob)
+    {
+    }
+
+    template <class Reader, class HuffDecoder>
+    bool decode(Reader &strm, coef_t &last_dc, const HuffDecoder &dc, const HuffDecoder &ac, const coef_t * const qt, const int block_idx)
+    {
+        return decode_block(strm,last_dc,dc,ac,qt,mBlocks[block_idx],mEob[block_idx]);
+    }
+
+    // for blocks decoded one symbol at a time: begin() points an output from output() at
+    // a block, the symbols go to the output, then end() completes the block
+    typedef DenseOutput Output;
+
+    Output output() const
+    {
+        const Output out={NULL,NULL,0};
+        return out;
+    }
+
+    void begin(Output &out, const coef_t * const qt, const int block_idx)
+    {
+        memset(mBlocks[block_idx],0,sizeof(coef_t)*64);
+        out.block=mBlocks[block_idx];
+        out.qt=qt;
+        out.eob=0;
+    }
+
+    void end(const Output &out, const int block_idx)
+    {
+        mEob[block_idx]=out.eob;
+    }
+
+private:
+    coef_t (*mBlocks)[64];
+    uint8_t *mEob;
+};
+
+// coefficients are appended to value/pos, which may be local to a segment;
+// the offsets hold coefficient counts until finish_sparse_blocks() is called
+class SparseBlockSink
+{
+public:
+    SparseBlockSink(SPARSE_BLOCKS &blocks, std::vector<coef_t> &value, std::vector<uint8_t> &pos):mBlocks(blocks),mValue(value),mPos(pos)
+    {
+    }
+
+    template <class Reader, class HuffDecoder>
+    bool decode(Reader &strm, coef_t &last_dc, const HuffDecoder &dc, const HuffDecoder &ac, const coef_t * const qt, const int block_idx)
+    {
+        const size_t first=mValue.size();
+        SparseOutput out={mValue,mPos,qt,0};
+        if (!decode_huffman_block(strm,last_dc,out,dc,ac))
+            return false;
+        mBlocks.eob[block_idx]=out.eob;
+        mBlocks.offset[block_idx+1]=mValue.size()-first;
+        return true;
+    }
+
+    typedef SparseOutput Output;
+
+    Output output() const
+    {
+        const Output out={mValue,mPos,NULL,0};
+        return out;
+    }
+
+    void begin(Output &out, const coef_t * const qt, const int)
+    {
+        mFirst=mValue.size();
+        out.qt=qt;
+        out.eob=0;
+    }
+
+    void end(const Output &out, const int block_idx)
+    {
+        mBlocks.eob[block_idx]=out.eob;
+        mBlocks.offset[block_idx+1]=mValue.size()-mFirst;
+    }
+
+private:
+    SPARSE_BLOCKS &mBlocks;
+    std::vector<coef_t> &mValue;
+    std::vector<uint8_t> &mPos;
+    size_t mFirst=0; // first coefficient of the block being decoded one symbol at a time
+};
+
+// blocks are only decoded to check the entropy-coded data
+class DiscardBlockSink
+{
+public:
+    template <class Reader, class HuffDecoder>
+    bool decode(Reader &strm, coef_t &last_dc, const HuffDecoder &dc, const HuffDecoder &ac, const coef_t * const, const int)
+    {
+        DiscardOutput out;
+        return decode_huffman_block(strm,last_dc,out,dc,ac);
+    }
+};
+
+// turn the coefficient counts of blocks [first,end) into offsets, the offsets before them must be final
+static void inline finish_sparse_blocks(SPARSE_BLOCKS &blocks, const size_t first, const size_t end)
+{
+    if (first==0) blocks.offset[0]=0;
+    for (size_t i=first+1;i<=end;i++)
+        blocks.offset[i]+=blocks.offset[i-1];
+}
+
+static void inline finish_sparse_blocks(SPARSE_BLOCKS &blocks)
+{
+    finish_sparse_blocks(blocks,0,blocks.offset.size()-1);
+}
+
+static void inline init_scan_state(SCAN_STATE &state)
+{
+    memset(&state,0,sizeof(state));
+}
+
+// checked before every channel, FastBitReader is only checked at the end of the scan
+static bool inline scan_data_exhausted(BitStream &strm)
+{
+    return strm.cacheEof();
+}
+
+// a flag test per MCU until the cache takes padding, the exact test afterwards
+static bool inline scan_data_exhausted(FastBitReader &strm)
+{
+    return strm.paddingLoaded() && strm.cacheEof();
+}
+
+// Huffman decoders and quantization table of every scan component, bound once per scan
+template <class HuffDecoder>
+struct SCAN_TABLES
+{
+    const HuffDecoder *dc[3];
+    const HuffDecoder *ac[3];
+    const coef_t *qt[3];
+
+    SCAN_TABLES(const JPG_DATA &jpg, const HuffDecoderSet<HuffDecoder> &htree)
+    {
+        for (int ch_idx=0;ch_idx<jpg.scan_info.num_channels;ch_idx++)
+        {
+            qt[ch_idx]=jpg.quantization_table[jpg.frame_info.channel_info[ch_idx].quant_tbl_id];
+            dc[ch_idx]=htree[jpg.scan_info.channel_data[ch_idx].huff_tbl_id>>4];
+            ac[ch_idx]=htree[0x10|(jpg.scan_info.channel_data[ch_idx].huff_tbl_id&0xF)];
+            vassert(dc[ch_idx]!=NULL && ac[ch_idx]!=NULL);
+        }
+    }
+};
+
+// read the RSTn marker due before MCU state.mcu_idx and reset the DC predictors
+template <class Reader>
+static bool read_restart_marker(const JPG_DATA &jpg, Reader &strm, SCAN_STATE &state)
+{
+    strm.cacheAlignToByte();
+    const uint8_t RST=strm.cachedNextBits(8);
+    if (RST!=(uint8_t)0xD0+(state.dri_counter&7))
+    {
+        logprintf("[X] expected RST%d (interval = %d; %d/%d mcu)\n",state.dri_counter&7,jpg.dri_info.restart_interval,state.mcu_idx,jpg.mcu_count);
+        state.error=SCAN_BAD_RESTART;
+        return false;
+    }
+    state.dri_mcu_counter-=jpg.dri_info.restart_interval;
+    state.dri_counter++;
+    memset(state.dc_coef,0,sizeof(state.dc_coef));
+    return true;
+}
+
+// decode the blocks of one component of MCU state.mcu_idx
+template <class HuffDecoder, class Reader, class BlockSink>
+static bool inline decode_mcu_component(const JPG_DATA &jpg, const SCAN_TABLES<HuffDecoder> &tables, Reader &strm, SCAN_STATE &state, BlockSink &sink, const int ch_idx, const int num_blocks)
+{
+    if ((state.mcu_idx>0 || ch_idx>0) && scan_data_exhausted(strm))
+    {
+        logprintf("[X] data incomplete or buffer too small. (%d/%d mcu)\n",state.mcu_idx,jpg.mcu_count);
+        state.error=SCAN_TRUNCATED;
+        return false;
+    }
+    for (int blk_idx=0;blk_idx<num_blocks;blk_idx++)
+    {
+        if (!sink.decode(strm,state.dc_coef[ch_idx],*tables.dc[ch_idx],*tables.ac[ch_idx],tables.qt[ch_idx],state.overall_block_idx++))
+        {
+            logprintf("[X] data corrupted. (%d/%d mcu %d/%d ch %d/%d blk)\n",state.mcu_idx,jpg.mcu_count,ch_idx,jpg.scan_info.num_channels,blk_idx,num_blocks);
+            state.error=SCAN_BAD_CODE;
+            return false;
+        }
+    }
+    return true;
+}
+
+// decode MCU state.mcu_idx, preceded by its RSTn marker if one is due
+// works for any sampling factors, see McuDecoder for the common ones
+template <class HuffDecoder, class Reader, class BlockSink>
+static bool decode_mcu(const JPG_DATA &jpg, const SCAN_TABLES<HuffDecoder> &tables, Reader &strm, SCAN_STATE &state, BlockSink &sink)
+{
+    if (jpg.dri_info.restart_interval>0 && state.dri_mcu_counter++==jpg.dri_info.restart_interval && !read_restart_marker(jpg,strm,state))
+        return false;
+    // here we refer to scan_info because it's releated to huffman decoding
+    for (int ch_idx=0;ch_idx<jpg.scan_info.num_channels;ch_idx++)
+    {
+        if (!decode_mcu_component(jpg,tables,strm,state,sink,ch_idx,jpg.blks_per_mcu[ch_idx]))
+            return false;
+    }
+    state.mcu_idx++;
+    return true;
+}
+
+// decode_mcu() for an MCU of luma_blocks Y blocks followed by one block of each other
+// component, with or without restart intervals; the block schedule is unrolled by the compiler
+template <int luma_blocks, int num_channels, bool restart>
+struct McuDecoder
+{
+    template <class HuffDecoder, class Reader, class BlockSink>
+    static bool decode(const JPG_DATA &jpg, const SCAN_TABLES<HuffDecoder> &tables, Reader &strm, SCAN_STATE &state, BlockSink &sink)
+    {
+        if (restart && state.dri_mcu_counter++==jpg.dri_info.restart_interval && !read_restart_marker(jpg,strm,state))
+            return false;
+        for (int ch_idx=0;ch_idx<num_channels;ch_idx++)
+        {
+            if (!decode_mcu_component(jpg,tables,strm,state,sink,ch_idx,ch_idx==0?luma_blocks:1))
+                return false;
+        }
+        state.mcu_idx++;
+        return true;
+    }
+};
+
+struct GenericMcuDecoder
+{
+    template <class HuffDecoder, class Reader, class BlockSink>
+    static bool decode(const JPG_DATA &jpg, const SCAN_TABLES<HuffDecoder> &tables, Reader &strm, SCAN_STATE &state, BlockSink &sink)
+    {
+        return decode_mcu(jpg,tables,strm,state,sink);
+    }
+};
+
+// decode MCUs while next() allows it, which is asked before every MCU, e.g. to feed the reader
+template <class Decoder, class HuffDecoder, class Reader, class BlockSink, class Next>
+static bool decode_mcu_run(const JPG_DATA &jpg, const SCAN_TABLES<HuffDecoder> &tables, Reader &strm, SCAN_STATE &state, BlockSink &sink, Next &next)
+{
+    while (state.mcu_idx<jpg.mcu_count && next())
+    {
+        if (!Decoder::decode(jpg,tables,strm,state,sink))
+            return false;
+    }
+    return true;
+}
+
+template <int luma_blocks, int num_channels, class HuffDecoder, class Reader, class BlockSink, class Next>
+static bool decode_mcu_run(const JPG_DATA &jpg, const SCAN_TABLES<HuffDecoder> &tables, Reader &strm, SCAN_STATE &state, BlockSink &sink, Next &next)
+{
+    if (jpg.dri_info.restart_interval>0)
+        return decode_mcu_run<McuDecoder<luma_blocks,num_channels,true> >(jpg,tables,strm,state,sink,next);
+    return decode_mcu_run<McuDecoder<luma_blocks,num_channels,false> >(jpg,tables,strm,state,sink,next);
+}
+
+// decode_mcu_run() with the MCU decoder of the layout picked by init_mcu_layout()
+template <class HuffDecoder, class Reader, class BlockSink, class Next>
+static bool decode_mcus(const JPG_DATA &jpg, const SCAN_TABLES<HuffDecoder> &tables, Reader &strm, SCAN_STATE &state, BlockSink &sink, Next &next)
+{
+    switch (jpg.mcu_layout)
+    {
+    case MCU_LAYOUT_444:
+        return decode_mcu_run<1,3>(jpg,tables,strm,state,sink,next);
+    case MCU_LAYOUT_420:
+        return decode_mcu_run<4,3>(jpg,tables,strm,state,sink,next);
+    case MCU_LAYOUT_422:
+        return decode_mcu_run<2,3>(jpg,tables,strm,state,sink,next);
+    case MCU_LAYOUT_GRAY:
+        return decode_mcu_run<1,1>(jpg,tables,strm,state,sink,next);
+    case MCU_LAYOUT_GENERIC:
+    default:
+        return decode_mcu_run<GenericMcuDecoder>(jpg,tables,strm,state,sink,next);
+    }
+}
+
+#endif // ENTROPY_H_INCLUDED
@@ -0,0 +1,325 @@
+#include "stdafx.h"
+#include <mutex>
+
+#include "macro.h"
+#include "jpeg.h"
+#include "bitstream.h"
+#include "huffman.h"
+#include "huffcache.h"
+
+// ITU-T T.81 Annex K.3 typical Huffman tables
+static constexpr uint8_t DC_LUMINANCE_COUNTS[16]={0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
+static constexpr uint8_t DC_LUMINANCE_SYMBOLS[256]={0,1,2,3,4,5,6,7,8,9,10,11};
+
+static constexpr uint8_t DC_CHROMINANCE_COUNTS[16]={0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
+static constexpr uint8_t DC_CHROMINANCE_SYMBOLS[256]={0,1,2,3,4,5,6,7,8,9,10,11};
+
+static constexpr uint8_t AC_LUMINANCE_COUNTS[16]={0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
+static constexpr uint8_t AC_LUMINANCE_SYMBOLS[256]=
+{
+    0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,
+    0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,
+    0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+    0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
+    0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,
+    0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+    0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,
+    0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,
+    0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+    0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+    0xf9,0xfa
+};
+
+static constexpr uint8_t AC_CHROMINANCE_COUNTS[16]={0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
+static constexpr uint8_t AC_CHROMINANCE_SYMBOLS[256]=
+{
+    0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,
+    0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,
+    0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+    0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,
+    0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,
+    0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+    0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,
+    0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,
+    0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+    0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+    0xf9,0xfa
+};
+
+// built at compile time, no runtime construction needed
+static constexpr HufTable DC_LUMINANCE_TABLE(DC_LUMINANCE_COUNTS,DC_LUMINANCE_SYMBOLS,false);
+static constexpr HufTable DC_CHROMINANCE_TABLE(DC_CHROMINANCE_COUNTS,DC_CHROMINANCE_SYMBOLS,false);
+static constexpr HufTable AC_LUMINANCE_TABLE(AC_LUMINANCE_COUNTS,AC_LUMINANCE_SYMBOLS,true);
+static constexpr HufTable AC_CHROMINANCE_TABLE(AC_CHROMINANCE_COUNTS,AC_CHROMINANCE_SYMBOLS,true);
+
+struct HUFFMAN_CACHE_ENTRY
+{
+    uint64_t hash;
+    bool ac;
+    int num_codeword;
+    uint8_t count_by_length[16];
+    uint8_t value[256];
+    const HufTable *table;
+    bool builtin; // points to one of the compile-time tables, never evicted
+    int refs; // decoders still using the table
+    bool referenced; // acquired since the clock hand last passed
+    int next; // next entry of the same bucket, or -1
+};
+
+// a table built at runtime, which knows its entry
+struct CachedHufTable : public HufTable
+{
+    int slot;
+
+    CachedHufTable(const uint8_t countByLength[16], const uint8_t *symbols, const int slot):HufTable(countByLength,symbols),slot(slot) {}
+};
+
+static const int HUFFMAN_CACHE_SIZE=256;
+static const int HUFFMAN_CACHE_BUCKETS=512; // a power of 2
+
+static HUFFMAN_CACHE_ENTRY cache_entries[HUFFMAN_CACHE_SIZE];
+static int cache_buckets[HUFFMAN_CACHE_BUCKETS];
+static int cache_num_entries;
+static int cache_clock_hand;
+static bool cache_initialized;
+static unsigned long cache_hits;
+static unsigned long cache_misses;
+static unsigned long cache_evictions;
+static std::mutex cache_mutex;
+
+// FNV-1a over the table class, DHT counts and symbols
+static uint64_t huffman_table_hash(const uint8_t countByLength[16], const uint8_t *symbols, const int num, const bool ac)
+{
+    uint64_t hash=14695981039346656037ULL;
+    hash=(hash^(ac?1:0))*1099511628211ULL;
+    for (int i=0;i<16;i++)
+        hash=(hash^countByLength[i])*1099511628211ULL;
+    for (int i=0;i<num;i++)
+        hash=(hash^symbols[i])*1099511628211ULL;
+    return hash;
+}
+
+static int &cache_bucket(const uint64_t hash)
+{
+    return cache_buckets[(hash^(hash>>32))&(HUFFMAN_CACHE_BUCKETS-1)];
+}
+
+static void cache_insert(const int slot, const uint8_t countByLength[16], const uint8_t *symbols, const int num, const bool ac, const HufTable *table, const bool builtin)
+{
+    HUFFMAN_CACHE_ENTRY &entry=cache_entries[slot];
+    entry.hash=huffman_table_hash(countByLength,symbols,num,ac);
+    entry.ac=ac;
+    entry.num_codeword=num;
+    memcpy(entry.count_by_length,countByLength,16);
+    memcpy(entry.value,symbols,num);
+    entry.table=table;
+    entry.builtin=builtin;
+    entry.refs=builtin?0:1;
+    entry.referenced=true;
+    int &head=cache_bucket(entry.hash);
+    entry.next=head;
+    head=slot;
+}
+
+static void cache_unlink(const int slot)
+{
+    int *link=&cache_bucket(cache_entries[slot].hash);
+    while (*link!=slot)
+        link=&cache_entries[*link].next;
+    *link=cache_entries[slot].next;
+}
+
+// a slot for a new entry: an unused one, or the first unused table the clock hand finds
+// without a reference since its last pass; -1 if every table is in use
+static int cache_free_slot()
+{
+    if (cache_num_entries<HUFFMAN_CACHE_SIZE)
+        return cache_num_entries++;
+    for (int step=0;step<2*HUFFMAN_CACHE_SIZE;step++)
+    {
+        const int slot=cache_clock_hand;
+        cache_clock_hand=(cache_clock_hand+1)%HUFFMAN_CACHE_SIZE;
+        HUFFMAN_CACHE_ENTRY &entry=cache_entries[slot];
+        if (entry.builtin || entry.refs>0) continue;
+        if (entry.referenced)
+        {
+            entry.referenced=false;
+            continue;
+        }
+        cache_unlink(slot);
+        delete static_cast<const CachedHufTable*>(entry.table);
+        cache_evictions++;
+        return slot;
+    }
+    return -1;
+}
+
+static int count_codewords(const uint8_t countByLength[16])
+{
+    int num=0;
+    for (int i=0;i<16;i++) num+=countByLength[i];
+    return num;
+}
+
+static void cache_init()
+{
+    for (int i=0;i<HUFFMAN_CACHE_BUCKETS;i++)
+        cache_buckets[i]=-1;
+    cache_insert(cache_num_entries++,DC_LUMINANCE_COUNTS,DC_LUMINANCE_SYMBOLS,count_codewords(DC_LUMINANCE_COUNTS),false,&DC_LUMINANCE_TABLE,true);
+    cache_insert(cache_num_entries++,DC_CHROMINANCE_COUNTS,DC_CHROMINANCE_SYMBOLS,count_codewords(DC_CHROMINANCE_COUNTS),false,&DC_CHROMINANCE_TABLE,true);
+    cache_insert(cache_num_entries++,AC_LUMINANCE_COUNTS,AC_LUMINANCE_SYMBOLS,count_codewords(AC_LUMINANCE_COUNTS),true,&AC_LUMINANCE_TABLE,true);
+    cache_insert(cache_num_entries++,AC_CHROMINANCE_COUNTS,AC_CHROMINANCE_SYMBOLS,count_codewords(AC_CHROMINANCE_COUNTS),true,&AC_CHROMINANCE_TABLE,true);
+    cache_clock_hand=0;
+    cache_initialized=true;
+}
+
+static int cache_find(const HUFFMAN_TABLE &tbl, const bool ac, const uint64_t hash)
+{
+    for (int slot=cache_bucket(hash);slot>=0;slot=cache_entries[slot].next)
+    {
+        const HUFFMAN_CACHE_ENTRY &entry=cache_entries[slot];
+        if (entry.hash==hash && entry.ac==ac && entry.num_codeword==tbl.num_codeword && \
+            !memcmp(entry.count_by_length,tbl.count_by_length,16) && \
+            !memcmp(entry.value,tbl.value,tbl.num_codeword))
+            return slot;
+    }
+    return -1;
+}
+
+static bool is_builtin_table(const HufTable *table)
+{
+    return table==&DC_LUMINANCE_TABLE || table==&DC_CHROMINANCE_TABLE || \
+           table==&AC_LUMINANCE_TABLE || table==&AC_CHROMINANCE_TABLE;
+}
+
+const HufTable* huffman_cache_acquire(const HUFFMAN_TABLE &tbl, const bool ac)
+{
+    const uint64_t hash=huffman_table_hash(tbl.count_by_length,tbl.value,tbl.num_codeword,ac);
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (!cache_initialized) cache_init();
+    const int found=cache_find(tbl,ac,hash);
+    if (found>=0)
+    {
+        HUFFMAN_CACHE_ENTRY &entry=cache_entries[found];
+        if (!entry.builtin) entry.refs++;
+        entry.referenced=true;
+        cache_hits++;
+        return entry.table;
+    }
+    cache_misses++;
+    const int slot=cache_free_slot();
+    if (slot<0)
+        return NULL;
+    CachedHufTable *table=new CachedHufTable(tbl.count_by_length,tbl.value,slot);
+    if (ac) table->buildFastAC();
+    cache_insert(slot,tbl.count_by_length,tbl.value,tbl.num_codeword,ac,table,false);
+    return table;
+}
+
+void huffman_cache_release(const HufTable *table)
+{
+    // the compile-time tables are not counted
+    if (is_builtin_table(table)) return;
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    HUFFMAN_CACHE_ENTRY &entry=cache_entries[static_cast<const CachedHufTable*>(table)->slot];
+    assert(entry.table==table && entry.refs>0);
+    entry.refs--;
+}
+
+HUFFMAN_CACHE_STATS huffman_cache_stats()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    HUFFMAN_CACHE_STATS stats;
+    stats.hits=cache_hits;
+    stats.misses=cache_misses;
+    stats.evictions=cache_evictions;
+    stats.entries=cache_num_entries;
+    return stats;
+}
+
+// every table must have been released
+void huffman_cache_clear()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (int i=0;i<cache_num_entries;i++)
+    {
+        assert(cache_entries[i].refs==0);
+        if (!cache_entries[i].builtin)
+            delete static_cast<const CachedHufTable*>(cache_entries[i].table);
+    }
+    cache_num_entries=0;
+    cache_initialized=false;
+    cache_hits=0;
+    cache_misses=0;
+    cache_evictions=0;
+}
+
+// compare a compile-time table against one built at runtime for every 16-bit input
+static bool same_decoding(const HufTable &a, const uint8_t countByLength[16], const uint8_t *symbols, const bool ac)
+{
+    HufTable b(countByLength,symbols);
+    if (ac) b.buildFastAC();
+    for (uint32_t bits=0;bits<0x10000;bits++)
+    {
+        const uint8_t data[4]={(uint8_t)(bits>>8),(uint8_t)bits,0,0};
+        BitStream sa(data,sizeof(data)),sb(data,sizeof(data));
+        sa.cacheInit();
+        sb.cacheInit();
+        const FastACEntry &fa=a.fastAC(sa);
+        const FastACEntry &fb=b.fastAC(sb);
+        if (fa.value!=fb.value || fa.run!=fb.run || fa.length!=fb.length)
+            return false;
+        if (a.decodeInCache(sa)!=b.decodeInCache(sb) || sa.cachedFrontBits(16)!=sb.cachedFrontBits(16))
+            return false;
+    }
+    return true;
+}
+
+bool test_huffman_cache()
+{
+    assert(same_decoding(DC_LUMINANCE_TABLE,DC_LUMINANCE_COUNTS,DC_LUMINANCE_SYMBOLS,false));
+    assert(same_decoding(DC_CHROMINANCE_TABLE,DC_CHROMINANCE_COUNTS,DC_CHROMINANCE_SYMBOLS,false));
+    assert(same_decoding(AC_LUMINANCE_TABLE,AC_LUMINANCE_COUNTS,AC_LUMINANCE_SYMBOLS,true));
+    assert(same_decoding(AC_CHROMINANCE_TABLE,AC_CHROMINANCE_COUNTS,AC_CHROMINANCE_SYMBOLS,true));
+
+    // distinct DC tables of two 1-bit codewords
+    HUFFMAN_TABLE tbl;
+    memset(&tbl,0,sizeof(tbl));
+    tbl.num_codeword=2;
+    tbl.count_by_length[0]=2;
+    #define TEST_TABLE(k) (tbl.value[0]=(uint8_t)(k),tbl.value[1]=(uint8_t)((k)>>8),tbl)
+    huffman_cache_clear();
+    // a held table survives any number of others, which evict each other once released
+    const HufTable *held=huffman_cache_acquire(TEST_TABLE(0),false);
+    for (int k=1;k<=2*HUFFMAN_CACHE_SIZE;k++)
+    {
+        const HufTable *table=huffman_cache_acquire(TEST_TABLE(k),false);
+        assert(table!=NULL);
+        huffman_cache_release(table);
+    }
+    HUFFMAN_CACHE_STATS stats=huffman_cache_stats();
+    assert(stats.entries==HUFFMAN_CACHE_SIZE && stats.evictions>0 && stats.hits==0);
+    const HufTable *again=huffman_cache_acquire(TEST_TABLE(0),false);
+    assert(again==held);
+    huffman_cache_release(again);
+    huffman_cache_release(held);
+    // with every entry held, new tables are left to the caller until one is released
+    huffman_cache_clear();
+    const HufTable *tables[HUFFMAN_CACHE_SIZE];
+    const int num_builtin=4;
+    for (int k=0;k<HUFFMAN_CACHE_SIZE-num_builtin;k++)
+    {
+        tables[k]=huffman_cache_acquire(TEST_TABLE(k),false);
+        assert(tables[k]!=NULL);
+    }
+    const HufTable *overflow=huffman_cache_acquire(TEST_TABLE(HUFFMAN_CACHE_SIZE),false);
+    assert(overflow==NULL);
+    huffman_cache_release(tables[7]);
+    tables[7]=huffman_cache_acquire(TEST_TABLE(HUFFMAN_CACHE_SIZE),false);
+    assert(tables[7]!=NULL && huffman_cache_stats().evictions==1);
+    for (int k=0;k<HUFFMAN_CACHE_SIZE-num_builtin;k++)
+        huffman_cache_release(tables[k]);
+    #undef TEST_TABLE
+    huffman_cache_clear();
+    return true;
+}
@@ -0,0 +1,26 @@
+#ifndef HUFFCACHE_H_INCLUDED
+#define HUFFCACHE_H_INCLUDED
+
+const int HUFFMAN_LOOKAHEAD=9;
+typedef CanonicalHuffmanTable<HUFFMAN_LOOKAHEAD> HufTable;
+
+struct HUFFMAN_CACHE_STATS
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    int entries;
+};
+
+// returns a shared decoder for the table, to be given back with huffman_cache_release(),
+// or NULL if every cached table is in use. Lookups go through a hash index; when the cache
+// is full, a clock sweep evicts a table no decoder holds and none acquired recently.
+const HufTable* huffman_cache_acquire(const HUFFMAN_TABLE &tbl, const bool ac);
+void huffman_cache_release(const HufTable *table);
+HUFFMAN_CACHE_STATS huffman_cache_stats();
+void huffman_cache_clear();
+
+// unit tests
+bool test_huffman_cache();
+
+#endif // HUFFCACHE_H_INCLUDED
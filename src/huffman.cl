@@ -0,0 +1,188 @@
+// Huffman decoding of independent entropy-coded segments, one segment per work item.
+// HUFFMAN_LOOKAHEAD is defined by the host when the program is built.
+// The output blocks are dequantized and in natural order, as consumed by idct8x8.cl.
+
+#ifdef COEF_INT16
+typedef short coef_t;
+#else
+typedef int coef_t;
+#endif
+
+typedef struct
+{
+    ushort lookup[1<<HUFFMAN_LOOKAHEAD]; // (code length<<8)|symbol, 0 for longer codes
+    int max_code[18];
+    int val_offset[18];
+    uchar symbols[256];
+} huffman_table;
+
+typedef struct
+{
+    int dc_table;
+    int ac_table;
+    int quant_table;
+    int channel;
+} mcu_block_info;
+
+typedef struct
+{
+    ulong bit_pos;
+    ulong end_bit_pos;
+    int mcu_blk;
+    int first_block;
+    int num_blocks;
+    int dc_coef[4];
+} entropy_segment;
+
+constant uchar zigzag[64]=
+{
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// same caching scheme as BitStream::cachedFrontBits()
+typedef struct
+{
+    global const uchar *data;
+    ulong byte_pos;
+    ulong cache;
+    int bits;
+} bit_reader;
+
+// 0 < num_bits <= 32
+uint front_bits(bit_reader *r, const int num_bits)
+{
+    if (r->bits<num_bits)
+    {
+        global const uchar *p=r->data+r->byte_pos;
+        const uint word=((uint)p[0]<<24)|((uint)p[1]<<16)|((uint)p[2]<<8)|(uint)p[3];
+        r->cache|=(ulong)word<<(32-r->bits);
+        r->bits+=32;
+        r->byte_pos+=4;
+    }
+    return (uint)(r->cache>>(64-num_bits));
+}
+
+void skip_bits(bit_reader *r, const int num_bits)
+{
+    r->cache<<=num_bits;
+    r->bits-=num_bits;
+}
+
+ulong tell_bits(const bit_reader *r)
+{
+    return (r->byte_pos<<3)-r->bits;
+}
+
+void seek_bits(bit_reader *r, const ulong bit_pos)
+{
+    r->byte_pos=bit_pos>>3;
+    r->cache=0;
+    r->bits=0;
+    if (bit_pos&7)
+    {
+        front_bits(r,8);
+        skip_bits(r,bit_pos&7);
+    }
+}
+
+// returns the decoded symbol, or -1 if the codeword is not found
+int decode_symbol(bit_reader *r, global const huffman_table *t)
+{
+    const uint peek=front_bits(r,16);
+    const ushort entry=t->lookup[peek>>(16-HUFFMAN_LOOKAHEAD)];
+    if (entry!=0)
+    {
+        skip_bits(r,entry>>8);
+        return entry&0xFF;
+    }
+    for (int len=HUFFMAN_LOOKAHEAD+1;len<=16;len++)
+    {
+        const int code=peek>>(16-len);
+        if (code<=t->max_code[len])
+        {
+            skip_bits(r,len);
+            return t->symbols[t->val_offset[len]+code];
+        }
+    }
+    return -1;
+}
+
+int receive_extend(bit_reader *r, const int num_bits)
+{
+    if (num_bits==0) return 0;
+    int value=front_bits(r,num_bits);
+    skip_bits(r,num_bits);
+    if (value<(1<<(num_bits-1)))
+        value-=(1<<num_bits)-1; // negative
+    return value;
+}
+
+// eob is set to 1 + the zig-zag index of the last coefficient, which picks the IDCT variant
+bool decode_block(bit_reader *r, global const huffman_table *dc, global const huffman_table *ac, global const int *qt, int *last_dc, global coef_t *out, global uchar *eob)
+{
+    for (int k=0;k<64;k++)
+        out[k]=0;
+
+    int symbol=decode_symbol(r,dc);
+    if (symbol<0 || symbol>16) return false;
+    *last_dc+=receive_extend(r,symbol);
+    out[0]=*last_dc*qt[0];
+
+    int last=1;
+    for (int k=1;k<64;)
+    {
+        symbol=decode_symbol(r,ac);
+        if (symbol<0) return false;
+        const int run=symbol>>4;
+        const int size=symbol&0xF;
+        k+=run;
+        if (k>63) return false; // run past the end of the block
+        if (size==0)
+        {
+            if (run==0) break; // EOB
+            k++;
+        }else
+        {
+            out[zigzag[k]]=receive_extend(r,size)*qt[k];
+            last=++k;
+        }
+    }
+    *eob=last;
+    return true;
+}
+
+// status[i] is 0 if segment i was decoded, otherwise 1 + the index of the failed block in it
+kernel void decode_segments(global const uchar *scan, global const entropy_segment *segments, const int num_segments,
+                            global const huffman_table *tables, constant mcu_block_info *layout, const int num_mcu_blks,
+                            global const int *quant, global coef_t *blocks, global uchar *block_eob, global int *status)
+{
+    for (int i=get_global_id(0);i<num_segments;i+=get_global_size(0))
+    {
+        global const entropy_segment *seg=segments+i;
+        bit_reader r;
+        r.data=scan;
+        seek_bits(&r,seg->bit_pos);
+        int dc_coef[4]={seg->dc_coef[0],seg->dc_coef[1],seg->dc_coef[2],seg->dc_coef[3]};
+        int mcu_blk=seg->mcu_blk;
+        int result=0;
+        for (int n=0;n<seg->num_blocks;n++)
+        {
+            constant mcu_block_info *blk=layout+mcu_blk;
+            const int block_idx=seg->first_block+n;
+            if (!decode_block(&r,tables+blk->dc_table,tables+blk->ac_table,quant+(blk->quant_table<<6),&dc_coef[blk->channel],blocks+(block_idx<<6),block_eob+block_idx) || tell_bits(&r)>seg->end_bit_pos)
+            {
+                result=n+1;
+                break;
+            }
+            if (++mcu_blk==num_mcu_blks) mcu_blk=0;
+        }
+        status[i]=result;
+    }
+}
@@ -22,5 +22,34 @@ bool test_huffman()
     tree2.addCode("010",3,123);
     assert(tree2["00"]==567);
     assert(tree2["010"]==123);
+
+    // canonical codes: 00 -> 5, 010 -> 7, 011000000000 -> 9
+    const uint8_t counts[16]={0,1,1,0,0,0,0,0,0,0,0,1,0,0,0,0};
+    const uint8_t symbols[3]={5,7,9};
+    CanonicalHuffmanTable<9> table(counts,symbols);
+    BitStream bs1("00"),bs2("0100"),bs3("011000000000"),bs4("1111111111111111");
+    bs1.cacheInit();
+    bs2.cacheInit();
+    bs3.cacheInit();
+    bs4.cacheInit();
+    assert(table.decodeInCache(bs1)==5);
+    assert(table.decodeInCache(bs2)==7);
+    assert(table.decodeInCache(bs3)==9); // longer than the lookahead
+    assert(table.decodeInCache(bs4)==-1);
+
+    // AC run/size: 00 -> 0x01, 01 -> 0x22, 10 -> 0x00 (EOB)
+    const uint8_t ac_counts[16]={0,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+    const uint8_t ac_symbols[3]={0x01,0x22,0x00};
+    CanonicalHuffmanTable<9> ac_table(ac_counts,ac_symbols);
+    ac_table.buildFastAC();
+    BitStream bs5("000"),bs6("0101"),bs7("10");
+    bs5.cacheInit();
+    bs6.cacheInit();
+    bs7.cacheInit();
+    const FastACEntry &fac5=ac_table.fastAC(bs5);
+    assert(fac5.length==3 && fac5.run==0 && fac5.value==-1);
+    const FastACEntry &fac6=ac_table.fastAC(bs6);
+    assert(fac6.length==4 && fac6.run==2 && fac6.value==-2);
+    assert(ac_table.fastAC(bs7).length==0);
     return true;
 }
@@ -3,11 +3,62 @@
 
 #include "bitstream.h"
 
+// allocates nodes in chunks and releases all of them at once
+template <class NodeType>
+class HuffmanNodePool
+{
+public:
+    HuffmanNodePool():mHead(NULL)
+    {
+    }
+
+    ~HuffmanNodePool()
+    {
+        while (mHead!=NULL)
+        {
+            Chunk * const next=mHead->next;
+            for (size_t i=0;i<mHead->used;i++)
+                ((NodeType*)mHead->storage)[i].~NodeType();
+            delete mHead;
+            mHead=next;
+        }
+    }
+
+    // returns uninitialized memory for one node (to be used with placement new)
+    void* allocate()
+    {
+        if (mHead==NULL || mHead->used==CHUNK_SIZE)
+        {
+            Chunk * const chunk=new Chunk;
+            chunk->next=mHead;
+            chunk->used=0;
+            mHead=chunk;
+        }
+        return &((NodeType*)mHead->storage)[mHead->used++];
+    }
+
+private:
+    enum {CHUNK_SIZE=64};
+
+    struct Chunk
+    {
+        Chunk *next;
+        size_t used;
+        alignas(NodeType) uint8_t storage[CHUNK_SIZE*sizeof(NodeType)];
+    };
+
+    Chunk *mHead;
+
+    HuffmanNodePool(const HuffmanNodePool&) = delete;
+    HuffmanNodePool& operator = (const HuffmanNodePool&) = delete;
+};
+
 template <int ary, typename DataTp>
 class HuffmanTreeNode
 {
 public:
     typedef HuffmanTreeNode<ary, DataTp> NodeType, SelfType;
+    typedef HuffmanNodePool<NodeType> PoolType;
 
     HuffmanTreeNode(const NodeType * parent):mParent(parent)
     {
@@ -16,7 +67,7 @@ public:
     }
 
     // initialize a leaf node
-    HuffmanTreeNode(const NodeType * parent, const DataTp& data, const char * code, const size_t len):mParent(parent)
+    HuffmanTreeNode(const NodeType * parent, const DataTp& data, const uint32_t code, const size_t len):mParent(parent)
     {
         assert(parent!=NULL);
         mNumChildren = -1;
@@ -47,7 +98,7 @@ public:
         return *mChildren[idx];
     }
 
-    NodeType& createSubTree(const int idx)
+    NodeType& createSubTree(const int idx, PoolType& pool)
     {
         vassert(idx>=0 && idx<ary);
         assert(!isLeaf());
@@ -61,18 +112,18 @@ public:
         {
             ++mNumChildren;
             assert(mNumChildren<=ary);
-            return *(mChildren[idx]=new NodeType(this));
+            return *(mChildren[idx]=new (pool.allocate()) NodeType(this));
         }
     }
 
-    NodeType& createLeaf(const int idx, const DataTp& data, const char * code, const size_t codelen)
+    NodeType& createLeaf(const int idx, const DataTp& data, const uint32_t code, const size_t codelen, PoolType& pool)
     {
         vassert(idx>=0 && idx<ary);
         assert(!isLeaf() && mChildren[idx]==NULL);
 
         ++mNumChildren;
         assert(mNumChildren<=ary);
-        return *(mChildren[idx]=new NodeType(this,data,code,codelen));
+        return *(mChildren[idx]=new (pool.allocate()) NodeType(this,data,code,codelen));
     }
 
     bool isLeaf() const
@@ -107,7 +158,7 @@ private:
     const NodeType * const mParent;
     DataTp mData;
 
-    const char* mCode;
+    uint32_t mCode;
     size_t mCodeLength;
 };
 
@@ -129,19 +180,16 @@ public:
     }
 
     // import huffman table
-    HuffmanTree(const char* const* code, const DataType* val, const size_t num):mRoot(NULL)
+    HuffmanTree(const uint16_t* code, const uint8_t* len, const DataType* val, const size_t num):mRoot(NULL)
     {
         calc_lg2();
         for (size_t i=0;i<num;i++)
         {
-            addCode(code[i],strlen(code[i]),val[i]);
+            addCode(code[i],len[i],val[i]);
         }
     }
 
-    ~HuffmanTree()
-    {
-        // TODO: clean
-    }
+    // all nodes but the root are released along with mPool
 
     // conversion to NodeType (the way to retrieve root node)
     operator NodeType&()
@@ -149,12 +197,27 @@ public:
         return mRoot;
     }
 
-    void addCode(const char * hcode, const size_t hlen, const DataType& hval);
+    void addCode(const uint32_t hcode, const size_t hlen, const DataType& hval);
+
+    void addCode(const char * hcode, const size_t hlen, const DataType& hval)
+    {
+        assert(strlen(hcode)==hlen);
+        addCode(binToDec(hcode,hlen),hlen,hval);
+    }
 
     const NodeType* findCode(BitStream& strm) const;
 
-    // cached version
-    const NodeType* findCodeInCache(BitStream& strm) const;
+    // cached version, also used with other readers that have the cached interface
+    template <class Reader>
+    const NodeType* findCodeInCache(Reader& strm) const;
+
+    // returns the decoded symbol, or -1 if the codeword is not found
+    template <class Reader>
+    int decodeInCache(Reader& strm) const
+    {
+        const NodeType* node=findCodeInCache(strm);
+        return node!=NULL?(int)(const DataType&)*node:-1;
+    }
 
     const DataType& operator [](const char * hcode) const
     {
@@ -170,10 +233,22 @@ public:
     }
 
 protected:
+    typename NodeType::PoolType mPool;
     NodeType mRoot;
 
 private:
     unsigned mLg2;
+
+    static int binToDec(const char * bin, const size_t len)
+    {
+        int ret=0;
+        for (size_t i=0;i<len;i++)
+        {
+            ret=(ret<<1)|(bin[i]=='1');
+        }
+        return ret;
+    }
+
     void calc_lg2()
     {
         for (mLg2=0;(1<<(uint8_t)mLg2)<ary;mLg2++);
@@ -187,21 +262,10 @@ private:
 
 // though it's extremely ugly, the implementation must be put in this header file
 
-int inline binToDec(const char * bin, const size_t len)
-{
-    int ret=0;
-    for (size_t i=0;i<len;i++)
-    {
-        ret=(ret<<1)|(bin[i]=='1');
-    }
-    return ret;
-}
-
 template <int a, class T>
 void
-HuffmanTree<a,T>::addCode(const char * hcode, const size_t hlen, const T& hval)
+HuffmanTree<a,T>::addCode(const uint32_t hcode, const size_t hlen, const T& hval)
 {
-    assert(strlen(hcode)==hlen);
     assert(hlen>0 && hlen<=32);
 
     auto *node=&mRoot;
@@ -209,21 +273,21 @@ HuffmanTree<a,T>::addCode(const char * hcode, const size_t hlen, const T& hval)
     {
         if (hlen-pos==mLg2) //  the last few digits
         {
-            node=&(node->createLeaf(binToDec(&hcode[pos],mLg2),hval,hcode,hlen));
+            node=&(node->createLeaf(hcode&(a-1),hval,hcode,hlen,mPool));
         }
         else if (hlen-pos>mLg2)
         {
-            node=&(node->createSubTree(binToDec(&hcode[pos],mLg2)));
+            node=&(node->createSubTree((hcode>>(hlen-pos-mLg2))&(a-1),mPool));
         }
         else
         {
             auto &tmpNode=*node;
             int high,low;
-            high=low=binToDec(&hcode[pos],hlen-pos)<<(mLg2-(hlen-pos)); // padding with 0s
+            high=low=(hcode&((1<<(hlen-pos))-1))<<(mLg2-(hlen-pos)); // padding with 0s
             high|=(1<<(mLg2-(hlen-pos)))-1; // padding with 1s
             vassert(low<high);
 
-            node=&(node->createLeaf(low,hval,hcode,hlen));
+            node=&(node->createLeaf(low,hval,hcode,hlen,mPool));
             for (int i=low+1;i<=high;i++)
             {
                 assert(tmpNode[i]==NULL);
@@ -275,8 +339,9 @@ HuffmanTree<a,T>::findCode(BitStream& strm) const
 }
 
 template <int a, class T>
+template <class Reader>
 const HuffmanTreeNode<a,T>*
-HuffmanTree<a,T>::findCodeInCache(BitStream& strm) const
+HuffmanTree<a,T>::findCodeInCache(Reader& strm) const
 {
 	const size_t NUM_BITS_READ_ONCE = 16;
     size_t count=0, totRead=0;
@@ -313,6 +378,243 @@ HuffmanTree<a,T>::findCodeInCache(BitStream& strm) const
     return node;
 }
 
+// run/size/magnitude of a JPEG AC coefficient decoded in one step
+struct FastACEntry
+{
+    int16_t value; // sign-extended coefficient
+    uint8_t run; // number of preceding zeroes
+    uint8_t length; // code length plus magnitude bits, 0 if the entry can't be used
+};
+
+// compile-time integer sequence (std::index_sequence requires C++14)
+template <int... I>
+struct IndexSequence
+{
+};
+
+template <class A, class B>
+struct __CONCAT_SEQUENCE;
+
+template <int... A, int... B>
+struct __CONCAT_SEQUENCE<IndexSequence<A...>, IndexSequence<B...> >
+{
+    typedef IndexSequence<A..., ((int)sizeof...(A)+B)...> type;
+};
+
+// e.g. MakeIndexSequence<3>::type=IndexSequence<0,1,2>
+template <int N>
+struct MakeIndexSequence
+{
+    typedef typename __CONCAT_SEQUENCE<typename MakeIndexSequence<N/2>::type, typename MakeIndexSequence<N-N/2>::type>::type type;
+};
+
+template <>
+struct MakeIndexSequence<0>
+{
+    typedef IndexSequence<> type;
+};
+
+template <>
+struct MakeIndexSequence<1>
+{
+    typedef IndexSequence<0> type;
+};
+
+// constexpr counterparts of CanonicalHuffmanTable::build() and buildFastAC()
+struct __CANONICAL_HUFFMAN
+{
+    // the first codeword of the given length
+    static constexpr int32_t firstCode(const uint8_t* counts, const int len)
+    {
+        return len<=1?0:(firstCode(counts,len-1)+counts[len-2])<<1;
+    }
+
+    // the number of codewords shorter than len
+    static constexpr int32_t firstIndex(const uint8_t* counts, const int len)
+    {
+        return len<=1?0:firstIndex(counts,len-1)+counts[len-2];
+    }
+
+    static constexpr int32_t maxCode(const uint8_t* counts, const int len)
+    {
+        return (len==0 || counts[len-1]==0)?-1:firstCode(counts,len)+counts[len-1]-1;
+    }
+
+    static constexpr int32_t valOffset(const uint8_t* counts, const int len)
+    {
+        return len==0?0:firstIndex(counts,len)-firstCode(counts,len);
+    }
+
+    static constexpr uint16_t lookupEntry(const uint8_t* counts, const uint8_t* symbols, const int lookahead, const int idx, const int len=1)
+    {
+        return len>lookahead?0:
+            ((idx>>(lookahead-len))>=firstCode(counts,len) && (idx>>(lookahead-len))<=maxCode(counts,len))?
+                (uint16_t)((len<<8)|symbols[valOffset(counts,len)+(idx>>(lookahead-len))]):
+                lookupEntry(counts,symbols,lookahead,idx,len+1);
+    }
+
+    static constexpr int extend(const int value, const int size)
+    {
+        return value<(1<<(size-1))?value-(1<<size)+1:value;
+    }
+
+    static constexpr FastACEntry fastAC(const int lookahead, const int idx, const int len, const int run, const int size)
+    {
+        return (len==0 || size==0 || len+size>lookahead)?FastACEntry{0,0,0}:
+            FastACEntry{(int16_t)extend((idx>>(lookahead-len-size))&((1<<size)-1),size),(uint8_t)run,(uint8_t)(len+size)};
+    }
+
+    static constexpr FastACEntry fastAC(const uint16_t entry, const int lookahead, const int idx)
+    {
+        return fastAC(lookahead,idx,entry>>8,(entry>>4)&0xF,entry&0xF);
+    }
+};
+
+/*
+    Canonical Huffman decoder built from the code counts of a DHT segment.
+    Codes no longer than `lookahead` bits are resolved by a single load from a flat table,
+    longer ones fall back to a maxcode/valptr search (as in ITU-T T.81 F.2.2.3).
+*/
+template <int lookahead>
+class CanonicalHuffmanTable
+{
+public:
+    enum
+    {
+        // Lookahead must not exceed the longest code allowed by JPEG.
+        __LOOKAHEAD_CHECK=STATIC_ASSERT(lookahead>=1 && lookahead<=16)
+    };
+
+    CanonicalHuffmanTable(const uint8_t countByLength[16], const uint8_t* symbols)
+    {
+        build(countByLength,symbols);
+    }
+
+    // compile-time construction (e.g. for the tables of ITU-T T.81 Annex K)
+    constexpr CanonicalHuffmanTable(const uint8_t (&countByLength)[16], const uint8_t (&symbols)[256], const bool ac)
+        :CanonicalHuffmanTable(countByLength,symbols,ac,
+                               typename MakeIndexSequence<1<<lookahead>::type(),
+                               typename MakeIndexSequence<256>::type(),
+                               typename MakeIndexSequence<17>::type())
+    {
+    }
+
+    // returns the decoded symbol, or -1 if the codeword is not found
+    template <class Reader>
+    int decodeInCache(Reader& strm) const
+    {
+        const uint32_t peek=strm.cachedFrontBits(16);
+        const uint16_t entry=mLookup[peek>>(16-lookahead)];
+        if (entry!=0)
+        {
+            // fast path: code length in the high byte, symbol in the low byte
+            strm.cachedSkipBits(entry>>8);
+            return entry&0xFF;
+        }
+        // slow path: the code is longer than lookahead bits
+        for (int len=lookahead+1;len<=16;len++)
+        {
+            const int32_t code=peek>>(16-len);
+            if (code<=mMaxCode[len])
+            {
+                strm.cachedSkipBits(len);
+                return mSymbols[mValOffset[len]+code];
+            }
+        }
+        return -1;
+    }
+
+    // interpret symbols as JPEG AC run/size pairs and precompute the coefficient for
+    // every lookahead pattern in which both the code and its magnitude bits fit
+    void buildFastAC()
+    {
+        for (int i=0;i<(1<<lookahead);i++)
+        {
+            FastACEntry &fac=mFastAC[i];
+            const int len=mLookup[i]>>8;
+            const int run=(mLookup[i]>>4)&0xF;
+            const int size=mLookup[i]&0xF;
+            // EOB, ZRL and long codes are left to the slow path
+            if (len==0 || size==0 || len+size>lookahead) continue;
+
+            int value=(i>>(lookahead-len-size))&((1<<size)-1);
+            if (value<(1<<(size-1)))
+                value-=(1<<size)-1; // negative
+            fac.value=(int16_t)value;
+            fac.run=(uint8_t)run;
+            fac.length=(uint8_t)(len+size);
+        }
+    }
+
+    template <class Reader>
+    const FastACEntry& fastAC(Reader& strm) const
+    {
+        return mFastAC[strm.cachedFrontBits(lookahead)];
+    }
+
+    // raw tables, e.g. for uploading to an OpenCL device
+    const uint16_t* lookupTable() const { return mLookup; }
+    const int32_t* maxCodes() const { return mMaxCode; }
+    const int32_t* valueOffsets() const { return mValOffset; }
+    const uint8_t* symbolTable() const { return mSymbols; }
+
+private:
+    template <int... L, int... S, int... N>
+    constexpr CanonicalHuffmanTable(const uint8_t (&countByLength)[16], const uint8_t (&symbols)[256], const bool ac,
+                                    IndexSequence<L...>, IndexSequence<S...>, IndexSequence<N...>)
+        :mLookup{__CANONICAL_HUFFMAN::lookupEntry(countByLength,symbols,lookahead,L)...},
+         mFastAC{__CANONICAL_HUFFMAN::fastAC(ac?__CANONICAL_HUFFMAN::lookupEntry(countByLength,symbols,lookahead,L):0,lookahead,L)...},
+         mMaxCode{__CANONICAL_HUFFMAN::maxCode(countByLength,N)...},
+         mValOffset{__CANONICAL_HUFFMAN::valOffset(countByLength,N)...},
+         mSymbols{symbols[S]...}
+    {
+    }
+
+    // (code length<<8)|symbol, 0 for codes longer than lookahead bits
+    uint16_t mLookup[1<<lookahead];
+    // fused AC decoding entries, all-zero unless buildFastAC() is called
+    FastACEntry mFastAC[1<<lookahead];
+    // the largest code of each length, -1 if there is no code of that length
+    int32_t mMaxCode[17];
+    // index into mSymbols minus the first code of each length
+    int32_t mValOffset[17];
+    uint8_t mSymbols[256];
+
+    void build(const uint8_t countByLength[16], const uint8_t* symbols)
+    {
+        memset(mLookup,0,sizeof(mLookup));
+        memset(mFastAC,0,sizeof(mFastAC));
+        int32_t code=0;
+        int num=0;
+        for (int len=1;len<=16;len++)
+        {
+            const int cnt=countByLength[len-1];
+            mValOffset[len]=num-code;
+            for (int i=0;i<cnt;i++,code++,num++)
+            {
+                assert(num<256);
+                mSymbols[num]=symbols[num];
+                if (len<=lookahead)
+                {
+                    // all entries sharing this prefix map to the same symbol
+                    const int shift=lookahead-len;
+                    const uint16_t entry=(uint16_t)((len<<8)|symbols[num]);
+                    for (int k=code<<shift;k<((code+1)<<shift);k++)
+                        mLookup[k]=entry;
+                }
+            }
+            mMaxCode[len]=cnt?code-1:-1;
+            assert(code<=(1<<len));
+            code<<=1;
+        }
+        mMaxCode[0]=-1;
+        mValOffset[0]=0;
+    }
+
+    CanonicalHuffmanTable(const CanonicalHuffmanTable&) = delete;
+    CanonicalHuffmanTable& operator = (const CanonicalHuffmanTable&) = delete;
+};
+
 // unit tests
 bool test_huffman();
 
@@ -1,20 +1,96 @@
 #ifndef IDCT_H_INCLUDED
 #define IDCT_H_INCLUDED
 
+// Huffman decoding on the device, the layouts must match huffman.cl
+const int CL_HUFFMAN_LOOKAHEAD=9;
+
+struct CL_HUFFMAN_TABLE
+{
+    uint16_t lookup[1<<CL_HUFFMAN_LOOKAHEAD]; // (code length<<8)|symbol, 0 for longer codes
+    int32_t max_code[18];
+    int32_t val_offset[18];
+    uint8_t symbols[256];
+};
+
+// which tables a block uses, by its index inside the MCU
+struct MCU_BLOCK_INFO
+{
+    int32_t dc_table;
+    int32_t ac_table;
+    int32_t quant_table;
+    int32_t channel;
+};
+
+// a run of blocks that can be decoded on its own
+struct ENTROPY_SEGMENT
+{
+    uint64_t bit_pos; // in the unstuffed scan
+    uint64_t end_bit_pos; // decoding past this position is an error
+    int32_t mcu_blk; // index of the first block inside its MCU
+    int32_t first_block;
+    int32_t num_blocks;
+    int32_t dc_coef[4]; // DC predictors before the first block
+};
+
+// which coefficients of a block can be non-zero, by its eob (1 + zig-zag index of the last
+// coefficient): zig-zag indices 0..2 lie in the top-left 2x2 corner, 0..9 in the 4x4 corner
+enum IdctClass
+{
+    IDCT_DC_ONLY,
+    IDCT_2X2,
+    IDCT_4X4,
+    IDCT_FULL
+};
+
+static inline IdctClass idct_class(const int eob)
+{
+    return eob<=1?IDCT_DC_ONLY:(eob<=3?IDCT_2X2:(eob<=10?IDCT_4X4:IDCT_FULL));
+}
+
+// the integer IDCT of cpuIDCT8x8.cpp and the kernels
+#define W1 2841 /* 2048*sqrt(2)*cos(1*pi/16) */
+#define W2 2676 /* 2048*sqrt(2)*cos(2*pi/16) */
+#define W3 2408 /* 2048*sqrt(2)*cos(3*pi/16) */
+#define W5 1609 /* 2048*sqrt(2)*cos(5*pi/16) */
+#define W6 1108 /* 2048*sqrt(2)*cos(6*pi/16) */
+#define W7 565  /* 2048*sqrt(2)*cos(7*pi/16) */
+
 void Initialize_Fast_IDCT();
-void Fast_IDCT(int * block);
-void idctrow(int * blk);
-void idctcol(int * blk);
+// the reference for every other variant, they all give the same results
+void Fast_IDCT_Scalar(coef_t * block);
+// consecutive blocks; with their eob, every block goes through the variant for its class,
+// otherwise all of them get the full transform. Runs the idct_blocks kernel of the
+// instruction set picked by select_cpu_kernels(), which gathers full blocks into
+// batches with AVX2 or AVX-512.
+void Fast_IDCT_Blocks(coef_t (*blocks)[64], const uint8_t *eob, const int count);
+void idctrow(coef_t * blk);
+void idctcol(coef_t * blk);
+// like Fast_IDCT_Blocks(), with the float AAN IDCT of IDCT_FAST; only DC-only blocks have
+// their own variant. The scale factors of its outputs, aan[0]=1 and aan[k]=sqrt(2)*cos(k*pi/16)
+// for row and column, multiply its inputs in float, which leaves 5 multiplications per row
+// and column and the quantization tables as they are for both widths of coef_t.
+void Float_IDCT_Blocks(coef_t (*blocks)[64], const uint8_t *eob, const int count);
+// time the IDCT kernel of every instruction set the CPU supports on copies of the blocks
+// and print blocks per second, for the full transform and by the class of every block
+void bench_idct(const coef_t (*blocks)[64], const int count);
+bool test_idct();
+
+struct DECODED_IMAGE;
 
 int Initialize_OpenCL_IDCT();
 bool clidct_create();
-bool clidct_allocate_memory(const int total_blocks, const size_t image_width, const size_t image_height, const int mcu_width, const int mcu_height);
-bool clidct_transfer_data_to_device(const int block_data_src[1][64], const int offset, const int count);
-bool clidct_build(ColorSpace colorspace);
+// the output is an image for PIXEL_BGRA and PIXEL_RGBA, a buffer holding its planes otherwise
+bool clidct_allocate_memory(const int total_blocks, const size_t image_width, const size_t image_height, const int mcu_width, const int mcu_height, const PixelFormat format);
+bool clidct_transfer_data_to_device(const coef_t block_data_src[1][64], const uint8_t *eob, const int offset, const int count);
+bool clidct_transfer_sparse_data_to_device(const uint32_t *offset, const uint8_t *eob, const coef_t *value, const uint8_t *pos, const int count, const size_t num_values);
+bool clidct_build(ColorSpace colorspace, bool sparse, IdctMode idct_mode, PixelFormat format, ChromaUpsampling upsampling);
 bool clidct_run(ColorSpace colorspace);
-bool clidct_retrieve_data_from_device(int block_data_dest[1][64]);
-bool clidct_retrieve_image_from_device(void *img_data_dest, const size_t img_width, const size_t img_height);
+bool clidct_retrieve_data_from_device(coef_t block_data_dest[1][64]);
+// every plane of an image allocated by alloc_image()
+bool clidct_retrieve_image_from_device(DECODED_IMAGE &image);
 bool clidct_wait_for_completion();
+bool clidct_build_entropy_decoder();
+bool clidct_decode_entropy(const uint8_t *scan, const size_t scan_size, const CL_HUFFMAN_TABLE *tables, const int num_tables, const MCU_BLOCK_INFO *layout, const int num_mcu_blks, const int quant[4][64], const ENTROPY_SEGMENT *segments, const int num_segments);
 bool clidct_clean_up();
 
 #endif // IDCT_H_INCLUDED
@@ -5,6 +5,16 @@
 #define W6 1108
 #define W7 565
 
+#ifdef COEF_INT16
+typedef short coef_t;
+#define load_row(offset,blk) convert_int8(vload8(offset,blk))
+#define store_row(y,offset,blk) vstore8(convert_short8(y),offset,blk)
+#else
+typedef int coef_t;
+#define load_row(offset,blk) vload8(offset,blk)
+#define store_row(y,offset,blk) vstore8(y,offset,blk)
+#endif
+
 #define x0 x.s0
 #define x1 x.s1
 #define x2 x.s2
@@ -14,14 +24,14 @@
 #define x6 x.s6
 #define x7 x.s7
 
-kernel void _idctrow(global int * blk, const int offset)
+kernel void _idctrow(global coef_t * blk, const int offset)
 {
     private int8 x; // x0 ~ x7
     private int8 y; // output
     private int  x8;// x8
 
     // load
-    x.s01234567 = vload8(offset, blk).s04621753;
+    x.s01234567 = load_row(offset, blk).s04621753;
     x.s01 <<= 11;
     x.s0 += 128;
     //first stage
@@ -59,10 +69,12 @@ kernel void _idctrow(global int * blk, const int offset)
     y.s7 = (x7-x1);
     y.s01234567 >>= 8;
     // store
-    vstore8(y,offset,blk);
+    store_row(y,offset,blk);
 }
 
-kernel void _idctcol(global int * blk)
+// only rows 0..n-1 of the column can be non-zero; with a constant n the
+// compiler drops the zero terms
+void idctcol_n(global coef_t * blk, const int n)
 {
     private int8 x; // x0 ~ x7
     private int8 y; // output
@@ -70,13 +82,13 @@ kernel void _idctcol(global int * blk)
 
     //intcut
     x0 = (blk[8*0]<<8) + 8192;
-    x1 = (blk[8*4]<<8);
-    x2 = blk[8*6];
-    x3 = blk[8*2];
+    x1 = n>4 ? (blk[8*4]<<8) : 0;
+    x2 = n>4 ? blk[8*6] : 0;
+    x3 = n>2 ? blk[8*2] : 0;
     x4 = blk[8*1];
-    x5 = blk[8*7];
-    x6 = blk[8*5];
-    x7 = blk[8*3];
+    x5 = n>4 ? blk[8*7] : 0;
+    x6 = n>4 ? blk[8*5] : 0;
+    x7 = n>2 ? blk[8*3] : 0;
 
     //first stage
     x8 = W7*(x4+x5) + 4;
@@ -124,6 +136,11 @@ kernel void _idctcol(global int * blk)
     blk[8*7] = y.s7;
 }
 
+kernel void _idctcol(global coef_t * blk)
+{
+    idctcol_n(blk,8);
+}
+
 #undef x0
 #undef x1
 #undef x2
@@ -133,7 +150,7 @@ kernel void _idctcol(global int * blk)
 #undef x6
 #undef x7
 
-kernel void _idct8x8(global int * cur_block)
+kernel void _idct8x8(global coef_t * cur_block)
 {
     _idctrow(cur_block,0);
     _idctrow(cur_block,1);
@@ -154,69 +171,417 @@ kernel void _idct8x8(global int * cur_block)
     _idctcol(cur_block+7);
 }
 
-kernel void batch_idct(global int * block, const int num_blocks)
+// every value is the result of the DC coefficient alone, as the full transform gives it
+void idct_dc(global coef_t * cur_block)
+{
+    const int row=(coef_t)(cur_block[0]<<3);
+    const coef_t value=clamp((row+32)>>6,-256,256);
+    for (int k=0;k<64;k++)
+        cur_block[k]=value;
+}
+
+// coefficients in the top-left n*n corner only: rows n..7 stay zero through the row pass
+void idct_corner(global coef_t * cur_block, const int n)
+{
+    for (int i=0;i<n;i++)
+        _idctrow(cur_block,i);
+    for (int i=0;i<8;i++)
+        idctcol_n(cur_block+i,n);
+}
+
+#ifdef IDCT_FLOAT
+// the AAN IDCT of Float_IDCT_Blocks() on the host, with the same float operations in the
+// same order, the inputs multiplied by aan[i]*aan[j]/8 like there
+#pragma OPENCL FP_CONTRACT OFF
+constant float aan_factor[8]={1.0f,1.387039845f,1.306562965f,1.175875602f,1.0f,0.785694958f,0.541196100f,0.275899379f};
+
+// x[k] holds row k (then column k), one column (then row) per component
+void aan_idct(float8 * x)
+{
+    //even part
+    float8 tmp10 = x[0] + x[4];
+    float8 tmp11 = x[0] - x[4];
+    const float8 tmp13 = x[2] + x[6];
+    float8 tmp12 = 1.414213562f*(x[2] - x[6]) - tmp13;
+    const float8 tmp0 = tmp10 + tmp13;
+    const float8 tmp3 = tmp10 - tmp13;
+    const float8 tmp1 = tmp11 + tmp12;
+    const float8 tmp2 = tmp11 - tmp12;
+    //odd part
+    const float8 z13 = x[5] + x[3];
+    const float8 z10 = x[5] - x[3];
+    const float8 z11 = x[1] + x[7];
+    const float8 z12 = x[1] - x[7];
+    const float8 tmp7 = z11 + z13;
+    tmp11 = 1.414213562f*(z11 - z13);
+    const float8 z5 = 1.847759065f*(z10 + z12);
+    tmp10 = 1.082392200f*z12 - z5;
+    tmp12 = -2.613125930f*z10 + z5;
+    const float8 tmp6 = tmp12 - tmp7;
+    const float8 tmp5 = tmp11 - tmp6;
+    const float8 tmp4 = tmp10 + tmp5;
+    //outputs
+    x[0] = tmp0 + tmp7;
+    x[7] = tmp0 - tmp7;
+    x[1] = tmp1 + tmp6;
+    x[6] = tmp1 - tmp6;
+    x[2] = tmp2 + tmp5;
+    x[5] = tmp2 - tmp5;
+    x[4] = tmp3 + tmp4;
+    x[3] = tmp3 - tmp4;
+}
+
+// column k of a block stored by rows
+float8 load_column(const float * ws, const int k)
+{
+    return (float8)(ws[k],ws[8+k],ws[16+k],ws[24+k],ws[32+k],ws[40+k],ws[48+k],ws[56+k]);
+}
+
+void idct_float(global coef_t * cur_block)
+{
+    private float8 x[8];
+    private float ws[64];
+    const float8 aan = vload8(0,aan_factor);
+    for (int i=0;i<8;i++)
+        x[i] = convert_float8(load_row(i,cur_block))*((aan_factor[i]*aan)*0.125f);
+    aan_idct(x);
+    for (int i=0;i<8;i++)
+        vstore8(x[i],i,ws);
+    for (int k=0;k<8;k++)
+        x[k] = load_column(ws,k);
+    aan_idct(x);
+    for (int k=0;k<8;k++)
+        vstore8(x[k],k,ws);
+    // clamped before rounding to nearest even, like on the host
+    for (int i=0;i<8;i++)
+        store_row(convert_int8_rte(clamp(load_column(ws,i),-256.0f,255.0f)),i,cur_block);
+}
+
+void idct_dc_float(global coef_t * cur_block)
+{
+    const coef_t value=convert_int_rte(clamp(cur_block[0]*0.125f,-256.0f,255.0f));
+    for (int k=0;k<64;k++)
+        cur_block[k]=value;
+}
+#endif
+
+// the variant for the class of the block, eob being 1 + the zig-zag index of its last
+// coefficient; the classes are those of idct_class() on the host
+void idct_block(global coef_t * cur_block, const int eob)
+{
+#ifdef IDCT_FLOAT
+    if (eob<=1)
+        idct_dc_float(cur_block);
+    else
+        idct_float(cur_block);
+#else
+    if (eob<=1)
+        idct_dc(cur_block);
+    else if (eob<=3)
+        idct_corner(cur_block,2);
+    else if (eob<=10)
+        idct_corner(cur_block,4);
+    else
+        _idct8x8(cur_block);
+#endif
+}
+
+#ifdef SPARSE_BLOCKS
+// only the non-zero coefficients are sent, the block buffer is filled here
+#define SPARSE_ARGS , global const uint * sparse_offset, global const coef_t * sparse_value, global const uchar * sparse_pos
+#define LOAD_BLOCKS(first,count) load_sparse_blocks(block,first,count,sparse_offset,sparse_value,sparse_pos)
+
+void load_sparse_blocks(global coef_t * block, const int first, const int count, global const uint * sparse_offset, global const coef_t * sparse_value, global const uchar * sparse_pos)
+{
+    global coef_t * cur_block=block+(first<<6);
+    for (int k=0;k<(count<<6);k++)
+        cur_block[k]=0;
+    for (int i=0;i<count;i++)
+    {
+        for (uint n=sparse_offset[first+i];n<sparse_offset[first+i+1];n++)
+            cur_block[(i<<6)+sparse_pos[n]]=sparse_value[n];
+    }
+}
+
+// block i into dst, without touching the block buffer
+#define COPY_BLOCK(dst,i) copy_sparse_block(dst,i,sparse_offset,sparse_value,sparse_pos)
+
+void copy_sparse_block(global coef_t * dst, const int i, global const uint * sparse_offset, global const coef_t * sparse_value, global const uchar * sparse_pos)
+{
+    for (int k=0;k<64;k++)
+        dst[k]=0;
+    for (uint n=sparse_offset[i];n<sparse_offset[i+1];n++)
+        dst[sparse_pos[n]]=sparse_value[n];
+}
+#else
+#define SPARSE_ARGS
+#define LOAD_BLOCKS(first,count)
+#define COPY_BLOCK(dst,i) copy_block(dst,block+((i)<<6))
+
+void copy_block(global coef_t * dst, global const coef_t * src)
+{
+    for (int k=0;k<64;k++)
+        dst[k]=src[k];
+}
+#endif
+
+kernel void batch_idct(global coef_t * block, global const uchar * block_eob, const int num_blocks SPARSE_ARGS)
 {
     // local int loc_block[64] __attribute ((aligned (32)));
     // we can't store block in local memory for local memory is limited.
     for (int i=get_global_id(0);i<num_blocks;i+=get_global_size(0))
     {
-        global int * cur_block=block+(i<<6);
-        _idct8x8(cur_block);
+        global coef_t * cur_block=block+(i<<6);
+        LOAD_BLOCKS(i,1);
+        idct_block(cur_block,block_eob[i]);
     }
 }
 
-kernel void batch_idct_csc_444(global int * block, const int num_blocks, write_only image2d_t image, const int num_hor_mcu)
+// the fixed-point colour conversion of the CPU kernels (kernels.inc): factors with CSC_BITS
+// fractional bits, chroma terms rounded to nearest, the same results
+#define CSC_BITS 14
+#define CSC_HALF (1<<(CSC_BITS-1))
+#define CSC_R_V 22970  /* 1.402*2^14 */
+#define CSC_G_U (-5638)  /* -0.34414*2^14 */
+#define CSC_G_V (-11700) /* -0.71414*2^14 */
+#define CSC_B_U 29032  /* 1.772*2^14 */
+
+#ifdef OUTPUT_RGB24
+// R G B bytes in a buffer, pitch bytes from one row to the next
+#define OUTPUT_IMAGE global uchar * image
+#define write_pixel(image,pitch,pos,r,g,b) vstore3(convert_uchar3((int3)(r,g,b)),0,(image)+(pos).y*(pitch)+(pos).x*3)
+#else
+// BGRA or RGBA, following the format of the image; pitch is not used
+// RGBA is opaque, BGRA keeps the 0x00RRGGBB words of the bitmap
+#ifndef OUTPUT_ALPHA
+#define OUTPUT_ALPHA 0
+#endif
+#define OUTPUT_IMAGE write_only image2d_t image
+#define write_pixel(image,pitch,pos,r,g,b) write_imageui(image,pos,convert_uint4((int4)(r,g,b,OUTPUT_ALPHA)))
+#endif
+
+// 8 pixels of a scanline, from pos to the right
+void write_rgb_row(OUTPUT_IMAGE, const int pitch, const int2 pos, const int8 Y, const int8 U, const int8 V)
 {
+    const int8 y=Y+128;
+    private int r[8], g[8], b[8];
+    vstore8(clamp(y+((CSC_R_V*V+CSC_HALF)>>CSC_BITS),0,255),0,r);
+    vstore8(clamp(y+((CSC_G_U*U+CSC_G_V*V+CSC_HALF)>>CSC_BITS),0,255),0,g);
+    vstore8(clamp(y+((CSC_B_U*U+CSC_HALF)>>CSC_BITS),0,255),0,b);
+    for (int x=0;x<8;x++)
+        write_pixel(image,pitch,pos+(int2)(x,0),r[x],g[x],b[x]);
+}
+
+kernel void batch_idct_csc_444(global coef_t * block, global const uchar * block_eob, const int num_blocks, OUTPUT_IMAGE, const int num_hor_mcu SPARSE_ARGS)
+{
+    const int pitch=(num_hor_mcu<<3)*3;
     const int num_mcus=num_blocks/3;
     for (int idx_mcu=get_global_id(0);idx_mcu<num_mcus;idx_mcu+=get_global_size(0))
     {
-        global int* cur_block=block+((idx_mcu*3)<<6);
-        _idct8x8(cur_block);
-        _idct8x8(cur_block+64);
-        _idct8x8(cur_block+128);
+        global coef_t* cur_block=block+((idx_mcu*3)<<6);
+        global const uchar* cur_eob=block_eob+idx_mcu*3;
+        LOAD_BLOCKS(idx_mcu*3,3);
+        idct_block(cur_block,cur_eob[0]);
+        idct_block(cur_block+64,cur_eob[1]);
+        idct_block(cur_block+128,cur_eob[2]);
 
         int2 offset=(int2)((idx_mcu%num_hor_mcu)<<3,(idx_mcu/num_hor_mcu)<<3); // (x,y)
-        for (int k=0;k<64;k++)
-        {
-            int2 pos=(int2)(k&7,k>>3);
-            int Y=*(cur_block+0+k);
-            int U=*(cur_block+64+k);
-            int V=*(cur_block+128+k);
-            int4 rgba=(int4)(Y+1.402*V+128,Y-0.34414*U-0.71414*V+128,Y+1.772*U+128,0);
-            rgba=clamp(rgba,0,255);
-
-            write_imageui(image,offset+pos,convert_uint4(rgba));
-        }
-
+        for (int y=0;y<8;y++)
+            write_rgb_row(image,pitch,offset+(int2)(0,y),load_row(y,cur_block),load_row(y,cur_block+64),load_row(y,cur_block+128));
     }
 }
 
-kernel void batch_idct_csc_411(global int * block, const int num_blocks, write_only image2d_t image, const int num_hor_mcu)
+kernel void batch_idct_csc_411(global coef_t * block, global const uchar * block_eob, const int num_blocks, OUTPUT_IMAGE, const int num_hor_mcu SPARSE_ARGS)
 {
+    const int pitch=(num_hor_mcu<<4)*3;
     const int num_mcus=num_blocks/6;
     for (int idx_mcu=get_global_id(0);idx_mcu<num_mcus;idx_mcu+=get_global_size(0))
     {
-        global int* cur_block=block+((idx_mcu*6)<<6);
-        _idct8x8(cur_block);
-        _idct8x8(cur_block+64);
-        _idct8x8(cur_block+128);
-        _idct8x8(cur_block+192);
-        _idct8x8(cur_block+256);
-        _idct8x8(cur_block+320);
+        global coef_t* cur_block=block+((idx_mcu*6)<<6);
+        global const uchar* cur_eob=block_eob+idx_mcu*6;
+        LOAD_BLOCKS(idx_mcu*6,6);
+        for (int i=0;i<6;i++)
+            idct_block(cur_block+(i<<6),cur_eob[i]);
 
 		// assuming the mcu size is 16*16
         int2 offset=(int2)((idx_mcu%num_hor_mcu)<<4,(idx_mcu/num_hor_mcu)<<4); // (x,y)
 		for (int y=0;y<16;y++)
 		{
-			for (int x=0;x<16;x++)
-			{
-				int Y=*(cur_block+64*(((y>>3)<<1)+(x>>3))+((y&7)<<3)+(x&7));
-				int U=*(cur_block+64*4+((y>>1)<<3)+(x>>1));
-				int V=*(cur_block+64*5+((y>>1)<<3)+(x>>1));
-				int4 rgba=(int4)(Y+1.402*V+128,Y-0.34414*U-0.71414*V+128,Y+1.772*U+128,0);
-				rgba=clamp(rgba,0,255);
-				write_imageui(image,offset+(int2)(x,y),convert_uint4(rgba));
-			}
+			// the chroma row covers both Y blocks, each value twice
+			const int8 U=load_row(y>>1,cur_block+64*4);
+			const int8 V=load_row(y>>1,cur_block+64*5);
+			global coef_t* Y=cur_block+64*((y>>3)<<1);
+			write_rgb_row(image,pitch,offset+(int2)(0,y),load_row(y&7,Y),U.s00112233,V.s00112233);
+			write_rgb_row(image,pitch,offset+(int2)(8,y),load_row(y&7,Y+64),U.s44556677,V.s44556677);
 		}
     }
 }
+
+#ifdef FANCY_UPSAMPLING
+/*
+    batch_idct_csc_411 with libjpeg's fancy upsampling, like convert_mcu_row_fancy() on the host.
+    A work-group of TILE_W*TILE_H work-items converts a tile of as many MCUs at a time. First they
+    transform the chroma of the tile, and of the MCUs around it, into local memory; then each one
+    transforms the Y of its MCU and filters the chroma it needs from the tile, so the filter reads
+    no more global memory than replication. The MCUs around a tile belong to other tiles, so chroma
+    blocks are never transformed in place: each work-item copies them to its 2 blocks of scratch.
+    CHROMA_WIDTH and CHROMA_HEIGHT are the chroma samples inside the image, repeated past its edges.
+*/
+#define TILE_PITCH ((TILE_W<<3)+2) // the chroma samples of the tile, with one more on each side
+#define TILE_ROWS ((TILE_H<<3)+2)
+
+// the filtered samples of a row of an MCU, from chroma rows nearest and farther of the tile at the columns cols
+void fancy_upsample_row(local const uchar * tile, const int nearest, const int farther, const int * cols, int8 * out)
+{
+    int sum[10], row[16];
+    for (int i=0;i<10;i++)
+        sum[i]=3*tile[nearest*TILE_PITCH+cols[i]]+tile[farther*TILE_PITCH+cols[i]];
+    for (int x=0;x<8;x++)
+    {
+        row[x<<1]=(3*sum[x+1]+sum[x]+8)>>4;
+        row[(x<<1)+1]=(3*sum[x+1]+sum[x+2]+7)>>4;
+    }
+    // the tile holds unsigned samples, the filter keeps their offset of 128
+    out[0]=vload8(0,row)-128;
+    out[1]=vload8(1,row)-128;
+}
+
+kernel void batch_idct_csc_411_fancy(global coef_t * block, global const uchar * block_eob, const int num_blocks, OUTPUT_IMAGE, const int num_hor_mcu SPARSE_ARGS, global coef_t * scratch)
+{
+    local uchar tile[2][TILE_ROWS*TILE_PITCH];
+    const int pitch=(num_hor_mcu<<4)*3;
+    const int num_ver_mcu=num_blocks/6/num_hor_mcu;
+    const int tiles_w=(num_hor_mcu+TILE_W-1)/TILE_W;
+    const int num_tiles=tiles_w*((num_ver_mcu+TILE_H-1)/TILE_H);
+    const int lid=get_local_id(0);
+    global coef_t * chroma=scratch+(get_global_id(0)<<7);
+    for (int t=get_group_id(0);t<num_tiles;t+=get_num_groups(0))
+    {
+        const int x0=(t%tiles_w)*TILE_W, y0=(t/tiles_w)*TILE_H; // the first MCU of the tile
+        for (int k=lid;k<(TILE_W+2)*(TILE_H+2);k+=TILE_W*TILE_H)
+        {
+            const int mx=x0-1+k%(TILE_W+2), my=y0-1+k/(TILE_W+2);
+            if (mx<0 || my<0 || mx>=num_hor_mcu || my>=num_ver_mcu)
+                continue;
+            const int idx_blk=(my*num_hor_mcu+mx)*6;
+            // where the block starts in the tile, only the part inside it is stored
+            const int lx=((mx-x0)<<3)+1, ly=((my-y0)<<3)+1;
+            for (int c=0;c<2;c++)
+            {
+                global coef_t * cur_block=chroma+(c<<6);
+                COPY_BLOCK(cur_block,idx_blk+4+c);
+                idct_block(cur_block,block_eob[idx_blk+4+c]);
+                for (int y=max(0,-ly);y<min(8,TILE_ROWS-ly);y++)
+                {
+                    for (int x=max(0,-lx);x<min(8,TILE_PITCH-lx);x++)
+                        tile[c][(ly+y)*TILE_PITCH+lx+x]=convert_uchar_sat(cur_block[(y<<3)+x]+128);
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        const int mx=x0+lid%TILE_W, my=y0+lid/TILE_W;
+        if (mx<num_hor_mcu && my<num_ver_mcu)
+        {
+            const int idx_mcu=my*num_hor_mcu+mx;
+            global coef_t* cur_block=block+((idx_mcu*6)<<6);
+            global const uchar* cur_eob=block_eob+idx_mcu*6;
+            LOAD_BLOCKS(idx_mcu*6,4);
+            for (int i=0;i<4;i++)
+                idct_block(cur_block+(i<<6),cur_eob[i]);
+            // chroma columns -1..8 of the MCU in the tile
+            int cols[10];
+            for (int i=0;i<10;i++)
+                cols[i]=clamp((mx<<3)+i-1,0,CHROMA_WIDTH-1)-(x0<<3)+1;
+            const int2 offset=(int2)(mx<<4,my<<4); // (x,y)
+            for (int y=0;y<16;y++)
+            {
+                // the chroma row of the scanline and the one next to it, above or below
+                const int cy=(my<<3)+(y>>1);
+                const int nearest=clamp(cy,0,CHROMA_HEIGHT-1)-(y0<<3)+1;
+                const int farther=clamp(cy+((y&1)?1:-1),0,CHROMA_HEIGHT-1)-(y0<<3)+1;
+                int8 U[2], V[2];
+                fancy_upsample_row(tile[0],nearest,farther,cols,U);
+                fancy_upsample_row(tile[1],nearest,farther,cols,V);
+                global coef_t* Y=cur_block+64*((y>>3)<<1);
+                write_rgb_row(image,pitch,offset+(int2)(0,y),load_row(y&7,Y),U[0],V[0]);
+                write_rgb_row(image,pitch,offset+(int2)(8,y),load_row(y&7,Y+64),U[1],V[1]);
+            }
+        }
+        // the tile is refilled for the next one
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+#endif // FANCY_UPSAMPLING
+
+#ifdef OUTPUT_PLANES
+// The YCbCr samples as they are, without colour conversion, in a buffer: the Y plane of all
+// the MCUs, then the Cb and Cr planes at their sampling, or with OUTPUT_NV12 one plane of Cb Cr
+// pairs at half the resolution in both directions, or nothing more with OUTPUT_GRAY.
+// The luma has the sampling factors SAMPLING_H and SAMPLING_V, the chroma 1x1.
+#define LUMA_BLOCKS (SAMPLING_H*SAMPLING_V)
+
+// a block after the IDCT, pitch bytes from one row of the plane to the next
+void store_block(global uchar * plane, const int pitch, global const coef_t * blk)
+{
+    for (int y=0;y<8;y++)
+        vstore8(convert_uchar8_sat(load_row(y,blk)+128),0,plane+y*pitch);
+}
+
+// the Cb Cr pairs of an MCU, each the average of the chroma under its 2x2 pixels, which is the
+// chroma itself with 4:2:0 (store_mcu_row_nv12() on the host)
+void store_nv12_pairs(global uchar * plane, const int pitch, global const coef_t * cb, global const coef_t * cr)
+{
+    for (int y=0;y<(SAMPLING_V<<2);y++)
+    {
+        for (int x=0;x<(SAMPLING_H<<2);x++)
+        {
+            int2 sum=0;
+            for (int i=0;i<4;i++)
+            {
+                const int pos=((((y<<1)+(i>>1))/SAMPLING_V)<<3)+((x<<1)+(i&1))/SAMPLING_H;
+                sum+=clamp((int2)(cb[pos],cr[pos])+128,0,255);
+            }
+            vstore2(convert_uchar2((sum+2)>>2),0,plane+y*pitch+(x<<1));
+        }
+    }
+}
+
+kernel void batch_idct_planes(global coef_t * block, global const uchar * block_eob, const int num_blocks, global uchar * planes, const int num_hor_mcu SPARSE_ARGS)
+{
+    const int blks_per_mcu=LUMA_BLOCKS+2;
+    const int num_mcus=num_blocks/blks_per_mcu;
+    const int pitch=num_hor_mcu*(SAMPLING_H<<3); // of the Y plane
+    const int height=num_mcus/num_hor_mcu*(SAMPLING_V<<3);
+    global uchar * chroma=planes+pitch*height;
+    for (int idx_mcu=get_global_id(0);idx_mcu<num_mcus;idx_mcu+=get_global_size(0))
+    {
+        global coef_t* cur_block=block+((idx_mcu*blks_per_mcu)<<6);
+        global const uchar* cur_eob=block_eob+idx_mcu*blks_per_mcu;
+        const int mx=idx_mcu%num_hor_mcu, my=idx_mcu/num_hor_mcu;
+#ifdef OUTPUT_GRAY
+        // the chroma blocks are not even transformed
+        LOAD_BLOCKS(idx_mcu*blks_per_mcu,LUMA_BLOCKS);
+        for (int i=0;i<LUMA_BLOCKS;i++)
+            idct_block(cur_block+(i<<6),cur_eob[i]);
+#else
+        LOAD_BLOCKS(idx_mcu*blks_per_mcu,blks_per_mcu);
+        for (int i=0;i<blks_per_mcu;i++)
+            idct_block(cur_block+(i<<6),cur_eob[i]);
+#endif
+        for (int i=0;i<LUMA_BLOCKS;i++)
+        {
+            const int x=(mx*SAMPLING_H+i%SAMPLING_H)<<3, y=(my*SAMPLING_V+i/SAMPLING_H)<<3;
+            store_block(planes+y*pitch+x,pitch,cur_block+(i<<6));
+        }
+#if defined(OUTPUT_NV12)
+        store_nv12_pairs(chroma+my*(SAMPLING_V<<2)*pitch+mx*(SAMPLING_H<<3),pitch,cur_block+(LUMA_BLOCKS<<6),cur_block+((LUMA_BLOCKS+1)<<6));
+#elif !defined(OUTPUT_GRAY)
+        const int chroma_pitch=num_hor_mcu<<3;
+        const int chroma_size=chroma_pitch*(height/SAMPLING_V);
+        global uchar * cb=chroma+(my<<3)*chroma_pitch+(mx<<3);
+        store_block(cb,chroma_pitch,cur_block+(LUMA_BLOCKS<<6));
+        store_block(cb+chroma_size,chroma_pitch,cur_block+((LUMA_BLOCKS+1)<<6));
+#endif
+    }
+}
+#endif // OUTPUT_PLANES
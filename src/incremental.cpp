@@ -0,0 +1,257 @@
+#include "stdafx.h"
+
+#include "macro.h"
+#include "jpeg.h"
+#include "bytesource.h"
+#include "bitstream.h"
+#include "bitreader.h"
+#include "huffman.h"
+#include "huffcache.h"
+#include "zigzag.h"
+#include "idct.h"
+#include "decoder.h"
+#include "entropy.h"
+#include "scan.h"
+#include "parser.h"
+#include "incremental.h"
+
+// position right after the SOS segment, or 0 if more data is needed to get there
+// only segment lengths are looked at, the parser validates the rest
+// pos is where the first incomplete segment starts, the next call carries on from there
+static size_t find_headers_end(const uint8_t *data, const size_t len, size_t &pos)
+{
+    for (;;)
+    {
+        // marker and segment length
+        if (pos+4>len) return 0;
+        const uint8_t marker=data[pos+1];
+        if (marker==0xD9) return pos+4; // EOI before any scan, let the parser fail
+        const size_t end=pos+2+(((size_t)data[pos+2]<<8)|data[pos+3]);
+        if (end>len) return 0;
+        if (marker==0xDA) return end;
+        pos=end;
+    }
+}
+
+template <class HuffDecoder>
+struct SCAN_DECODERS
+{
+    const HuffDecoderSet<HuffDecoder> htree;
+    const SCAN_TABLES<HuffDecoder> tables;
+
+    explicit SCAN_DECODERS(const JPG_DATA &jpg):htree(jpg),tables(jpg,htree)
+    {
+    }
+};
+
+// the decoders of decoder_options.huffman_decoder, the other ones are NULL
+struct IncrementalDecoder::ScanDecoders
+{
+    SCAN_DECODERS<HufTree> *tree=NULL;
+    SCAN_DECODERS<HufTable> *lookup=NULL;
+
+    ~ScanDecoders()
+    {
+        delete tree;
+        delete lookup;
+    }
+};
+
+IncrementalDecoder::IncrementalDecoder()
+{
+    memset(&mJpg,0,sizeof(mJpg));
+    mJpg.idct_mode=decoder_options.idct;
+    mImage.width=mImage.height=0;
+    mImage.pixels=NULL;
+    mImage.size=0;
+    init_scan_state(mScan);
+}
+
+IncrementalDecoder::~IncrementalDecoder()
+{
+    // the scan tables point to the quantization tables
+    delete mDecoders;
+    release_jpg(mJpg);
+    free_image(mImage);
+}
+
+int IncrementalDecoder::readyLines() const
+{
+    return min(mReadyRows*mJpg.mcu_height,(int)mJpg.frame_info.img_height);
+}
+
+bool IncrementalDecoder::fail()
+{
+    mStage=STAGE_FAILED;
+    return false;
+}
+
+bool IncrementalDecoder::push(const uint8_t * data, const size_t len)
+{
+    switch (mStage)
+    {
+    case STAGE_HEADERS:
+        mHeader.insert(mHeader.end(),data,data+len);
+        if (find_headers_end(mHeader.data(),mHeader.size(),mHeaderPos)==0)
+            return true; // wait for the rest of the headers
+        return parseHeaders() && decodeAvailable();
+    case STAGE_SCAN:
+        appendScanData(data,len);
+        return decodeAvailable();
+    case STAGE_DONE:
+        return true;
+    case STAGE_FAILED:
+    default:
+        return false;
+    }
+}
+
+bool IncrementalDecoder::finish()
+{
+    mInputEnded=true;
+    if (mStage==STAGE_HEADERS && !parseHeaders())
+        return false;
+    if (mStage==STAGE_SCAN && !decodeAvailable())
+        return false;
+    if (mStage!=STAGE_DONE)
+    {
+        printf("[X] data incomplete. (%d/%d mcu)\n",mScan.mcu_idx,mJpg.mcu_count);
+        return fail();
+    }
+    return true;
+}
+
+bool IncrementalDecoder::parseHeaders()
+{
+    ByteSource src;
+    src.open(mHeader.data(),mHeader.size());
+    if (!read_headers(mJpg,src))
+        return fail();
+    if (!decode_init(mJpg))
+    {
+        puts("[X] decoder initialization failed");
+        return fail();
+    }
+    alloc_image(mImage,mJpg,decoder_options.output);
+    mDecoders=new ScanDecoders;
+    switch (decoder_options.huffman_decoder)
+    {
+    case HUFFMAN_TREE:
+        mDecoders->tree=new SCAN_DECODERS<HufTree>(mJpg);
+        break;
+    case HUFFMAN_LOOKUP:
+    default:
+        mDecoders->lookup=new SCAN_DECODERS<HufTable>(mJpg);
+        break;
+    }
+    mStrm.reserve(SCAN_DATA_PADDING*4);
+    mStrm.cacheInit();
+    mStage=STAGE_SCAN;
+    // whatever came after the headers belongs to the scan
+    const size_t scan_start=src.tell();
+    appendScanData(mHeader.data()+scan_start,mHeader.size()-scan_start);
+    std::vector<uint8_t>().swap(mHeader);
+    return true;
+}
+
+void IncrementalDecoder::appendScanData(const uint8_t * data, const size_t len)
+{
+    if (mScanEnded) return; // EOI and anything after it
+    mChunk.clear();
+    if (mPendingFF) mChunk.push_back(0xFF);
+    mChunk.insert(mChunk.end(),data,data+len);
+    if (mChunk.empty()) return;
+    // unstuff in place
+    size_t out;
+    const size_t consumed=unstuff_scan_data(mChunk.data(),&out,mChunk.data(),mChunk.size(),NULL);
+    mStrm.append(mChunk.data(),out);
+    mPendingFF=consumed==mChunk.size()-1;
+    mScanEnded=consumed<mChunk.size() && !mPendingFF;
+}
+
+bool IncrementalDecoder::decodeAvailable()
+{
+    if (mStage!=STAGE_SCAN) return mStage==STAGE_DONE;
+    // an MCU is only decoded once its data is sure to be there,
+    // unless no more data will come; then truncated data is reported by decode_mcus()
+    const bool all_data=mScanEnded || mInputEnded;
+    if (mScan.mcu_idx<mJpg.mcu_count && (all_data || mStrm.getSize()>=SCAN_DATA_PADDING))
+    {
+        const bool ret=mDecoders->tree!=NULL?decodeMcus(*mDecoders->tree):decodeMcus(*mDecoders->lookup);
+        if (!ret) return fail();
+    }
+    return finishRows();
+}
+
+template <class Decoders>
+bool IncrementalDecoder::decodeMcus(const Decoders &decoders)
+{
+    if (mJpg.sparse_data!=NULL)
+    {
+        SparseBlockSink sink(*mJpg.sparse_data,mJpg.sparse_data->value,mJpg.sparse_data->pos);
+        return decodeMcusInto(decoders,sink);
+    }
+    else
+    {
+        DenseBlockSink sink(mJpg.mcu_data,mJpg.mcu_eob);
+        return decodeMcusInto(decoders,sink);
+    }
+}
+
+template <class Decoders, class BlockSink>
+bool IncrementalDecoder::decodeMcusInto(const Decoders &decoders, BlockSink &sink)
+{
+    const bool all_data=mScanEnded || mInputEnded;
+    auto next=[&]()
+    {
+        return all_data || mStrm.getSize()>=SCAN_DATA_PADDING;
+    };
+    return decode_mcus(mJpg,decoders.tables,mStrm,mScan,sink,next);
+}
+
+// convert the MCU rows decoded since the last call
+bool IncrementalDecoder::finishRows()
+{
+    const int rows=mScan.mcu_idx/mJpg.mcu_count_w;
+    if (rows>mDecodedRows)
+    {
+        const int blks_per_row=mJpg.mcu_count_w*mJpg.tot_blks_per_mcu;
+        if (mJpg.sparse_data!=NULL)
+            finish_sparse_blocks(*mJpg.sparse_data,mDecodedRows*blks_per_row,rows*blks_per_row);
+        mDecodedRows=rows;
+    }
+    #ifdef USE_CPU_ONLY
+        // the rows read past the converted ones must be complete
+        int ready=rows;
+        if (rows<mJpg.mcu_count_h)
+            ready=max(rows-mcu_rows_read_ahead(mJpg,mImage.format),0);
+        if (ready>mReadyRows)
+        {
+            if (!decode_mcu_rows(mJpg,mReadyRows,ready,mImage))
+            {
+                puts("[X] decode_mcu_rows() failed");
+                return fail();
+            }
+            mReadyRows=ready;
+        }
+    #endif
+    if (mScan.mcu_idx<mJpg.mcu_count)
+        return true;
+    if (mStrm.cacheEof())
+    {
+        printf("[X] data incomplete. (%d/%d mcu)\n",mScan.mcu_idx,mJpg.mcu_count);
+        return fail();
+    }
+    #ifndef USE_CPU_ONLY
+        // the whole image goes through the IDCT kernel at once
+        transfer_blocks_to_device(mJpg);
+        if (!decode_mcu_data(mJpg,mImage))
+        {
+            puts("[X] decode_mcu_data() failed");
+            return fail();
+        }
+        mReadyRows=mJpg.mcu_count_h;
+    #endif
+    mStage=STAGE_DONE;
+    return true;
+}
@@ -0,0 +1,91 @@
+#ifndef INCREMENTAL_H_INCLUDED
+#define INCREMENTAL_H_INCLUDED
+
+// Decodes a JPEG file that arrives in pieces of any size, e.g. from the network.
+// The headers are parsed once all of them have arrived. After that every push() decodes the
+// MCUs its data completes and suspends at an MCU boundary, keeping the DC predictors, the
+// restart counters and the bit stream for the next push(). On the CPU, MCU rows are
+// converted to pixels as soon as they are decoded. With OpenCL the IDCT only runs once the
+// scan is complete, over the whole image: running it on the first MCU rows while the rest
+// of the file is still arriving is not implemented. Entropy decoding is serial whatever
+// the decoder options say.
+class IncrementalDecoder
+{
+public:
+    IncrementalDecoder();
+    ~IncrementalDecoder();
+
+    // the next bytes of the file; false once decoding has failed
+    bool push(const uint8_t * data, const size_t len);
+    // no more data will come: decode what is left, true if the image is complete
+    bool finish();
+
+    bool hasFailed() const
+    {
+        return mStage==STAGE_FAILED;
+    }
+
+    bool isComplete() const
+    {
+        return mStage==STAGE_DONE;
+    }
+
+    // MCU rows decoded and converted so far and their total, 0 until the headers are parsed
+    // the pixels of these rows are final; with OpenCL there are none until the scan is complete
+    int readyRows() const
+    {
+        return mReadyRows;
+    }
+
+    int totalRows() const
+    {
+        return mJpg.mcu_count_h;
+    }
+
+    // image rows of pixels ready at the top of the image
+    int readyLines() const;
+
+    // allocated once the headers are parsed
+    const DECODED_IMAGE& getImage() const
+    {
+        return mImage;
+    }
+
+private:
+    enum Stage
+    {
+        STAGE_HEADERS, // collecting the headers
+        STAGE_SCAN,    // decoding MCUs as their data arrives
+        STAGE_DONE,    // the rest of the file is ignored
+        STAGE_FAILED
+    };
+
+    Stage mStage=STAGE_HEADERS;
+    JPG_DATA mJpg;
+    DECODED_IMAGE mImage;
+    std::vector<uint8_t> mHeader; // file data received before the scan
+    size_t mHeaderPos=2; // first header segment not completely received, after SOI
+    struct ScanDecoders;
+    ScanDecoders *mDecoders=NULL; // built once the headers are parsed
+    std::vector<uint8_t> mChunk; // stuffed scan data being unstuffed
+    BitStream mStrm;
+    SCAN_STATE mScan;
+    bool mPendingFF=false; // the last byte received was a 0xFF whose meaning is still unknown
+    bool mScanEnded=false; // the marker after the scan has been received
+    bool mInputEnded=false;
+    int mDecodedRows=0; // MCU rows whose coefficients are complete
+    int mReadyRows=0; // MCU rows in the image, one less than decoded ones when converting them reads ahead
+
+    bool parseHeaders();
+    void appendScanData(const uint8_t * data, const size_t len);
+    bool decodeAvailable();
+    template <class Decoders> bool decodeMcus(const Decoders &decoders);
+    template <class Decoders, class BlockSink> bool decodeMcusInto(const Decoders &decoders, BlockSink &sink);
+    bool finishRows();
+    bool fail();
+
+    IncrementalDecoder(const IncrementalDecoder&) = delete;
+    IncrementalDecoder& operator = (const IncrementalDecoder&) = delete;
+};
+
+#endif // INCREMENTAL_H_INCLUDED
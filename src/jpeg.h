@@ -1,4 +1,5 @@
 // JPEG Standard Definiton
+#include <vector>
 
 #pragma pack(1)
 struct APP0
@@ -50,11 +51,31 @@ struct DRI
 struct HUFFMAN_TABLE
 {
     int num_codeword;
-    const char *codeword[256]; // at most 256 codewords
-    uint8_t value[256];
+    uint8_t count_by_length[16]; // number of codewords of length 1~16 (as stored in DHT)
+    uint8_t value[256]; // symbols, in order of increasing codeword
+    // derived canonical codewords
+    uint16_t codeword[256]; // at most 256 codewords
+    uint8_t length[256];
 };
 
-typedef int coef_t;
+// blocks of each component in an MCU, for which the entropy decoder has a specialized loop
+enum McuLayout
+{
+    MCU_LAYOUT_GENERIC, // any other sampling factors
+    MCU_LAYOUT_444,     // Y Cb Cr
+    MCU_LAYOUT_420,     // 4 Y, Cb, Cr
+    MCU_LAYOUT_422,     // 2 Y, Cb, Cr
+    MCU_LAYOUT_GRAY     // Y
+};
+
+// dequantized coefficient blocks without their zeros
+struct SPARSE_BLOCKS
+{
+    std::vector<uint32_t> offset; // index of the first coefficient of every block, plus the total count
+    std::vector<uint8_t> eob; // 1 + zig-zag index of the last non-zero coefficient, 0 for an empty block
+    std::vector<coef_t> value;
+    std::vector<uint8_t> pos; // natural order position of every coefficient
+};
 
 struct JPG_DATA
 {
@@ -67,6 +88,8 @@ struct JPG_DATA
     DRI dri_info;
 
     ColorSpace color_space;
+    McuLayout mcu_layout;
+    IdctMode idct_mode; // the IDCT of the blocks, from decoder_options
 
     int mcu_width; // in pixels
     int mcu_height; // in pixels
@@ -74,6 +97,8 @@ struct JPG_DATA
     int mcu_count_h;
     int mcu_count;
     coef_t (*mcu_data)[64];
+    uint8_t *mcu_eob; // 1 + zig-zag index of the last decoded coefficient of every block in mcu_data
+    SPARSE_BLOCKS *sparse_data; // replaces mcu_data if blocks are stored sparsely
 
     int blks_per_mcu[4]; // Color Component Blocks per MCU
     int tot_blks_per_mcu;
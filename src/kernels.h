@@ -0,0 +1,40 @@
+#ifndef KERNELS_H_INCLUDED
+#define KERNELS_H_INCLUDED
+
+// Included by the kernels_*.cpp files before they pick their instruction set, so that the
+// code of every other header is compiled for the baseline and shared between them.
+
+#include "macro.h"
+#include "jpeg.h"
+#include "idct.h"
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define KERNELS_X86
+    // all intrinsics are declared whatever the compiler flags (GCC 4.9 and later, MSVC)
+    #include <immintrin.h>
+#endif
+
+// KERNELS_ANY_ISA: the compiler can use the intrinsics of any instruction set in a file,
+// whatever the compiler flags; otherwise only those the flags enable (__AVX2__ etc.)
+#ifdef KERNELS_X86
+    #if defined(_MSC_VER)
+        // MSVC doesn't need /arch for intrinsics
+        #define KERNELS_ANY_ISA
+    #elif defined(__GNUC__) && !defined(__clang__) && (__GNUC__>4 || (__GNUC__==4 && __GNUC_MINOR__>=9))
+        // the instruction set of a file is picked with #pragma GCC target, which doesn't
+        // define __AVX2__ and the like in C++
+        #define KERNELS_ANY_ISA
+        #define KERNELS_GCC_TARGET
+    #endif
+#endif
+
+// floating-point code that must give the same results in every kernel: FMA instructions
+// that come with AVX-512 would otherwise be used for a*b+c
+#ifdef KERNELS_GCC_TARGET
+    #define KERNELS_NO_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+    #define KERNELS_NO_CONTRACT
+#endif
+
+#endif // KERNELS_H_INCLUDED
@@ -0,0 +1,21 @@
+#include "stdafx.h"
+#include "kernels.h"
+
+// the kernels for CPUs with AVX2
+#ifdef KERNELS_GCC_TARGET
+    #pragma GCC target("avx2")
+#endif
+
+#if defined(__AVX2__) || defined(KERNELS_ANY_ISA)
+    #define KERNELS_SSE2
+    #define KERNELS_SSE41
+    #define KERNELS_AVX2
+    #define KERNELS_COMPILED true
+#else
+    #define KERNELS_COMPILED false
+#endif
+#define KERNELS_ISA ISA_AVX2
+#define KERNELS_NAMESPACE avx2_kernels
+#define KERNELS_TABLE cpu_kernels_avx2
+
+#include "kernels.inc"
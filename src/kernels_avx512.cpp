@@ -0,0 +1,26 @@
+#include "stdafx.h"
+#include "kernels.h"
+
+// the kernels for CPUs with AVX-512F
+#ifdef KERNELS_GCC_TARGET
+    #pragma GCC target("avx512f")
+    #if __GNUC__==12
+        // false positives in the AVX-512 headers of GCC 12 (GCC bug 105593)
+        #pragma GCC diagnostic ignored "-Wuninitialized"
+    #endif
+#endif
+
+#if defined(__AVX512F__) || defined(KERNELS_ANY_ISA)
+    #define KERNELS_SSE2
+    #define KERNELS_SSE41
+    #define KERNELS_AVX2
+    #define KERNELS_AVX512
+    #define KERNELS_COMPILED true
+#else
+    #define KERNELS_COMPILED false
+#endif
+#define KERNELS_ISA ISA_AVX512
+#define KERNELS_NAMESPACE avx512_kernels
+#define KERNELS_TABLE cpu_kernels_avx512
+
+#include "kernels.inc"
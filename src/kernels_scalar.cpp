@@ -0,0 +1,10 @@
+#include "stdafx.h"
+#include "kernels.h"
+
+// the kernels without intrinsics, for any CPU
+#define KERNELS_COMPILED true
+#define KERNELS_ISA ISA_SCALAR
+#define KERNELS_NAMESPACE scalar_kernels
+#define KERNELS_TABLE cpu_kernels_scalar
+
+#include "kernels.inc"
@@ -0,0 +1,19 @@
+#include "stdafx.h"
+#include "kernels.h"
+
+// the kernels for CPUs with SSE2
+#ifdef KERNELS_GCC_TARGET
+    #pragma GCC target("sse2")
+#endif
+
+#if defined(__SSE2__) || defined(KERNELS_ANY_ISA)
+    #define KERNELS_SSE2
+    #define KERNELS_COMPILED true
+#else
+    #define KERNELS_COMPILED false
+#endif
+#define KERNELS_ISA ISA_SSE2
+#define KERNELS_NAMESPACE sse2_kernels
+#define KERNELS_TABLE cpu_kernels_sse2
+
+#include "kernels.inc"
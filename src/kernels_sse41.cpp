@@ -0,0 +1,20 @@
+#include "stdafx.h"
+#include "kernels.h"
+
+// the kernels for CPUs with SSE4.1
+#ifdef KERNELS_GCC_TARGET
+    #pragma GCC target("sse4.1")
+#endif
+
+#if defined(__SSE4_1__) || defined(KERNELS_ANY_ISA)
+    #define KERNELS_SSE2
+    #define KERNELS_SSE41
+    #define KERNELS_COMPILED true
+#else
+    #define KERNELS_COMPILED false
+#endif
+#define KERNELS_ISA ISA_SSE41
+#define KERNELS_NAMESPACE sse41_kernels
+#define KERNELS_TABLE cpu_kernels_sse41
+
+#include "kernels.inc"
@@ -46,6 +46,11 @@
     #define vbprintf(...) DUMMYSTATEMENT
 #endif // VERBOSE
 
+// messages of the parser and the entropy decoder, turned off while validating files
+extern bool decoder_messages;
+#define logprintf(...) (decoder_messages?(void)printf(__VA_ARGS__):(void)0)
+#define logputs(s) (decoder_messages?(void)puts(s):(void)0)
+
 // Type info
 template <typename T>
 class __BITSOF_CLASS {
@@ -118,6 +123,40 @@ enum ColorSpace
     Other
 };
 
+// accuracy of the IDCT, picked before the quantization tables are read
+enum IdctMode
+{
+    IDCT_EXACT, // integer Chen-Wang transform
+    IDCT_FAST   // AAN transform in float, with its scale factors applied to its inputs
+};
+
+// layout of the decoded image (DECODED_IMAGE), picked before decoding
+enum PixelFormat
+{
+    PIXEL_BGRA,  // 4 bytes per pixel: B G R 0, i.e. 0x00RRGGBB words
+    PIXEL_RGBA,  // 4 bytes per pixel: R G B 255, opaque for consumers that honour alpha
+    PIXEL_RGB24, // 3 bytes per pixel: R G B
+    PIXEL_GRAY,  // the Y plane only
+    PIXEL_YCBCR, // Y, Cb and Cr planes at the sampling factors of the file, no colour conversion
+    PIXEL_NV12   // the Y plane and a plane of Cb Cr pairs at half the resolution in both directions
+};
+
+// how subsampled chroma is brought to the resolution of Y before colour conversion
+enum ChromaUpsampling
+{
+    UPSAMPLE_REPLICATE, // every chroma sample covers its 2x2 (or 2x1) pixels
+    UPSAMPLE_FANCY      // libjpeg's triangle filter, weighing the nearest sample by 3/4 and the next one by 1/4
+};
+
+// dequantized DCT coefficients, also the IDCT output
+// baseline coefficients fit in 16 bits, build with COEF_INT16 to halve the block data;
+// the int build is kept to compare against
+#ifdef COEF_INT16
+typedef int16_t coef_t;
+#else
+typedef int coef_t;
+#endif
+
 template <class T>
 uint8_t clamp255(T n)
 {
@@ -168,3 +207,12 @@ uint32_t inline bswap32(uint32_t& x)
 {
     return (x>>24)|((x&0xFF00)<<8)|((x&0xFF0000)>>8)|((x&0xFF)<<24);
 }
+
+uint64_t inline bswap64(uint64_t& x)
+{
+#ifdef __GNUC__
+    return __builtin_bswap64(x);
+#else
+    return _byteswap_uint64(x);
+#endif
+}
@@ -2,38 +2,204 @@
 #include "stdafx.h"
 #include "macro.h"
 #include "bitstream.h"
+#include "bitreader.h"
 #include "huffman.h"
 #include "idct.h"
+#include "jpeg.h"
+#include "bytesource.h"
+#include "decoder.h"
+#include "huffcache.h"
+#include "scan.h"
+#include "parser.h"
+#include "incremental.h"
+#include "validate.h"
+#include "cpu.h"
 
-bool load_jpg(const char *filePath);
+// hand the decoder whole files in memory, the way decode_jpg() is used by applications
+static bool from_memory=false;
+// feed files to IncrementalDecoder in pieces of this size, 0 to decode them at once
+static size_t chunk_size=0;
+// only check the files, see validate_jpg()
+static bool validate=false;
+// the best instruction set the kernels may use, ISA_COUNT for the best one of the CPU
+static CpuIsa max_isa=ISA_COUNT;
+
+static bool load_jpg_from_memory(const char *filePath)
+{
+    FILE *fp=fopen(filePath,"rb");
+    if (fp==NULL)
+    {
+        printf("Couldn't open file.\n");
+        return false;
+    }
+    fseek(fp,0,SEEK_END);
+    const long size=ftell(fp);
+    rewind(fp);
+    uint8_t *data=new uint8_t[size>0?size:1];
+    const bool loaded=size>=0 && fread(data,1,size,fp)==(size_t)size;
+    fclose(fp);
+    DECODED_IMAGE image;
+    bool saved=false;
+    if (loaded && decode_jpg(data,size,image))
+    {
+        saved=save_image(image)!=NULL;
+        free_image(image);
+    }
+    delete[] data;
+    return saved;
+}
+
+static bool load_jpg_in_chunks(const char *filePath)
+{
+    FILE *fp=fopen(filePath,"rb");
+    if (fp==NULL)
+    {
+        printf("Couldn't open file.\n");
+        return false;
+    }
+    IncrementalDecoder decoder;
+    uint8_t *chunk=new uint8_t[chunk_size];
+    size_t len;
+    int rows=0;
+    while ((len=fread(chunk,1,chunk_size,fp))>0 && decoder.push(chunk,len))
+    {
+        if (decoder.readyRows()>rows)
+        {
+            rows=decoder.readyRows();
+            vbprintf("[ ] %d/%d MCU rows ready\n",rows,decoder.totalRows());
+        }
+    }
+    fclose(fp);
+    delete[] chunk;
+    if (!decoder.finish()) return false;
+    const DECODED_IMAGE &image=decoder.getImage();
+    return save_image(image)!=NULL;
+}
+
+static bool parse_option(const char *opt)
+{
+    if (!strcmp(opt,"--huffman=tree"))
+        decoder_options.huffman_decoder=HUFFMAN_TREE;
+    else if (!strcmp(opt,"--huffman=lookup"))
+        decoder_options.huffman_decoder=HUFFMAN_LOOKUP;
+    else if (!strcmp(opt,"--bitreader=stream"))
+        decoder_options.bit_reader=BIT_READER_STREAM;
+    else if (!strcmp(opt,"--bitreader=fast"))
+        decoder_options.bit_reader=BIT_READER_FAST;
+    else if (!strncmp(opt,"--threads=",10))
+        decoder_options.threads=atoi(opt+10);
+    else if (!strcmp(opt,"--entropy=cpu"))
+        decoder_options.device_entropy=false;
+    else if (!strcmp(opt,"--entropy=device"))
+        decoder_options.device_entropy=true;
+    else if (!strcmp(opt,"--blocks=dense"))
+        decoder_options.sparse_blocks=false;
+    else if (!strcmp(opt,"--blocks=sparse"))
+        decoder_options.sparse_blocks=true;
+    else if (!strcmp(opt,"--input=read"))
+        decoder_options.map_input=from_memory=false;
+    else if (!strcmp(opt,"--input=mmap"))
+    {
+        decoder_options.map_input=true;
+        from_memory=false;
+    }
+    else if (!strcmp(opt,"--input=memory"))
+        from_memory=true;
+    else if (!strncmp(opt,"--chunk=",8))
+        chunk_size=max(atoi(opt+8),0);
+    else if (!strncmp(opt,"--interleave=",13))
+        decoder_options.interleave=max(1,min(atoi(opt+13),MAX_INTERLEAVE));
+    else if (!strcmp(opt,"--bench"))
+        decoder_options.benchmark=true;
+    else if (!strcmp(opt,"--validate"))
+        validate=true;
+    else if (!strcmp(opt,"--verify"))
+        decoder_options.device_entropy=decoder_options.verify_device=true;
+    else if (!strncmp(opt,"--isa=",6))
+        return (max_isa=parse_cpu_isa(opt+6))!=ISA_COUNT;
+    else if (!strcmp(opt,"--idct=exact"))
+        decoder_options.idct=IDCT_EXACT;
+    else if (!strcmp(opt,"--idct=fast"))
+        decoder_options.idct=IDCT_FAST;
+    else if (!strncmp(opt,"--output=",9))
+    {
+        static const char * const formats[]={"bgra","rgba","rgb24","gray","ycbcr","nv12"};
+        int i=0;
+        while (i<(int)COUNT_OF(formats) && strcmp(opt+9,formats[i])) i++;
+        if (i==(int)COUNT_OF(formats)) return false;
+        decoder_options.output=(PixelFormat)i;
+    }
+    else if (!strcmp(opt,"--upsample=replicate"))
+        decoder_options.upsampling=UPSAMPLE_REPLICATE;
+    else if (!strcmp(opt,"--upsample=fancy"))
+        decoder_options.upsampling=UPSAMPLE_FANCY;
+    else
+        return false;
+    return true;
+}
 
 int main(int argc, char **argv)
 {
     // run unit tests
     test_bitstream();
+    test_bitreader();
     test_huffman();
+    test_huffman_cache();
+    test_scan();
+    test_validate();
+    test_idct();
+    test_cpu_kernels();
     #ifdef COMPILE_ONLY
         puts("tests passed.");
         exit(0);
     #endif // COMPILE_ONLY
 
+    // OCLJPEG_ISA holds the default for --isa=
+    const char *isa_env=getenv("OCLJPEG_ISA");
+    if (isa_env!=NULL && *isa_env && (max_isa=parse_cpu_isa(isa_env))==ISA_COUNT)
+        printf("[!] unknown instruction set %s in OCLJPEG_ISA\n",isa_env);
+    int first_file=1;
+    for (;first_file<argc && !strncmp(argv[first_file],"--",2);first_file++)
+    {
+        if (!parse_option(argv[first_file]))
+        {
+            printf("Unknown option %s\n",argv[first_file]);
+            return 1;
+        }
+    }
+    if (first_file>=argc)
+    {
+        printf("Usage: %s [--huffman=tree|lookup] [--bitreader=stream|fast] [--threads=N] [--entropy=cpu|device] [--verify] [--interleave=1..4] [--bench] [--blocks=dense|sparse] [--input=read|mmap|memory] [--chunk=N] [--validate] [--isa=scalar|sse2|sse4.1|avx2|avx512] [--idct=exact|fast] [--output=bgra|rgba|rgb24|gray|ycbcr|nv12] [--upsample=replicate|fancy] file1 [file2 file3 ...]\n",argv[0]);
+        return 0;
+    }
+    const CpuIsa detected_isa=detect_cpu_isa();
+    const CPU_KERNELS *kernels=select_cpu_kernels(max_isa);
+    if (kernels->isa!=detected_isa)
+        printf("[ ] CPU kernels: %s (CPU supports %s)\n",cpu_isa_name(kernels->isa),cpu_isa_name(detected_isa));
+    else
+        printf("[ ] CPU kernels: %s\n",cpu_isa_name(kernels->isa));
+    if (validate)
+        return validate_files(argv+first_file,argc-first_file,decoder_options.threads)>0?2:0;
+
     // init IDCT library
     Initialize_Fast_IDCT();
     Initialize_OpenCL_IDCT();
 
-    if (argc<=1)
-    {
-        printf("Usage: %s file1 [file2 file3 ...]\n",argv[0]);
-        return 0;
-    }
-    for (int i=1;i<argc;i++)
+    for (int i=first_file;i<argc;i++)
     {
         printf("Processing %s\n",argv[i]);
-        load_jpg(argv[i]);
+        if (chunk_size>0)
+            load_jpg_in_chunks(argv[i]);
+        else if (from_memory)
+            load_jpg_from_memory(argv[i]);
+        else
+            load_jpg(argv[i]);
         if (i+1<argc)
         {
             system("pause");
         }
     }
+    const HUFFMAN_CACHE_STATS stats=huffman_cache_stats();
+    printf("Huffman table cache: %lu hits, %lu misses, %lu evictions, %d tables\n",stats.hits,stats.misses,stats.evictions,stats.entries);
     return 0;
 }
@@ -3,24 +3,50 @@
 
 #include "macro.h"
 #include "idct.h"
+#include "jpeg.h"
+#include "bytesource.h"
+#include "parser.h"
 
-const size_t BLOCK_SIZE=sizeof(int)*64;
+const size_t BLOCK_SIZE=sizeof(coef_t)*64;
 const size_t WORK_SIZE[]={512};
-const cl_image_format IMG_FORMAT={CL_BGRA, CL_UNSIGNED_INT8};
+// MCUs of a tile of batch_idct_csc_411_fancy(), the size of its work-groups
+const int FANCY_TILE_W=16;
+const int FANCY_TILE_H=4;
+const size_t FANCY_GROUP_SIZE[]={FANCY_TILE_W*FANCY_TILE_H};
+#ifdef COEF_INT16
+const char COEF_OPTION[]=" -DCOEF_INT16"; // the kernels share coef_t with the host
+#else
+const char COEF_OPTION[]="";
+#endif
+const cl_image_format IMG_FORMAT_BGRA={CL_BGRA, CL_UNSIGNED_INT8};
+const cl_image_format IMG_FORMAT_RGBA={CL_RGBA, CL_UNSIGNED_INT8};
 
 static cl_device_id sel_device;
 static cl_context g_context;
 static cl_command_queue g_commandq;
 static cl_program g_program;
 static cl_kernel g_entry;
+static cl_program g_huffman_program;
+static cl_kernel g_huffman_entry;
+static size_t g_huffman_simd_width; // work-items a compute unit runs in lockstep
 static cl_mem g_block_data;
-static cl_mem g_image_data; // for output image
+static cl_mem g_block_eob; // picks the IDCT variant of every block
+static cl_mem g_image_data; // for output image, a buffer unless the format is BGRA or RGBA
+static cl_mem g_sparse_offset; // sparse blocks, scattered into g_block_data by the IDCT kernel
+static cl_mem g_sparse_value;
+static cl_mem g_sparse_pos;
+static cl_mem g_chroma_scratch; // 2 blocks per work-item of batch_idct_csc_411_fancy()
 static int g_block_count;
 static size_t g_image_width;
 static size_t g_image_height;
 static size_t g_image_pitch;
+static bool g_image_buffer;
+static size_t g_plane_offset[MAX_PLANES]; // where the planes of the buffer start
+static size_t g_plane_pitch[MAX_PLANES];
 static int g_num_hor_mcu;
 static int g_num_ver_mcu;
+static size_t g_frame_width; // of the image itself, for the edges of fancy upsampling
+static size_t g_frame_height;
 
 int Initialize_OpenCL_IDCT()
 {
@@ -29,6 +55,7 @@ int Initialize_OpenCL_IDCT()
     cl_platform_id platform_ids[10];
     cl_uint num_platforms;
     cl_int err;
+    cl_device_id first_device = NULL;
 
     err = clGetPlatformIDs(COUNT_OF(platform_ids), platform_ids, &num_platforms);
     if (err != CL_SUCCESS) {
@@ -48,13 +75,14 @@ int Initialize_OpenCL_IDCT()
 
         cl_device_id dev_ids[10];
         cl_uint num_devices;
-        clGetDeviceIDs(pid, CL_DEVICE_TYPE_ALL, COUNT_OF(dev_ids), dev_ids, & num_devices);
+        err = clGetDeviceIDs(pid, CL_DEVICE_TYPE_ALL, COUNT_OF(dev_ids), dev_ids, & num_devices);
         if (err != CL_SUCCESS) {
             fprintf(stderr, "clGetDeviceIDs failed (error %d)\n", err);
             return -1;
         }else {
             for (cl_uint j = 0; j < num_devices; j++) {
                 const cl_device_id did = dev_ids[j];
+                if (!first_device) first_device = did;
 
                 clGetDeviceInfo(did, CL_DEVICE_NAME, sizeof(dname), dname, NULL);
                 printf("Device #%u: Name: %s\n", j+1, dname);
@@ -85,6 +113,12 @@ int Initialize_OpenCL_IDCT()
     {
         printf("[ ] OpenCL device selected.\n");
         return 0;
+    }else if (first_device)
+    {
+        // e.g. a CPU implementation such as PoCL, useful for verification
+        sel_device=first_device;
+        printf("[ ] No high-performance device found, using the first OpenCL device.\n");
+        return 0;
     }else
     {
         printf("[X] No suitable OpenCL device. A Quadro or FirePro graphics card would be a good choice.\n");
@@ -109,7 +143,7 @@ bool clidct_create()
     return true;
 }
 
-bool clidct_allocate_memory(const int total_blocks, const size_t image_width, const size_t image_height, const int mcu_width, const int mcu_height)
+bool clidct_allocate_memory(const int total_blocks, const size_t image_width, const size_t image_height, const int mcu_width, const int mcu_height, const PixelFormat format)
 {
     cl_int err;
     // create dct coefficient blocks buffer
@@ -123,13 +157,51 @@ bool clidct_allocate_memory(const int total_blocks, const size_t image_width, co
     {
         g_block_count=total_blocks;
     }
+    g_block_eob=clCreateBuffer(g_context,CL_MEM_READ_WRITE,total_blocks,NULL,&err);
+    if (err != CL_SUCCESS)
+    {
+        fprintf(stderr, "clCreateBuffer failed (error %d)\n", err);
+        return false;
+    }
     // create output image
     const int allocated_width=(image_width+mcu_width-1)&(~(mcu_width-1));
     const int allocated_height=(image_height+mcu_height-1)&(~(mcu_height-1));
-    g_image_data=clCreateImage2D(g_context,CL_MEM_WRITE_ONLY,&IMG_FORMAT,allocated_width,allocated_height,0,NULL,&err);
+    g_image_buffer=format!=PIXEL_BGRA && format!=PIXEL_RGBA;
+    if (g_image_buffer)
+    {
+        // the planes of whole MCUs as batch_idct_planes() writes them, the chroma of 4:4:4 or 4:2:0 files
+        const size_t luma=(size_t)allocated_width*allocated_height;
+        const size_t chroma=luma/((mcu_width>>3)*(mcu_height>>3));
+        size_t size=luma;
+        memset(g_plane_offset,0,sizeof(g_plane_offset));
+        g_plane_pitch[0]=allocated_width;
+        switch (format)
+        {
+        case PIXEL_RGB24:
+            g_plane_pitch[0]=allocated_width*3;
+            size=luma*3;
+            break;
+        case PIXEL_YCBCR:
+            g_plane_offset[1]=luma;
+            g_plane_offset[2]=luma+chroma;
+            g_plane_pitch[1]=g_plane_pitch[2]=allocated_width/(mcu_width>>3);
+            size=luma+chroma*2;
+            break;
+        case PIXEL_NV12:
+            g_plane_offset[1]=luma;
+            g_plane_pitch[1]=allocated_width;
+            size=luma+luma/2;
+            break;
+        default:
+            break;
+        }
+        g_image_data=clCreateBuffer(g_context,CL_MEM_WRITE_ONLY,size,NULL,&err);
+    }
+    else
+        g_image_data=clCreateImage2D(g_context,CL_MEM_WRITE_ONLY,format==PIXEL_RGBA?&IMG_FORMAT_RGBA:&IMG_FORMAT_BGRA,allocated_width,allocated_height,0,NULL,&err);
     if (err != CL_SUCCESS)
     {
-        fprintf(stderr, "clCreateImage2D failed (error %d)\n", err);
+        fprintf(stderr, "%s failed (error %d)\n", g_image_buffer?"clCreateBuffer":"clCreateImage2D", err);
         return false;
     }
     else
@@ -139,18 +211,22 @@ bool clidct_allocate_memory(const int total_blocks, const size_t image_width, co
         g_image_pitch=allocated_width*4;
         g_num_hor_mcu=allocated_width/mcu_width;
         g_num_ver_mcu=allocated_height/mcu_height;
+        g_frame_width=image_width;
+        g_frame_height=image_height;
     }
     return true;
 }
 
-bool clidct_transfer_data_to_device(const int block_data_src[1][64], const int offset, const int count)
+bool clidct_transfer_data_to_device(const coef_t block_data_src[1][64], const uint8_t *eob, const int offset, const int count)
 {
     assert(offset+count<=g_block_count);
     cl_int err;
     size_t write_size=0;
     // enqueue transfering dct blocks
     write_size+=BLOCK_SIZE*count;
-    err=clEnqueueWriteBuffer(g_commandq,g_block_data,CL_TRUE,0,write_size,block_data_src,0,NULL,NULL);
+    err=clEnqueueWriteBuffer(g_commandq,g_block_data,CL_TRUE,BLOCK_SIZE*offset,write_size,block_data_src,0,NULL,NULL);
+    err|=clEnqueueWriteBuffer(g_commandq,g_block_eob,CL_TRUE,offset,count,eob,0,NULL,NULL);
+    write_size+=count;
     // send
     if (err != CL_SUCCESS)
     {
@@ -164,7 +240,40 @@ bool clidct_transfer_data_to_device(const int block_data_src[1][64], const int o
     return true;
 }
 
-bool clidct_retrieve_data_from_device(int block_data_dest[1][64])
+bool clidct_transfer_sparse_data_to_device(const uint32_t *offset, const uint8_t *eob, const coef_t *value, const uint8_t *pos, const int count, const size_t num_values)
+{
+    assert(count==g_block_count);
+    cl_int err;
+    const size_t values=max(num_values,(size_t)1); // empty buffers are not allowed
+    g_sparse_offset=clCreateBuffer(g_context,CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,sizeof(uint32_t)*(count+1),(void*)offset,&err);
+    if (err==CL_SUCCESS)
+        g_sparse_value=clCreateBuffer(g_context,CL_MEM_READ_ONLY,sizeof(coef_t)*values,NULL,&err);
+    if (err==CL_SUCCESS)
+        g_sparse_pos=clCreateBuffer(g_context,CL_MEM_READ_ONLY,values,NULL,&err);
+    if (err!=CL_SUCCESS)
+    {
+        fprintf(stderr, "clCreateBuffer failed (error %d)\n", err);
+        return false;
+    }
+    err=clEnqueueWriteBuffer(g_commandq,g_block_eob,CL_TRUE,0,count,eob,0,NULL,NULL);
+    if (num_values>0)
+    {
+        err|=clEnqueueWriteBuffer(g_commandq,g_sparse_value,CL_TRUE,0,sizeof(coef_t)*num_values,value,0,NULL,NULL);
+        err|=clEnqueueWriteBuffer(g_commandq,g_sparse_pos,CL_TRUE,0,num_values,pos,0,NULL,NULL);
+    }
+    if (err != CL_SUCCESS)
+    {
+        fprintf(stderr, "clEnqueueWriteBuffer failed (error %d)\n", err);
+        return false;
+    }else
+    {
+        printf("[ ] Writing %u bytes to device...\n",(sizeof(uint32_t)*(count+1)+count+(sizeof(coef_t)+1)*num_values));
+    }
+    clFinish(g_commandq);
+    return true;
+}
+
+bool clidct_retrieve_data_from_device(coef_t block_data_dest[1][64])
 {
     cl_int err;
     size_t read_size=0;
@@ -184,16 +293,37 @@ bool clidct_retrieve_data_from_device(int block_data_dest[1][64])
     return true;
 }
 
-bool clidct_retrieve_image_from_device(void *img_data_dest, const size_t img_width, const size_t img_height)
+bool clidct_retrieve_image_from_device(DECODED_IMAGE &image)
 {
-    assert(img_width<=g_image_width && img_height<=g_image_height);
-    cl_int err;
+    assert((size_t)image.width<=g_image_width && (size_t)image.height<=g_image_height);
+    cl_int err=CL_SUCCESS;
     size_t read_size=0;
+    if (g_image_buffer)
+    {
+        // the planes without the padding of the MCUs
+        for (int i=0;i<image.num_planes && err==CL_SUCCESS;i++)
+        {
+            assert(g_plane_offset[i]%g_plane_pitch[i]==0 && (size_t)image.pitch[i]<=g_plane_pitch[i]);
+            size_t buffer_origin[3]={0,g_plane_offset[i]/g_plane_pitch[i],0};
+            size_t host_origin[3]={0,0,0};
+            size_t region[3]={(size_t)image.pitch[i],(size_t)image.plane_height[i],1};
+            err=clEnqueueReadBufferRect(g_commandq,g_image_data,CL_TRUE,buffer_origin,host_origin,region,g_plane_pitch[i],0,image.pitch[i],0,image.plane[i],0,NULL,NULL);
+            read_size+=region[0]*region[1];
+        }
+        if (err != CL_SUCCESS)
+        {
+            fprintf(stderr, "clEnqueueReadBufferRect failed (error %d)\n", err);
+            return false;
+        }
+        printf("[ ] Retrieving %u bytes from device...\n",read_size);
+        clFinish(g_commandq);
+        return true;
+    }
     // enqueue transfering image
-    read_size+=img_width*4*img_height;
+    read_size+=image.width*4*image.height;
     size_t origin[3]={0,0,0};
-    size_t region[3]={img_width,img_height,1};
-    err=clEnqueueReadImage(g_commandq,g_image_data,CL_TRUE,origin,region,img_width*4,0,img_data_dest,0,NULL,NULL);
+    size_t region[3]={(size_t)image.width,(size_t)image.height,1};
+    err=clEnqueueReadImage(g_commandq,g_image_data,CL_TRUE,origin,region,image.pitch[0],0,image.pixels,0,NULL,NULL);
     // recv
     if (err != CL_SUCCESS)
     {
@@ -207,24 +337,9 @@ bool clidct_retrieve_image_from_device(void *img_data_dest, const size_t img_wid
     return true;
 }
 
-bool clidct_build(ColorSpace colorspace)
+static cl_program build_program(const char *code_file, const char *options)
 {
-    const char *kernel_name=NULL, *code_file=NULL;
-    switch (colorspace)
-    {
-    case YUV444:
-        code_file="idct8x8.cl";
-        kernel_name="batch_idct_csc_444";
-        break;
-    case YUV411:
-        code_file="idct8x8.cl";
-        kernel_name="batch_idct_csc_411";
-        break;
-    case Other:
-        code_file="idct8x8.cl";
-        kernel_name="batch_idct"; // run IDCT only
-        break;
-    }
+    cl_program program=0;
     FILE *src=fopen(code_file,"rb");
     if (src!=NULL)
     {
@@ -242,34 +357,191 @@ bool clidct_build(ColorSpace colorspace)
             const char* code_str=code;
             size_t code_len=len;
             cl_int err;
-            g_program=clCreateProgramWithSource(g_context,1,&code_str,&code_len,&err);
-            ret=0;
+            program=clCreateProgramWithSource(g_context,1,&code_str,&code_len,&err);
             if (err==CL_SUCCESS)
             {
-                err=clBuildProgram(g_program,1,&sel_device,"-Werror",NULL,NULL);
-                if (err==CL_SUCCESS)
-                {
-                    g_entry=clCreateKernel(g_program,kernel_name,&err);
-                    if (err==CL_SUCCESS)
-                    {
-                        ret=1;
-                    }else
-                        fprintf(stderr, "clCreateKernel failed (error %d)\n", err);
-                }else
+                char build_options[256];
+                sprintf(build_options,"%s%s",options,COEF_OPTION);
+                err=clBuildProgram(program,1,&sel_device,build_options,NULL,NULL);
+                if (err!=CL_SUCCESS)
                 {
                     size_t length;
                     static char buffer[20480];
-                    clGetProgramBuildInfo(g_program, sel_device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &length);
+                    clGetProgramBuildInfo(program, sel_device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &length);
                     fprintf(stderr, "clBuildProgram failed (error %d %s)\n", err, buffer);
+                    clReleaseProgram(program);
+                    program=0;
                 }
             }
             else
+            {
                 fprintf(stderr, "clCreateProgramWithSource failed (error %d)\n", err);
+                program=0;
+            }
         }
         delete []code;
-        return ret==1;
     }
-    return false;
+    return program;
+}
+
+bool clidct_build(ColorSpace colorspace, bool sparse, IdctMode idct_mode, PixelFormat format, ChromaUpsampling upsampling)
+{
+    const char *kernel_name=NULL, *code_file=NULL;
+    int sampling=1; // of the luma, in both directions
+    switch (colorspace)
+    {
+    case YUV444:
+        code_file="idct8x8.cl";
+        kernel_name="batch_idct_csc_444";
+        break;
+    case YUV411:
+        code_file="idct8x8.cl";
+        kernel_name="batch_idct_csc_411";
+        sampling=2;
+        break;
+    case Other:
+        code_file="idct8x8.cl";
+        kernel_name="batch_idct"; // run IDCT only
+        break;
+    }
+    char options[256];
+    strcpy(options,sparse?"-Werror -DSPARSE_BLOCKS":"-Werror");
+    if (idct_mode==IDCT_FAST)
+        strcat(options," -DIDCT_FLOAT");
+    if (colorspace!=Other)
+    {
+        const bool planes=format==PIXEL_GRAY || format==PIXEL_YCBCR || format==PIXEL_NV12;
+        // BGRA and RGBA differ by the format of the image and the alpha
+        if (format==PIXEL_RGB24)
+            strcat(options," -DOUTPUT_RGB24");
+        else if (format==PIXEL_RGBA)
+            strcat(options," -DOUTPUT_ALPHA=255");
+        if (planes)
+        {
+            kernel_name="batch_idct_planes";
+            sprintf(options+strlen(options)," -DOUTPUT_PLANES -DSAMPLING_H=%d -DSAMPLING_V=%d%s",sampling,sampling,
+                format==PIXEL_GRAY?" -DOUTPUT_GRAY":format==PIXEL_NV12?" -DOUTPUT_NV12":"");
+        }
+        else if (colorspace==YUV411 && upsampling==UPSAMPLE_FANCY)
+        {
+            // libjpeg's upsampling of 4:2:0 chroma, fused with the colour conversion
+            kernel_name="batch_idct_csc_411_fancy";
+            sprintf(options+strlen(options)," -DFANCY_UPSAMPLING -DTILE_W=%d -DTILE_H=%d -DCHROMA_WIDTH=%d -DCHROMA_HEIGHT=%d",
+                FANCY_TILE_W,FANCY_TILE_H,(int)(g_frame_width+1)/2,(int)(g_frame_height+1)/2);
+            cl_int err;
+            g_chroma_scratch=clCreateBuffer(g_context,CL_MEM_READ_WRITE,BLOCK_SIZE*2*WORK_SIZE[0],NULL,&err);
+            if (err!=CL_SUCCESS)
+            {
+                fprintf(stderr, "clCreateBuffer failed (error %d)\n", err);
+                return false;
+            }
+        }
+    }
+    g_program=build_program(code_file,options);
+    if (!g_program) return false;
+    cl_int err;
+    g_entry=clCreateKernel(g_program,kernel_name,&err);
+    if (err!=CL_SUCCESS)
+    {
+        fprintf(stderr, "clCreateKernel failed (error %d)\n", err);
+        return false;
+    }
+    return true;
+}
+
+bool clidct_build_entropy_decoder()
+{
+    char options[64];
+    sprintf(options,"-Werror -DHUFFMAN_LOOKAHEAD=%d",CL_HUFFMAN_LOOKAHEAD);
+    g_huffman_program=build_program("huffman.cl",options);
+    if (!g_huffman_program) return false;
+    cl_int err;
+    g_huffman_entry=clCreateKernel(g_huffman_program,"decode_segments",&err);
+    if (err!=CL_SUCCESS)
+    {
+        fprintf(stderr, "clCreateKernel failed (error %d)\n", err);
+        return false;
+    }
+    // the preferred multiple of the work-group size is the warp or wavefront width
+    if (clGetKernelWorkGroupInfo(g_huffman_entry,sel_device,CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,sizeof(g_huffman_simd_width),&g_huffman_simd_width,NULL)!=CL_SUCCESS || \
+        g_huffman_simd_width==0)
+        g_huffman_simd_width=WORK_SIZE[0];
+    return true;
+}
+
+bool clidct_decode_entropy(const uint8_t *scan, const size_t scan_size, const CL_HUFFMAN_TABLE *tables, const int num_tables, const MCU_BLOCK_INFO *layout, const int num_mcu_blks, const int quant[4][64], const ENTROPY_SEGMENT *segments, const int num_segments)
+{
+    // the blocks are decoded straight into the buffer used by the IDCT kernels
+    const size_t sizes[]={scan_size,sizeof(ENTROPY_SEGMENT)*num_segments,sizeof(CL_HUFFMAN_TABLE)*num_tables,sizeof(MCU_BLOCK_INFO)*num_mcu_blks,sizeof(int)*4*64};
+    const void *data[]={scan,segments,tables,layout,quant};
+    cl_mem inputs[COUNT_OF(sizes)]={0};
+    cl_mem status=0;
+    int *result=new int[num_segments];
+    bool ret=false;
+    cl_int err=CL_SUCCESS;
+    size_t write_size=0;
+    size_t global_size;
+    for (size_t i=0;i<COUNT_OF(sizes) && err==CL_SUCCESS;i++)
+    {
+        inputs[i]=clCreateBuffer(g_context,CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,sizes[i],const_cast<void*>(data[i]),&err);
+        write_size+=sizes[i];
+    }
+    if (err==CL_SUCCESS)
+        status=clCreateBuffer(g_context,CL_MEM_WRITE_ONLY,sizeof(int)*num_segments,NULL,&err);
+    if (err!=CL_SUCCESS)
+    {
+        fprintf(stderr, "clCreateBuffer failed (error %d)\n", err);
+        goto cleanup;
+    }
+    printf("[ ] Writing %u bytes to device...\n",(unsigned)write_size);
+
+    err=clSetKernelArg(g_huffman_entry,0,sizeof(cl_mem),&inputs[0]);
+    err|=clSetKernelArg(g_huffman_entry,1,sizeof(cl_mem),&inputs[1]);
+    err|=clSetKernelArg(g_huffman_entry,2,sizeof(int),&num_segments);
+    err|=clSetKernelArg(g_huffman_entry,3,sizeof(cl_mem),&inputs[2]);
+    err|=clSetKernelArg(g_huffman_entry,4,sizeof(cl_mem),&inputs[3]);
+    err|=clSetKernelArg(g_huffman_entry,5,sizeof(int),&num_mcu_blks);
+    err|=clSetKernelArg(g_huffman_entry,6,sizeof(cl_mem),&inputs[4]);
+    err|=clSetKernelArg(g_huffman_entry,7,sizeof(cl_mem),&g_block_data);
+    err|=clSetKernelArg(g_huffman_entry,8,sizeof(cl_mem),&g_block_eob);
+    err|=clSetKernelArg(g_huffman_entry,9,sizeof(cl_mem),&status);
+    if (err!=CL_SUCCESS)
+    {
+        fprintf(stderr, "clSetKernelArg failed (error %d)\n", err);
+        goto cleanup;
+    }
+    // one work-item per segment, in whole warps or wavefronts
+    global_size=(num_segments+g_huffman_simd_width-1)/g_huffman_simd_width*g_huffman_simd_width;
+    err=clEnqueueNDRangeKernel(g_commandq,g_huffman_entry,1,NULL,&global_size,NULL,0,NULL,NULL);
+    if (err!=CL_SUCCESS)
+    {
+        fprintf(stderr, "clEnqueueNDRangeKernel failed (error %d)\n", err);
+        goto cleanup;
+    }
+    err=clEnqueueReadBuffer(g_commandq,status,CL_TRUE,0,sizeof(int)*num_segments,result,0,NULL,NULL);
+    if (err!=CL_SUCCESS)
+    {
+        fprintf(stderr, "clEnqueueReadBuffer failed (error %d)\n", err);
+        goto cleanup;
+    }
+    ret=true;
+    for (int i=0;i<num_segments;i++)
+    {
+        if (result[i]!=0)
+        {
+            printf("[X] device failed to decode block %d\n",segments[i].first_block+result[i]-1);
+            ret=false;
+            break;
+        }
+    }
+cleanup:
+    if (status) clReleaseMemObject(status);
+    for (size_t i=0;i<COUNT_OF(inputs);i++)
+    {
+        if (inputs[i]) clReleaseMemObject(inputs[i]);
+    }
+    delete[] result;
+    return ret;
 }
 
 bool clidct_run(ColorSpace colorspace)
@@ -277,19 +549,30 @@ bool clidct_run(ColorSpace colorspace)
     cl_int err;
     // set execution arguments
     err=clSetKernelArg(g_entry,0,sizeof(cl_mem),&g_block_data);
-    err|=clSetKernelArg(g_entry,1,sizeof(int),&g_block_count);
+    err|=clSetKernelArg(g_entry,1,sizeof(cl_mem),&g_block_eob);
+    err|=clSetKernelArg(g_entry,2,sizeof(int),&g_block_count);
     if (colorspace!=Other)
     {
         // if the colorspace is known, perform color space conversion on GPU and we have image memory in VRAM
-        err|=clSetKernelArg(g_entry,2,sizeof(cl_mem),&g_image_data);
-        err|=clSetKernelArg(g_entry,3,sizeof(int),&g_num_hor_mcu);
+        err|=clSetKernelArg(g_entry,3,sizeof(cl_mem),&g_image_data);
+        err|=clSetKernelArg(g_entry,4,sizeof(int),&g_num_hor_mcu);
     }
+    if (g_sparse_offset)
+    {
+        const int first_arg=colorspace!=Other?5:3;
+        err|=clSetKernelArg(g_entry,first_arg,sizeof(cl_mem),&g_sparse_offset);
+        err|=clSetKernelArg(g_entry,first_arg+1,sizeof(cl_mem),&g_sparse_value);
+        err|=clSetKernelArg(g_entry,first_arg+2,sizeof(cl_mem),&g_sparse_pos);
+    }
+    if (g_chroma_scratch)
+        err|=clSetKernelArg(g_entry,g_sparse_offset?8:5,sizeof(cl_mem),&g_chroma_scratch);
     if (err!=CL_SUCCESS)
     {
         fprintf(stderr, "clSetKernelArg failed (error %d)\n", err);
         return false;
     }
-    err=clEnqueueNDRangeKernel(g_commandq,g_entry,COUNT_OF(WORK_SIZE),NULL,&WORK_SIZE[0],NULL,0,NULL,NULL);
+    // the work-items of a group of the fancy upsampling kernel share a tile of chroma in local memory
+    err=clEnqueueNDRangeKernel(g_commandq,g_entry,COUNT_OF(WORK_SIZE),NULL,&WORK_SIZE[0],g_chroma_scratch?&FANCY_GROUP_SIZE[0]:NULL,0,NULL,NULL);
     if (err!=CL_SUCCESS)
     {
         fprintf(stderr, "clEnqueueNDRangeKernel failed (error %d)\n", err);
@@ -305,6 +588,16 @@ bool clidct_wait_for_completion()
 
 bool clidct_clean_up()
 {
+    if (g_huffman_entry)
+    {
+        clReleaseKernel(g_huffman_entry);
+        g_huffman_entry=0;
+    }
+    if (g_huffman_program)
+    {
+        clReleaseProgram(g_huffman_program);
+        g_huffman_program=0;
+    }
     if (g_entry)
     {
         clReleaseKernel(g_entry);
@@ -321,12 +614,37 @@ bool clidct_clean_up()
         g_image_data=0;
         g_image_pitch=0;
     }
+    if (g_sparse_offset)
+    {
+        clReleaseMemObject(g_sparse_offset);
+        g_sparse_offset=0;
+    }
+    if (g_sparse_value)
+    {
+        clReleaseMemObject(g_sparse_value);
+        g_sparse_value=0;
+    }
+    if (g_sparse_pos)
+    {
+        clReleaseMemObject(g_sparse_pos);
+        g_sparse_pos=0;
+    }
+    if (g_chroma_scratch)
+    {
+        clReleaseMemObject(g_chroma_scratch);
+        g_chroma_scratch=0;
+    }
     if (g_block_data)
     {
         clReleaseMemObject(g_block_data);
         g_block_data=0;
         g_block_count=0;
     }
+    if (g_block_eob)
+    {
+        clReleaseMemObject(g_block_eob);
+        g_block_eob=0;
+    }
     if (g_commandq)
     {
         clReleaseCommandQueue(g_commandq);
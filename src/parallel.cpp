@@ -0,0 +1,682 @@
+#include "stdafx.h"
+#include <thread>
+#include <atomic>
+#include <chrono>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <intrin.h>
+    #define HAVE_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define HAVE_RDTSC
+#endif
+
+#include "macro.h"
+#include "jpeg.h"
+#include "bytesource.h"
+#include "bitstream.h"
+#include "bitreader.h"
+#include "huffman.h"
+#include "huffcache.h"
+#include "zigzag.h"
+#include "idct.h"
+#include "decoder.h"
+#include "entropy.h"
+#include "scan.h"
+
+// The scan is first cut into segments that can be decoded independently: restart
+// intervals when the image has them, or runs of blocks found by speculative decoding
+// otherwise. The segments are then decoded by worker threads or by the OpenCL device.
+
+static int get_num_threads()
+{
+    if (decoder_options.threads>0) return decoder_options.threads;
+    const int n=std::thread::hardware_concurrency();
+    return n>0?n:1;
+}
+
+// run worker(thread index) on num_threads threads including the calling one
+template <class Worker>
+static void run_on_threads(const int num_threads, const Worker &worker)
+{
+    std::vector<std::thread> threads;
+    for (int i=1;i<num_threads;i++)
+        threads.push_back(std::thread(worker,i));
+    worker(0);
+    for (size_t i=0;i<threads.size();i++)
+        threads[i].join();
+}
+
+// lower an atomic value to val if val is smaller
+static void atomic_min(std::atomic<int> &target, const int val)
+{
+    int cur=target.load();
+    while (val<cur && !target.compare_exchange_weak(cur,val));
+}
+
+// what is needed to decode a block, by its index inside the MCU
+template <class HuffDecoder>
+struct MCU_BLOCK
+{
+    const HuffDecoder *dc;
+    const HuffDecoder *ac;
+    const coef_t *qt;
+    int channel;
+};
+
+template <class HuffDecoder>
+static std::vector<MCU_BLOCK<HuffDecoder> > get_mcu_layout(const JPG_DATA &jpg, const HuffDecoderSet<HuffDecoder> &htree)
+{
+    std::vector<MCU_BLOCK<HuffDecoder> > layout;
+    for (int ch_idx=0;ch_idx<jpg.scan_info.num_channels;ch_idx++)
+    {
+        MCU_BLOCK<HuffDecoder> blk;
+        blk.dc=htree[jpg.scan_info.channel_data[ch_idx].huff_tbl_id>>4];
+        blk.ac=htree[0x10|(jpg.scan_info.channel_data[ch_idx].huff_tbl_id&0xF)];
+        blk.qt=jpg.quantization_table[jpg.frame_info.channel_info[ch_idx].quant_tbl_id];
+        blk.channel=ch_idx;
+        vassert(blk.dc!=NULL && blk.ac!=NULL);
+        for (int blk_idx=0;blk_idx<jpg.blks_per_mcu[ch_idx];blk_idx++)
+            layout.push_back(blk);
+    }
+    return layout;
+}
+
+template <class HuffDecoder, class BlockSink>
+// error_block: the block that failed to decode or went past the end of the segment
+static bool decode_segment(const std::vector<MCU_BLOCK<HuffDecoder> > &layout, const SCAN_DATA &scan, const ENTROPY_SEGMENT &seg, BlockSink &sink, int &error_block)
+{
+    BitStream strm;
+    strm.attach(scan.data,scan.size);
+    strm.cachedSeek(seg.bit_pos);
+    coef_t dc_coef[4];
+    for (int ch_idx=0;ch_idx<4;ch_idx++)
+        dc_coef[ch_idx]=seg.dc_coef[ch_idx];
+    int mcu_blk=seg.mcu_blk;
+    for (int n=0;n<seg.num_blocks;n++)
+    {
+        const MCU_BLOCK<HuffDecoder> &blk=layout[mcu_blk];
+        if (!sink.decode(strm,dc_coef[blk.channel],*blk.dc,*blk.ac,blk.qt,seg.first_block+n) || strm.cachedTell()>seg.end_bit_pos)
+        {
+            error_block=seg.first_block+n;
+            return false;
+        }
+        if (++mcu_blk==(int)layout.size()) mcu_blk=0;
+    }
+    return true;
+}
+
+// decode n segments in lockstep, one symbol of every segment in turn, so that the dependency
+// chains of their Huffman codes overlap; every segment has its own bit stream and DC predictors
+// returns the index of a segment that failed, or n, with error_block[] like decode_segment()
+template <class HuffDecoder, class BlockSink>
+static int decode_segments_interleaved(const std::vector<MCU_BLOCK<HuffDecoder> > &layout, const SCAN_DATA &scan, const ENTROPY_SEGMENT *segs, const int n, BlockSink *sinks, int *error_block)
+{
+    vassert(n<=MAX_INTERLEAVE);
+    BitStream strm[MAX_INTERLEAVE];
+    coef_t dc_coef[MAX_INTERLEAVE][4];
+    int mcu_blk[MAX_INTERLEAVE];
+    int block[MAX_INTERLEAVE]; // blocks of the segment done
+    int count[MAX_INTERLEAVE]; // coefficients of the current block done
+    std::vector<typename BlockSink::Output> out;
+    for (int s=0;s<n;s++)
+    {
+        strm[s].attach(scan.data,scan.size);
+        strm[s].cachedSeek(segs[s].bit_pos);
+        for (int ch_idx=0;ch_idx<4;ch_idx++)
+            dc_coef[s][ch_idx]=segs[s].dc_coef[ch_idx];
+        mcu_blk[s]=segs[s].mcu_blk;
+        block[s]=0;
+        count[s]=0;
+        out.push_back(sinks[s].output());
+        if (segs[s].num_blocks>0)
+            sinks[s].begin(out[s],layout[mcu_blk[s]].qt,segs[s].first_block);
+    }
+    for (int active=n;active>0;)
+    {
+        active=0;
+        for (int s=0;s<n;s++)
+        {
+            if (block[s]==segs[s].num_blocks) continue;
+            active++;
+            const MCU_BLOCK<HuffDecoder> &blk=layout[mcu_blk[s]];
+            const SymbolResult r=decode_huffman_symbol(strm[s],dc_coef[s][blk.channel],out[s],*blk.dc,*blk.ac,count[s]);
+            if (r==SYMBOL_MORE) continue;
+            if (r==SYMBOL_ERROR || strm[s].cachedTell()>segs[s].end_bit_pos)
+            {
+                error_block[s]=segs[s].first_block+block[s];
+                return s;
+            }
+            sinks[s].end(out[s],segs[s].first_block+block[s]);
+            count[s]=0;
+            if (++mcu_blk[s]==(int)layout.size()) mcu_blk[s]=0;
+            if (++block[s]<segs[s].num_blocks)
+                sinks[s].begin(out[s],layout[mcu_blk[s]].qt,segs[s].first_block+block[s]);
+        }
+    }
+    return n;
+}
+
+// decode up to MAX_INTERLEAVE segments with one sink each
+// returns the index of a segment that failed, or n
+template <class HuffDecoder, class BlockSink>
+static int decode_segment_group(const std::vector<MCU_BLOCK<HuffDecoder> > &layout, const SCAN_DATA &scan, const ENTROPY_SEGMENT *segs, const int n, BlockSink *sinks, int *error_block)
+{
+    if (n==1)
+        return decode_segment(layout,scan,segs[0],sinks[0],error_block[0])?1:0;
+    return decode_segments_interleaved(layout,scan,segs,n,sinks,error_block);
+}
+
+template <class HuffDecoder>
+static bool decode_segments(const JPG_DATA &jpg, const std::vector<MCU_BLOCK<HuffDecoder> > &layout, const SCAN_DATA &scan, const std::vector<ENTROPY_SEGMENT> &segments)
+{
+    const int num_segments=segments.size();
+    // sparse coefficients are collected per segment and put together afterwards
+    std::vector<std::vector<coef_t> > values(jpg.sparse_data!=NULL?num_segments:0);
+    std::vector<std::vector<uint8_t> > positions(values.size());
+    std::atomic<int> next_segment(0);
+    std::atomic<int> first_error(num_segments);
+    std::vector<int> error_block(num_segments);
+    // every thread takes this many segments at a time and decodes them in lockstep
+    const int interleave=max(1,min(decoder_options.interleave,MAX_INTERLEAVE));
+    const int num_threads=min(get_num_threads(),(num_segments+interleave-1)/interleave);
+    if (interleave>1)
+        printf("[ ] decoding %d segments on %d threads, %d at a time\n",num_segments,num_threads,interleave);
+    else
+        printf("[ ] decoding %d segments on %d threads\n",num_segments,num_threads);
+    run_on_threads(num_threads,[&](const int)
+    {
+        int k;
+        while ((k=next_segment.fetch_add(interleave))<num_segments)
+        {
+            const int n=min(interleave,num_segments-k);
+            int failed;
+            if (jpg.sparse_data!=NULL)
+            {
+                std::vector<SparseBlockSink> sinks;
+                for (int i=0;i<n;i++)
+                    sinks.push_back(SparseBlockSink(*jpg.sparse_data,values[k+i],positions[k+i]));
+                failed=decode_segment_group(layout,scan,&segments[k],n,&sinks[0],&error_block[k]);
+            }
+            else
+            {
+                std::vector<DenseBlockSink> sinks(n,DenseBlockSink(jpg.mcu_data,jpg.mcu_eob));
+                failed=decode_segment_group(layout,scan,&segments[k],n,&sinks[0],&error_block[k]);
+            }
+            if (failed<n) atomic_min(first_error,k+failed);
+        }
+    });
+    if (first_error<num_segments)
+    {
+        // the earliest failure in the scan, like the serial decoder reports it
+        const int blk=error_block[first_error];
+        const int mcu_blk=blk%layout.size();
+        const int ch_idx=layout[mcu_blk].channel;
+        int blk_idx=0;
+        for (int i=0;i<mcu_blk;i++)
+            blk_idx+=layout[i].channel==ch_idx;
+        printf("[X] data corrupted. (%d/%d mcu %d/%d ch %d/%d blk)\n",blk/(int)layout.size(),jpg.mcu_count,ch_idx,jpg.scan_info.num_channels,blk_idx,jpg.blks_per_mcu[ch_idx]);
+        return false;
+    }
+    if (jpg.sparse_data!=NULL)
+    {
+        SPARSE_BLOCKS &sparse=*jpg.sparse_data;
+        finish_sparse_blocks(sparse);
+        sparse.value.resize(sparse.offset[jpg.blk_count]);
+        sparse.pos.resize(sparse.offset[jpg.blk_count]);
+        for (int k=0;k<num_segments;k++)
+        {
+            const size_t first=sparse.offset[segments[k].first_block];
+            std::copy(values[k].begin(),values[k].end(),sparse.value.begin()+first);
+            std::copy(positions[k].begin(),positions[k].end(),sparse.pos.begin()+first);
+        }
+    }
+    return true;
+}
+
+// every restart interval begins with reset DC predictors at a known MCU
+static bool get_restart_segments(const JPG_DATA &jpg, const SCAN_DATA &scan, std::vector<ENTROPY_SEGMENT> &segments)
+{
+    const int interval=jpg.dri_info.restart_interval;
+    const int num_intervals=(jpg.mcu_count+interval-1)/interval;
+    // every interval but the last one is terminated by RSTn
+    if ((int)scan.restart_offsets.size()<num_intervals-1)
+    {
+        printf("[X] expected %d restart markers, found %u\n",num_intervals-1,(unsigned)scan.restart_offsets.size());
+        return false;
+    }
+    for (int k=0;k<num_intervals;k++)
+    {
+        if (k<num_intervals-1 && scan.data[scan.restart_offsets[k]]!=(uint8_t)0xD0+(k&7))
+        {
+            printf("[X] expected RST%d (interval = %d; %d/%d mcu)\n",k&7,interval,(k+1)*interval,jpg.mcu_count);
+            return false;
+        }
+        const size_t start=k>0?scan.restart_offsets[k-1]+1:0;
+        const size_t end=k<num_intervals-1?scan.restart_offsets[k]:scan.size;
+        const int first_mcu=k*interval;
+        ENTROPY_SEGMENT seg={(uint64_t)start<<3,(uint64_t)end<<3,0,first_mcu*jpg.tot_blks_per_mcu,min(interval,jpg.mcu_count-first_mcu)*jpg.tot_blks_per_mcu,{0}};
+        segments.push_back(seg);
+    }
+    return true;
+}
+
+// Speculative decoding of scans without restart markers
+//
+// The scan is split into chunks which are decoded at the same time, each one starting at
+// its first bit as if an MCU began there. Huffman codes resynchronize quickly, so after a
+// few blocks such a decoder usually lands on a true block boundary and decodes correctly
+// from then on, except for DC values which are kept as differences.
+// A sequential pass then follows the true decoding chain: it decodes blocks itself until
+// the chain meets a boundary found by the next chunk (same bit position and same block
+// of the MCU), then skips to that chunk's end. The runs skipped this way become segments
+// whose DC predictors are rebuilt from the recorded differences, and so do the blocks
+// decoded by the sequential pass, which are decoded again with the others.
+
+// smaller chunks spend most of their time resynchronizing
+const size_t MIN_SPECULATIVE_CHUNK=32768;
+
+// a block boundary reached by a speculative decoder
+struct SPECULATIVE_BLOCK
+{
+    size_t bit_pos;
+    int mcu_blk; // index of the block inside the MCU
+    coef_t dc_diff;
+};
+
+// blocks decoded without error after a (re)start of a speculative decoder
+struct SPECULATIVE_RUN
+{
+    size_t end; // index after the last block
+    size_t end_bit_pos;
+    int end_mcu_blk;
+};
+
+struct SPECULATIVE_CHUNK
+{
+    size_t begin_bit_pos;
+    std::vector<SPECULATIVE_BLOCK> blocks; // sorted by bit_pos
+    std::vector<SPECULATIVE_RUN> runs;
+};
+
+static void close_speculative_run(SPECULATIVE_CHUNK &chunk, const size_t end_bit_pos, const int end_mcu_blk)
+{
+    const size_t begin=chunk.runs.empty()?0:chunk.runs.back().end;
+    if (chunk.blocks.size()>begin)
+        chunk.runs.push_back({chunk.blocks.size(),end_bit_pos,end_mcu_blk});
+}
+
+template <class HuffDecoder>
+static void decode_speculatively(const std::vector<MCU_BLOCK<HuffDecoder> > &layout, const SCAN_DATA &scan, const size_t end_bit_pos, SPECULATIVE_CHUNK &chunk)
+{
+    const size_t total_bits=scan.size<<3;
+    const int num_mcu_blks=layout.size();
+    BitStream strm;
+    strm.attach(scan.data,scan.size);
+    size_t pos=chunk.begin_bit_pos;
+    int mcu_blk=0;
+    strm.cachedSeek(pos);
+    while (pos<end_bit_pos)
+    {
+        const MCU_BLOCK<HuffDecoder> &blk=layout[mcu_blk];
+        coef_t dc_diff=0;
+        DiscardOutput out;
+        const bool ok=decode_huffman_block(strm,dc_diff,out,*blk.dc,*blk.ac);
+        if (ok && strm.cachedTell()>total_bits) break; // ran into the padding
+        if (!ok)
+        {
+            // pos was not a block boundary after all: restart one bit later
+            close_speculative_run(chunk,pos,mcu_blk);
+            strm.cachedSeek(++pos);
+            mcu_blk=0;
+            continue;
+        }
+        chunk.blocks.push_back({pos,mcu_blk,dc_diff});
+        pos=strm.cachedTell();
+        if (++mcu_blk==num_mcu_blks) mcu_blk=0;
+    }
+    close_speculative_run(chunk,pos,mcu_blk);
+}
+
+#ifndef USE_CPU_ONLY
+static bool build_device_entropy_decoder()
+{
+    static bool built=false;
+    if (!built && !clidct_build_entropy_decoder())
+    {
+        puts("[X] failed to build the opencl huffman decoder.");
+        return false;
+    }
+    built=true;
+    return true;
+}
+#endif
+
+template <class HuffDecoder>
+static bool get_speculative_segments(const JPG_DATA &jpg, const std::vector<MCU_BLOCK<HuffDecoder> > &layout, const SCAN_DATA &scan, std::vector<ENTROPY_SEGMENT> &segments)
+{
+    const size_t total_bits=scan.size<<3;
+    const int num_threads=get_num_threads();
+    // every thread needs a segment for each stream it interleaves
+    const int chunks_per_thread=decoder_options.benchmark?MAX_INTERLEAVE:max(decoder_options.interleave,1);
+    const int num_chunks=min((size_t)(num_threads*chunks_per_thread),scan.size/MIN_SPECULATIVE_CHUNK);
+    if (num_chunks<2)
+    {
+        // nothing to gain, the whole scan is one segment
+        ENTROPY_SEGMENT seg={0,total_bits,0,0,jpg.blk_count,{0}};
+        segments.push_back(seg);
+        return true;
+    }
+    const int num_mcu_blks=layout.size();
+
+    // 1. speculative decoding
+    std::vector<SPECULATIVE_CHUNK> chunks(num_chunks);
+    for (int k=0;k<num_chunks;k++)
+        chunks[k].begin_bit_pos=(scan.size*k/num_chunks)<<3;
+    printf("[ ] speculative decoding of %d chunks on %d threads\n",num_chunks,min(num_threads,num_chunks));
+    std::atomic<int> next_chunk(0);
+    run_on_threads(min(num_threads,num_chunks),[&](const int)
+    {
+        int k;
+        while ((k=next_chunk++)<num_chunks)
+            decode_speculatively(layout,scan,k+1<num_chunks?chunks[k+1].begin_bit_pos:total_bits,chunks[k]);
+    });
+
+    // 2. follow the true decoding chain
+    BitStream strm;
+    strm.attach(scan.data,scan.size);
+    size_t pos=0;
+    int mcu_blk=0;
+    int block_idx=0;
+    coef_t dc_coef[4]={0};
+    int num_synced_chunks=0;
+    bool in_gap=false; // decoding blocks between synchronized runs
+    ENTROPY_SEGMENT gap;
+    for (int k=0;k<num_chunks && block_idx<jpg.blk_count;k++)
+    {
+        const SPECULATIVE_CHUNK &chunk=chunks[k];
+        const size_t chunk_end=k+1<num_chunks?chunks[k+1].begin_bit_pos:(size_t)-1;
+        size_t i=0,run=0;
+        bool chunk_synced=false;
+        while (block_idx<jpg.blk_count && pos<chunk_end)
+        {
+            while (i<chunk.blocks.size() && chunk.blocks[i].bit_pos<pos) i++;
+            if (i<chunk.blocks.size() && chunk.blocks[i].bit_pos==pos && chunk.blocks[i].mcu_blk==mcu_blk)
+            {
+                // synchronized: the rest of this run is correct
+                if (in_gap)
+                {
+                    segments.push_back(gap);
+                    in_gap=false;
+                }
+                while (chunk.runs[run].end<=i) run++;
+                const SPECULATIVE_RUN &r=chunk.runs[run];
+                const int n=min(r.end-i,(size_t)(jpg.blk_count-block_idx));
+                ENTROPY_SEGMENT seg={pos,total_bits,mcu_blk,block_idx,n,{0}};
+                for (int ch_idx=0;ch_idx<4;ch_idx++)
+                    seg.dc_coef[ch_idx]=dc_coef[ch_idx];
+                segments.push_back(seg);
+                for (size_t j=i;j<i+n;j++)
+                    dc_coef[layout[chunk.blocks[j].mcu_blk].channel]+=chunk.blocks[j].dc_diff;
+                block_idx+=n;
+                i+=n;
+                if (i<r.end)
+                {
+                    pos=chunk.blocks[i].bit_pos;
+                    mcu_blk=chunk.blocks[i].mcu_blk;
+                }
+                else
+                {
+                    pos=r.end_bit_pos;
+                    mcu_blk=r.end_mcu_blk;
+                }
+                chunk_synced=true;
+                continue;
+            }
+            // not synchronized yet: decode the block here
+            if (!in_gap)
+            {
+                ENTROPY_SEGMENT seg={pos,total_bits,mcu_blk,block_idx,0,{0}};
+                for (int ch_idx=0;ch_idx<4;ch_idx++)
+                    seg.dc_coef[ch_idx]=dc_coef[ch_idx];
+                gap=seg;
+                in_gap=true;
+            }
+            const MCU_BLOCK<HuffDecoder> &blk=layout[mcu_blk];
+            const int ch_idx=blk.channel;
+            DiscardOutput out;
+            if (strm.cachedTell()!=pos) strm.cachedSeek(pos);
+            if (!decode_huffman_block(strm,dc_coef[ch_idx],out,*blk.dc,*blk.ac))
+            {
+                printf("[X] data corrupted. (%d/%d mcu %d/%d ch)\n",block_idx/num_mcu_blks,jpg.mcu_count,ch_idx,jpg.scan_info.num_channels);
+                return false;
+            }
+            if (strm.cachedTell()>total_bits)
+            {
+                printf("[X] data incomplete. (%d/%d mcu)\n",block_idx/num_mcu_blks,jpg.mcu_count);
+                return false;
+            }
+            pos=strm.cachedTell();
+            block_idx++;
+            gap.num_blocks++;
+            if (++mcu_blk==num_mcu_blks) mcu_blk=0;
+        }
+        if (chunk_synced) num_synced_chunks++;
+    }
+    if (in_gap) segments.push_back(gap);
+    if (block_idx<jpg.blk_count)
+    {
+        printf("[X] data incomplete. (%d/%d mcu)\n",block_idx/num_mcu_blks,jpg.mcu_count);
+        return false;
+    }
+    printf("[ ] %d/%d chunks synchronized\n",num_synced_chunks,num_chunks);
+    return true;
+}
+
+#ifndef USE_CPU_ONLY
+// decode the segments into the block buffer of the device
+static bool decode_segments_on_device(const JPG_DATA &jpg, const SCAN_DATA &scan, const std::vector<ENTROPY_SEGMENT> &segments)
+{
+    if (!build_device_entropy_decoder()) return false;
+
+    STATIC_ASSERT(HUFFMAN_LOOKAHEAD==CL_HUFFMAN_LOOKAHEAD);
+    int table_index[32];
+    int num_tables=0;
+    CL_HUFFMAN_TABLE *tables=new CL_HUFFMAN_TABLE[32];
+    for (int i=0;i<32;i++)
+    {
+        table_index[i]=-1;
+        if (jpg.huffman_table[i]==NULL) continue;
+        const HufTable *cached=huffman_cache_acquire(*jpg.huffman_table[i],(i&0x10)!=0);
+        const HufTable *t=cached!=NULL?cached:new HufTable(jpg.huffman_table[i]->count_by_length,jpg.huffman_table[i]->value);
+        CL_HUFFMAN_TABLE &cl=tables[num_tables];
+        memset(&cl,0,sizeof(cl));
+        memcpy(cl.lookup,t->lookupTable(),sizeof(cl.lookup));
+        memcpy(cl.max_code,t->maxCodes(),sizeof(int32_t)*17);
+        memcpy(cl.val_offset,t->valueOffsets(),sizeof(int32_t)*17);
+        memcpy(cl.symbols,t->symbolTable(),sizeof(cl.symbols));
+        if (cached!=NULL)
+            huffman_cache_release(cached);
+        else
+            delete t;
+        table_index[i]=num_tables++;
+    }
+    std::vector<MCU_BLOCK_INFO> layout;
+    for (int ch_idx=0;ch_idx<jpg.scan_info.num_channels;ch_idx++)
+    {
+        MCU_BLOCK_INFO blk;
+        blk.dc_table=table_index[jpg.scan_info.channel_data[ch_idx].huff_tbl_id>>4];
+        blk.ac_table=table_index[0x10|(jpg.scan_info.channel_data[ch_idx].huff_tbl_id&0xF)];
+        blk.quant_table=jpg.frame_info.channel_info[ch_idx].quant_tbl_id;
+        blk.channel=ch_idx;
+        for (int blk_idx=0;blk_idx<jpg.blks_per_mcu[ch_idx];blk_idx++)
+            layout.push_back(blk);
+    }
+    int quant[4][64]={{0}};
+    for (int i=0;i<4;i++)
+    {
+        if (jpg.quantization_table[i]==NULL) continue;
+        for (int pos=0;pos<64;pos++)
+            quant[i][pos]=jpg.quantization_table[i][pos];
+    }
+
+    clock_t timestamp=clock();
+    const bool ret=clidct_decode_entropy(scan.data,scan.size+SCAN_DATA_PADDING,tables,num_tables,&layout[0],layout.size(),quant,&segments[0],segments.size());
+    printf("Time elapsed for huffman decoding on device: %ld\n",clock()-timestamp);
+    delete[] tables;
+    return ret;
+}
+
+// compare the blocks decoded by the device with jpg.mcu_data
+static bool verify_device_coefficients(const JPG_DATA &jpg)
+{
+    coef_t (*device_blocks)[64]=new coef_t[jpg.blk_count][64];
+    bool ret=clidct_retrieve_data_from_device(device_blocks);
+    if (ret)
+    {
+        for (int i=0;i<jpg.blk_count;i++)
+        {
+            if (memcmp(device_blocks[i],jpg.mcu_data[i],sizeof(device_blocks[i])))
+            {
+                printf("[X] device coefficients differ from the CPU decoder. (block %d/%d)\n",i,jpg.blk_count);
+                ret=false;
+                break;
+            }
+        }
+        if (ret) printf("[ ] device coefficients match the CPU decoder. (%d blocks)\n",jpg.blk_count);
+    }
+    delete[] device_blocks;
+    return ret;
+}
+#endif
+
+// time stamp counter where there is one, nanoseconds otherwise
+static uint64_t read_cycle_counter()
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Huffman symbols in a segment, run/value pairs, EOB and ZRL included
+template <class HuffDecoder>
+static size_t count_segment_symbols(const std::vector<MCU_BLOCK<HuffDecoder> > &layout, const SCAN_DATA &scan, const ENTROPY_SEGMENT &seg)
+{
+    BitStream strm;
+    strm.attach(scan.data,scan.size);
+    strm.cachedSeek(seg.bit_pos);
+    coef_t dc_coef[4]={0};
+    int mcu_blk=seg.mcu_blk;
+    size_t symbols=0;
+    for (int n=0;n<seg.num_blocks;n++)
+    {
+        const MCU_BLOCK<HuffDecoder> &blk=layout[mcu_blk];
+        DiscardOutput out;
+        int count=0;
+        SymbolResult r;
+        do
+        {
+            r=decode_huffman_symbol(strm,dc_coef[blk.channel],out,*blk.dc,*blk.ac,count);
+            symbols++;
+        }while (r==SYMBOL_MORE);
+        if (r==SYMBOL_ERROR) break;
+        if (++mcu_blk==(int)layout.size()) mcu_blk=0;
+    }
+    return symbols;
+}
+
+// entropy decoding on one thread with every interleave factor, the first one being the
+// single-stream loop of decode_segment()
+template <class HuffDecoder>
+static void bench_interleaved_decoding(const JPG_DATA &jpg, const std::vector<MCU_BLOCK<HuffDecoder> > &layout, const SCAN_DATA &scan, const std::vector<ENTROPY_SEGMENT> &segments)
+{
+    const int num_segments=segments.size();
+    const int rounds=5;
+    size_t symbols=0;
+    for (int k=0;k<num_segments;k++)
+        symbols+=count_segment_symbols(layout,scan,segments[k]);
+    coef_t (*blocks)[64]=new coef_t[jpg.blk_count][64];
+    uint8_t *eob=new uint8_t[jpg.blk_count];
+    std::vector<DenseBlockSink> sinks(MAX_INTERLEAVE,DenseBlockSink(blocks,eob));
+    int error_block[MAX_INTERLEAVE];
+    printf("[ ] benchmark: %lu symbols in %d segments, best of %d rounds\n",(unsigned long)symbols,num_segments,rounds);
+    for (int interleave=1;interleave<=MAX_INTERLEAVE;interleave++)
+    {
+        uint64_t best=(uint64_t)-1;
+        for (int round=0;round<rounds;round++)
+        {
+            const uint64_t start=read_cycle_counter();
+            for (int k=0;k<num_segments;k+=interleave)
+                decode_segment_group(layout,scan,&segments[k],min(interleave,num_segments-k),&sinks[0],error_block);
+            best=min(best,read_cycle_counter()-start);
+        }
+    #ifdef HAVE_RDTSC
+        printf("[ ] %d stream(s): %llu cycles, %.3f symbols/cycle\n",interleave,(unsigned long long)best,(double)symbols/best);
+    #else
+        printf("[ ] %d stream(s): %llu ns, %.3f symbols/ns\n",interleave,(unsigned long long)best,(double)symbols/best);
+    #endif
+    }
+    delete[] blocks;
+    delete[] eob;
+}
+
+template <class HuffDecoder>
+static bool decode_scan_data(const JPG_DATA &jpg, const SCAN_DATA &scan, bool &on_device)
+{
+    const HuffDecoderSet<HuffDecoder> htree(jpg);
+    const std::vector<MCU_BLOCK<HuffDecoder> > layout=get_mcu_layout(jpg,htree);
+    std::vector<ENTROPY_SEGMENT> segments;
+    if (jpg.dri_info.restart_interval>0)
+    {
+        if (!get_restart_segments(jpg,scan,segments)) return false;
+    }
+    else
+    {
+        if (!get_speculative_segments(jpg,layout,scan,segments)) return false;
+    }
+    if (decoder_options.benchmark)
+        bench_interleaved_decoding(jpg,layout,scan,segments);
+
+    on_device=false;
+    #ifndef USE_CPU_ONLY
+        // without restart markers, the threads have already decoded the whole scan
+        // speculatively to find the segments, the device would only decode it again
+        if (decoder_options.device_entropy && jpg.dri_info.restart_interval==0)
+            puts("[ ] no restart markers, huffman decoding stays on the CPU.");
+        else if (decoder_options.device_entropy)
+        {
+            on_device=decode_segments_on_device(jpg,scan,segments);
+            if (!on_device)
+                puts("[ ] decoding on the CPU instead.");
+            else if (!decoder_options.verify_device)
+                return true;
+        }
+    #endif
+
+    if (!decode_segments(jpg,layout,scan,segments)) return false;
+
+    #ifndef USE_CPU_ONLY
+        if (on_device) return verify_device_coefficients(jpg);
+    #endif
+    return true;
+}
+
+bool decode_huffman_data_parallel(const JPG_DATA &jpg, ByteSource &src, bool &on_device)
+{
+    SCAN_DATA scan;
+    if (!load_scan_data(src,scan)) return false;
+    bool ret;
+    switch (decoder_options.huffman_decoder)
+    {
+    case HUFFMAN_TREE:
+        ret=decode_scan_data<HufTree>(jpg,scan,on_device);
+        break;
+    case HUFFMAN_LOOKUP:
+    default:
+        ret=decode_scan_data<HufTable>(jpg,scan,on_device);
+        break;
+    }
+    free_scan_data(scan);
+    return ret;
+}
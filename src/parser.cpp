@@ -2,25 +2,27 @@
 
 #include "macro.h"
 #include "jpeg.h"
+#include "bytesource.h"
 #include "decoder.h"
+#include "parser.h"
 
-bool read_soi(JPG_DATA &jpg, FILE * const strm)
+bool read_soi(JPG_DATA &jpg, ByteSource &strm)
 {
     uint8_t tag[2];
-    if (1==fread(tag,sizeof(tag),1,strm) && tag[0]==0xFF && tag[1]==0xD8)
+    if (strm.read(tag,sizeof(tag)) && tag[0]==0xFF && tag[1]==0xD8)
         return true;
     else
     {
-        puts("[X] SOI is missing or broken.");
+        logputs("[X] SOI is missing or broken.");
         return false;
     }
 }
 
-bool read_app0(JPG_DATA &jpg, FILE * const strm)
+bool read_app0(JPG_DATA &jpg, ByteSource &strm)
 {
-    if (1!=fread(&jpg.app0,sizeof(APP0),1,strm))
+    if (!strm.read(&jpg.app0,sizeof(APP0)))
     {
-        puts("[X] APP0 is incomplete.");
+        logputs("[X] APP0 is incomplete.");
         return false;
     }
     // calculate the size of thumbnail image
@@ -28,38 +30,38 @@ bool read_app0(JPG_DATA &jpg, FILE * const strm)
     // validate
     if (memcmp(jpg.app0.id,"JFIF\0",5) || bswap16(jpg.app0.len)!=sizeof(APP0)+tn_size)
     {
-        puts("[X] APP0 is broken.");
+        logputs("[X] APP0 is broken.");
         return false;
     }
     // read thumbnail image
     if (tn_size)
     {
         jpg.thumbnail=new uint8_t[tn_size];
-        if (1!=fread(jpg.thumbnail,1,tn_size,strm))
+        if (!strm.read(jpg.thumbnail,tn_size))
         {
-            puts("[X] Thumbnail image is broken.");
+            logputs("[X] Thumbnail image is broken.");
             return false;
         }
     }
     return true;
 }
 
-bool read_dqt(JPG_DATA &jpg, FILE * const strm, size_t len)
+bool read_dqt(JPG_DATA &jpg, ByteSource &strm, size_t len)
 {
     uint8_t byte;
     while (len>0)
     {
-        fread(&byte,sizeof(byte),1,strm);
+        strm.read(&byte,sizeof(byte));
         const uint8_t prec=byte>>4;
         const uint8_t id=byte&0xF;
         if (id>3 || jpg.quantization_table[id]!=NULL)
         {
-            printf("[X] Quantization table #%u is invalid or already defined.\n",id);
+            logprintf("[X] Quantization table #%u is invalid or already defined.\n",id);
             return false;
         }
         if (prec!=1 && prec!=0)
         {
-            printf("[X] Invalid Precision Value for Quantization Table #%u.\n",id);
+            logprintf("[X] Invalid Precision Value for Quantization Table #%u.\n",id);
             return false;
         }
         jpg.quantization_table[id]=new coef_t[64];
@@ -68,19 +70,19 @@ bool read_dqt(JPG_DATA &jpg, FILE * const strm, size_t len)
         switch (prec)
         {
         case 0: // 8-bit
-            if (1==fread(qt8,sizeof(qt8),1,strm))
+            if (strm.read(qt8,sizeof(qt8)))
             {
                 for (size_t i=0;i<64;i++)
                     jpg.quantization_table[id][i]=qt8[i];
             }else
             {
 corrupted:
-                printf("[X] Quantization Table #%u is corrupted.\n",id);
+                logprintf("[X] Quantization Table #%u is corrupted.\n",id);
                 return false;
             }
             break;
         case 1: // 16-bit
-            if (1==fread(qt16,sizeof(qt16),1,strm))
+            if (strm.read(qt16,sizeof(qt16)))
             {
                 for (size_t i=0;i<64;i++)
                     jpg.quantization_table[id][i]=qt16[i];
@@ -91,23 +93,26 @@ corrupted:
             len-=64*(size_t)(prec+1)+1;
         else
         {
-            puts("[X] DQT is corrupted.");
+            logputs("[X] DQT is corrupted.");
             return false;
         }
-        printf("[ ] --- Quantization Table #%u (%d-bit)\n",id,8<<prec);
+        logprintf("[ ] --- Quantization Table #%u (%d-bit)\n",id,8<<prec);
     }
     return true;
 }
 
-bool read_sof(JPG_DATA &jpg, FILE * const strm, size_t len)
+bool read_sof(JPG_DATA &jpg, ByteSource &strm, size_t len)
 {
-    if (len!=sizeof(SOF0) || 1!=fread(&jpg.frame_info,sizeof(SOF0),1,strm))
+    // channel_info holds up to 3 components, 1 for grayscale
+    const size_t fixed=sizeof(SOF0)-sizeof(jpg.frame_info.channel_info);
+    if (len<fixed || len>sizeof(SOF0) || !strm.read(&jpg.frame_info,len) || \
+        len!=fixed+sizeof(jpg.frame_info.channel_info[0])*jpg.frame_info.num_channels)
     {
-        puts("[X] SOF0 is corrupted.");
+        logputs("[X] SOF0 is corrupted.");
         return false;
-    }else if (jpg.frame_info.num_channels!=3 || jpg.frame_info.bit_depth!=8)
+    }else if (jpg.frame_info.num_channels<1 || jpg.frame_info.bit_depth!=8)
     {
-        puts("[X] Unsupported Sampling");
+        logputs("[X] Unsupported Sampling");
         return false;
     }else
     {
@@ -115,11 +120,11 @@ bool read_sof(JPG_DATA &jpg, FILE * const strm, size_t len)
         jpg.frame_info.img_width=bswap16(jpg.frame_info.img_width);
         jpg.frame_info.img_height=bswap16(jpg.frame_info.img_height);
 
-        printf("Dimensions: %u px * %u px\n",jpg.frame_info.img_width,jpg.frame_info.img_height);
-        printf("Bit Depth: %u\n",jpg.frame_info.bit_depth);
+        logprintf("Dimensions: %u px * %u px\n",jpg.frame_info.img_width,jpg.frame_info.img_height);
+        logprintf("Bit Depth: %u\n",jpg.frame_info.bit_depth);
         for (uint8_t i=0;i<jpg.frame_info.num_channels;i++)
         {
-            printf("Channel #%u: id=%u, sampling=%u*%u, uses quantization table %u\n",i, \
+            logprintf("Channel #%u: id=%u, sampling=%u*%u, uses quantization table %u\n",i, \
                    jpg.frame_info.channel_info[i].id, \
                    jpg.frame_info.channel_info[i].sampling_factor>>4, \
                    jpg.frame_info.channel_info[i].sampling_factor&0xF, \
@@ -129,22 +134,23 @@ bool read_sof(JPG_DATA &jpg, FILE * const strm, size_t len)
     }
 }
 
-bool read_sos(JPG_DATA &jpg, FILE * const strm, size_t len)
+bool read_sos(JPG_DATA &jpg, ByteSource &strm, size_t len)
 {
     static const uint8_t reserved[3]={0,0x3F,0};
-    if (len!=sizeof(SOS) || 1!=fread(&jpg.scan_info,sizeof(SOS),1,strm) || memcmp(jpg.scan_info.reserved,reserved,3))
+    // the reserved bytes follow the components actually present
+    const size_t channels_len=len-1-sizeof(jpg.scan_info.reserved);
+    if (len>sizeof(SOS) || !strm.read(&jpg.scan_info.num_channels,1) || jpg.scan_info.num_channels<1 || \
+        channels_len!=sizeof(jpg.scan_info.channel_data[0])*jpg.scan_info.num_channels || \
+        !strm.read(jpg.scan_info.channel_data,channels_len) || !strm.read(jpg.scan_info.reserved,3) || \
+        memcmp(jpg.scan_info.reserved,reserved,3))
     {
-        puts("[X] SOF0 is corrupted.");
-        return false;
-    }else if (jpg.scan_info.num_channels!=3)
-    {
-        puts("[X] Unsupported Sampling");
+        logputs("[X] SOS is corrupted.");
         return false;
     }else
     {
         for (uint8_t i=0;i<jpg.scan_info.num_channels;i++)
         {
-            printf("Channel #%u: id=%u, uses huffman table AC%u & DC%u\n",i, \
+            logprintf("Channel #%u: id=%u, uses huffman table AC%u & DC%u\n",i, \
                    jpg.scan_info.channel_data[i].id, \
                    jpg.scan_info.channel_data[i].huff_tbl_id>>4, \
                    jpg.scan_info.channel_data[i].huff_tbl_id&0xF);
@@ -153,36 +159,36 @@ bool read_sos(JPG_DATA &jpg, FILE * const strm, size_t len)
     }
 }
 
-bool read_dri(JPG_DATA &jpg, FILE * const strm, size_t len)
+bool read_dri(JPG_DATA &jpg, ByteSource &strm, size_t len)
 {
-    if (len!=sizeof(DRI) || 1!=fread(&jpg.dri_info,sizeof(DRI),1,strm))
+    if (len!=sizeof(DRI) || !strm.read(&jpg.dri_info,sizeof(DRI)))
     {
-        puts("[X] DRI is corrupted.");
+        logputs("[X] DRI is corrupted.");
         return false;
     }
     // fix endianess
     jpg.dri_info.restart_interval=bswap16(jpg.dri_info.restart_interval);
 
-    printf("DRI Interval is %d\n",jpg.dri_info.restart_interval);
+    logprintf("DRI Interval is %d\n",jpg.dri_info.restart_interval);
     return true;
 }
 
-bool read_dht(JPG_DATA &jpg, FILE * const strm, size_t len)
+bool read_dht(JPG_DATA &jpg, ByteSource &strm, size_t len)
 {
     uint8_t byte;
     while (len>0)
     {
-        fread(&byte,sizeof(byte),1,strm);
+        strm.read(&byte,sizeof(byte));
         const uint8_t type=byte>>4; // 0:DC 1:AC
         const uint8_t id=byte&0x1F; // combine type and id
         if (type!=1 && type!=0)
         {
-            printf("[X] Invalid Type for Huffman Table #%u.\n",id);
+            logprintf("[X] Invalid Type for Huffman Table #%u.\n",id);
             return false;
         }
         if (jpg.huffman_table[id]!=NULL)
         {
-            printf("[X] Huffman table #%u is already defined.\n",id);
+            logprintf("[X] Huffman table #%u is already defined.\n",id);
             return false;
         }
         // allocate memory for huffman table
@@ -191,108 +197,109 @@ bool read_dht(JPG_DATA &jpg, FILE * const strm, size_t len)
         tbl->num_codeword=0; // initialization
 
         uint8_t countByLength[16];
-        if (1!=fread(&countByLength,sizeof(countByLength),1,strm))
+        if (!strm.read(&countByLength,sizeof(countByLength)))
         {
 datacorrupted:
-            printf("[X] Data of Huffman Table #%u is corrupted.\n",id);
+            logprintf("[X] Data of Huffman Table #%u is corrupted.\n",id);
             return false;
         }
+        memcpy(tbl->count_by_length,countByLength,sizeof(countByLength));
         // assert(countByLength[0]==0); // true in most cases
-        printf("[ ] Huffman Table #%u Data:",id);
+        logprintf("[ ] Huffman Table #%u Data:",id);
         for (int i=1;i<=16;i++)
         {
             vbprintf(" %02x",countByLength[i-1]);
-            assert(countByLength[i-1]<=(1<<i));
             tbl->num_codeword+=countByLength[i-1];
         }
-        puts("");
+        logputs("");
+        for (int i=1;i<=16;i++)
+        {
+            if (countByLength[i-1]>(1<<i))
+                goto invalidtree;
+        }
         if (tbl->num_codeword>256)
         {
 invalidtree:
-            printf("[X] Huffman Table #%u is invalid.\n",id);
+            logprintf("[X] Huffman Table #%u is invalid.\n",id);
             return false;
         }
         else if (tbl->num_codeword>0)
         {
             // read weights
-            if (1!=fread(&tbl->value,tbl->num_codeword,1,strm))
+            if (!strm.read(&tbl->value,tbl->num_codeword))
                 goto datacorrupted;
+            // DC symbols are magnitude categories, at most 11 for 8-bit samples
+            for (int i=0;type==0 && i<tbl->num_codeword;i++)
+            {
+                if (tbl->value[i]>11) goto invalidtree;
+            }
 
-            char curCodeWord[20]={'0',0};
-            int curCodeWordLen=1;
-            // the first codeword must be zeroes
-            while (countByLength[curCodeWordLen-1]==0)
-                curCodeWord[curCodeWordLen++]='0';
-            --countByLength[curCodeWordLen-1];
-
-            tbl->codeword[0]=strcpy(new char[20],curCodeWord);
-            vbprintf("Codeword %s Value %d\n",tbl->codeword[0],tbl->value[0]);
-            // generate other codewords
-            for (int n=1;n<tbl->num_codeword;n++)
+            // generate canonical codewords (ITU-T T.81 C.2)
+            uint32_t code=0;
+            int n=0;
+            for (int bits=1;bits<=16;bits++)
             {
-                // next codeword (incremented by 1)
-                int i;
-                for (i=curCodeWordLen-1;i>=0;i--)
-                {
-                    if (++curCodeWord[i]=='1')
-                        break;
-                    else
-                        curCodeWord[i]='0';
-                }
-                if (i<0) goto invalidtree;
-                if (!countByLength[curCodeWordLen-1])
+                for (int i=0;i<countByLength[bits-1];i++,n++)
                 {
-                    // inc length (padding with 0)
-                    do
-                    {
-                        curCodeWord[curCodeWordLen]='0';
-                        curCodeWord[curCodeWordLen+1]=0;
-                    }while (++curCodeWordLen<=16 && countByLength[curCodeWordLen-1]==0);
-                    if (curCodeWordLen>16) goto invalidtree;
+                    tbl->codeword[n]=(uint16_t)code++;
+                    tbl->length[n]=(uint8_t)bits;
+                    vbprintf("Codeword %0*x (%d bits) Value %d\n",(bits+3)>>2,tbl->codeword[n],bits,tbl->value[n]);
                 }
-                --countByLength[curCodeWordLen-1];
-
-                tbl->codeword[n]=strcpy(new char[20],curCodeWord);
-                vbprintf("Codeword %s Value %d\n",tbl->codeword[n],tbl->value[n]);
+                // codewords of this length must not run out of the code space
+                if (code>(1u<<bits)) goto invalidtree;
+                code<<=1;
             }
-            assert(0==countByLength[curCodeWordLen-1]);
         }
         if (len>=(size_t)16+tbl->num_codeword+1)
             len-=(size_t)16+tbl->num_codeword+1;
         else
         {
-            puts("[X] DQT is corrupted.");
+            logputs("[X] DQT is corrupted.");
             return false;
         }
-        printf("[ ] ^^^ Huffman Table #%u (Type:%s)\n",id,type?"AC":"DC");
+        logprintf("[ ] ^^^ Huffman Table #%u (Type:%s)\n",id,type?"AC":"DC");
     }
     return true;
 }
 
-bool load_jpg(const char *filePath)
+void release_jpg(JPG_DATA &jpg)
 {
-    FILE * const fp=fopen(filePath,"rb");
-    if (fp==NULL)
+    for (int i=0;i<4;i++)
     {
-        printf("Couldn't open file.\n");
-        return false;
+        delete[] jpg.quantization_table[i];
+        jpg.quantization_table[i]=NULL;
     }
-    clock_t timestamp=clock();
-    // parse data
-    JPG_DATA jpg;
-    memset(&jpg,0,sizeof(jpg));
+    for (int i=0;i<32;i++)
+    {
+        delete jpg.huffman_table[i];
+        jpg.huffman_table[i]=NULL;
+    }
+    delete[] (uint8_t*)jpg.thumbnail;
+    jpg.thumbnail=NULL;
+    delete[] jpg.mcu_data;
+    jpg.mcu_data=NULL;
+    delete[] jpg.mcu_eob;
+    jpg.mcu_eob=NULL;
+    delete jpg.sparse_data;
+    jpg.sparse_data=NULL;
+}
+
+bool read_headers(JPG_DATA &jpg, ByteSource &src, const bool decodable)
+{
     uint8_t tag[2];
     uint16_t len;
+#ifdef PROCESS_APPN_HEADER
     bool foundAPP0=false;
+#endif
     // read SOI
-    if (!read_soi(jpg,fp))
+    if (!read_soi(jpg,src))
     {
-        puts("[X] read_soi() failed");
-        goto error;
+        logputs("[X] read_soi() failed");
+        return false;
     }
     // read APP? tags
     tag[1]=0;
-    while (1==fread(tag,sizeof(tag),1,fp) && tag[1]>=0xE0 && tag[1]<=0xEF)
+    while (src.read(tag,sizeof(tag)) && tag[1]>=0xE0 && tag[1]<=0xEF)
     {
         #ifdef PROCESS_APPN_HEADER
         if (tag[1]==0xE0)
@@ -300,120 +307,232 @@ bool load_jpg(const char *filePath)
             // APP0
             if (foundAPP0)
             {
-                puts("[!] multiple app0 found");
+                logputs("[!] multiple app0 found");
             }
-            if (!read_app0(jpg,fp))
+            if (!read_app0(jpg,src))
             {
-                puts("[X] read_app0() failed");
-                goto error;
+                logputs("[X] read_app0() failed");
+                return false;
             }
             foundAPP0=true;
-            printf("JPEG Version: %04x\n",bswap16(jpg.app0.ver));
-            printf("Thumbnail: %u * %u\n",jpg.app0.thumbnail_width,jpg.app0.thumbnail_height);
+            logprintf("JPEG Version: %04x\n",bswap16(jpg.app0.ver));
+            logprintf("Thumbnail: %u * %u\n",jpg.app0.thumbnail_width,jpg.app0.thumbnail_height);
         }else
         #endif
         {
-            printf("skipping APP%d\n",tag[1]-0xE0);
+            logprintf("skipping APP%d\n",tag[1]-0xE0);
             uint16_t len;
-            fread(&len,sizeof(len),1,fp);
-            fseek(fp,bswap16(len)-sizeof(len),SEEK_CUR);
+            src.read(&len,sizeof(len));
+            src.skip(bswap16(len)-sizeof(len));
         }
         tag[1]=0;
     }
     do
     {
         /*
-        const long start_pos=ftell(fp);
+        const long start_pos=src.tell();
         */
-        fread(&len,sizeof(len),1,fp);
+        src.read(&len,sizeof(len));
         len=bswap16(len)-2;
         switch (tag[1])
         {
         case 0xDB: // DQT
-            if (!read_dqt(jpg,fp,len))
+            if (!read_dqt(jpg,src,len))
             {
-                puts("[X] read_dqt() failed");
-                goto error;
+                logputs("[X] read_dqt() failed");
+                return false;
             }
             break;
         case 0xC0: // SOF0 (Baseline)
-            if (!read_sof(jpg,fp,len))
+            if (!read_sof(jpg,src,len))
             {
-                puts("[X] read_sof() failed");
-                goto error;
+                logputs("[X] read_sof() failed");
+                return false;
             }
             break;
         case 0xC1:
         case 0xC2: // Progressive
         case 0xC3: // Lossless
-            puts("[X] Only Baseline Profile is Supported.");
-            goto error;
-            break;
+            logputs("[X] Only Baseline Profile is Supported.");
+            return false;
         case 0xC4: // DHT
-            if (!read_dht(jpg,fp,len))
+            if (!read_dht(jpg,src,len))
             {
-                puts("[X] read_dht() failed");
-                goto error;
+                logputs("[X] read_dht() failed");
+                return false;
             }
             break;
         case 0xDA: // SOS
-            if (!read_sos(jpg,fp,len))
+            if (!read_sos(jpg,src,len))
             {
-                puts("[X] read_sos() failed");
-                goto error;
+                logputs("[X] read_sos() failed");
+                return false;
             }
+            if (!decodable)
+                return is_valid_file(jpg);
             if (!is_supported_file(jpg))
             {
-                puts("[X] this file is not supported");
-                goto error;
+                logputs("[X] this file is not supported");
+                return false;
             }else
             {
-                puts("[ ] file format supported. ready to decode.");
+                logputs("[ ] file format supported. ready to decode.");
             }
-            printf("Time elapsed for parsing basic info: %ld\n",clock()-timestamp);
-
-            timestamp=clock();
-            if (!decode_init(jpg))
-            {
-                puts("[X] decoder initialization failed");
-                goto error;
-            }
-            printf("Time elapsed for initialization: %ld\n",clock()-timestamp);
-
-            timestamp=clock();
-            if (!decode_huffman_data(jpg,fp))
-            {
-                puts("[X] decode_huffman_data() failed");
-                goto error;
-            }
-            printf("Time elapsed for huffman decoding: %ld\n",clock()-timestamp);
-
-            timestamp=clock();
-            if (!decode_mcu_data(jpg,fp))
-            {
-                puts("[X] decode_mcu_data() failed");
-                goto error;
-            }
-            printf("Time elapsed for IDCT and color space conversion: %ld\n",clock()-timestamp);
-
-            puts("[ ] decoding completed.");
-            break;
+            return true;
         case 0xDD: // DRI
-            if (!read_dri(jpg,fp,len))
+            if (!read_dri(jpg,src,len))
             {
-                puts("[X] read_dri() failed");
-                goto error;
+                logputs("[X] read_dri() failed");
+                return false;
             }
             break;
         case 0xD9: // EOI
-            puts("[-] End of Image.");
+            logputs("[-] End of Image.");
+            // fall through: no scan before the end of the image
         default:
             tag[1]=0;
             break;
         }
-    }while (tag[1]!=0 && 1==fread(tag,sizeof(tag),1,fp));
+    }while (tag[1]!=0 && src.read(tag,sizeof(tag)));
+    logputs("[X] no scan found");
+    return false;
+}
+
+// parse and decode a whole file, shared by the file and memory entry points
+static bool decode_jpg(ByteSource &src, DECODED_IMAGE &image)
+{
+    clock_t timestamp=clock();
+    // parse data
+    JPG_DATA jpg;
+    memset(&jpg,0,sizeof(jpg));
+    jpg.idct_mode=decoder_options.idct;
+    uint8_t tag[2];
+    bool decoded=false;
+    image.width=image.height=0;
+    image.pixels=NULL;
+    image.size=0;
+    if (!read_headers(jpg,src))
+        goto error;
+    printf("Time elapsed for parsing basic info: %ld\n",clock()-timestamp);
+
+    timestamp=clock();
+    if (!decode_init(jpg))
+    {
+        puts("[X] decoder initialization failed");
+        goto error;
+    }
+    printf("Time elapsed for initialization: %ld\n",clock()-timestamp);
+
+    timestamp=clock();
+    if (!decode_huffman_data(jpg,src))
+    {
+        puts("[X] decode_huffman_data() failed");
+        goto error;
+    }
+    printf("Time elapsed for huffman decoding: %ld\n",clock()-timestamp);
+
+    timestamp=clock();
+    alloc_image(image,jpg,decoder_options.output);
+    if (!decode_mcu_data(jpg,image))
+    {
+        puts("[X] decode_mcu_data() failed");
+        goto error;
+    }
+    printf("Time elapsed for IDCT and color space conversion: %ld\n",clock()-timestamp);
+
+    puts("[ ] decoding completed.");
+    decoded=true;
+    // the scan is followed by EOI
+    if (src.read(tag,sizeof(tag)) && tag[0]==0xFF && tag[1]==0xD9)
+        puts("[-] End of Image.");
 
 error:
-    fclose(fp);
-    return true;
+    release_jpg(jpg);
+    if (!decoded) free_image(image);
+    return decoded;
+}
+
+bool decode_jpg(const uint8_t *data, const size_t len, DECODED_IMAGE &image)
+{
+    ByteSource src;
+    src.open(data,len);
+    return decode_jpg(src,image);
+}
+
+void free_image(DECODED_IMAGE &image)
+{
+    delete[] image.pixels;
+    image.pixels=NULL;
+    image.size=0;
+    image.width=image.height=0;
+}
+
+void alloc_image(DECODED_IMAGE &image, const JPG_DATA &jpg, const PixelFormat format)
+{
+    const SOF0 &frame=jpg.frame_info;
+    image.width=frame.img_width;
+    image.height=frame.img_height;
+    image.format=format;
+    image.num_planes=1;
+    image.plane_width[0]=image.width;
+    image.plane_height[0]=image.height;
+    switch (format)
+    {
+    case PIXEL_BGRA:
+    case PIXEL_RGBA:
+        image.pitch[0]=image.width*4;
+        break;
+    case PIXEL_RGB24:
+        image.pitch[0]=image.width*3;
+        break;
+    case PIXEL_GRAY:
+        image.pitch[0]=image.width;
+        break;
+    case PIXEL_YCBCR:
+        image.num_planes=min((int)frame.num_channels,MAX_PLANES);
+        for (int i=0;i<image.num_planes;i++)
+        {
+            // the samples covering the image, rounded up (A.1.1)
+            const int h_max=jpg.mcu_width>>3, v_max=jpg.mcu_height>>3;
+            const int h=frame.channel_info[i].sampling_factor>>4;
+            const int v=frame.channel_info[i].sampling_factor&0xF;
+            image.plane_width[i]=(image.width*h+h_max-1)/h_max;
+            image.plane_height[i]=(image.height*v+v_max-1)/v_max;
+            image.pitch[i]=image.plane_width[i];
+        }
+        break;
+    case PIXEL_NV12:
+        image.num_planes=2;
+        image.pitch[0]=image.width;
+        image.plane_width[1]=(image.width+1)/2;
+        image.plane_height[1]=(image.height+1)/2;
+        image.pitch[1]=image.plane_width[1]*2;
+        break;
+    }
+    image.size=0;
+    for (int i=0;i<image.num_planes;i++)
+        image.size+=(size_t)image.pitch[i]*image.plane_height[i];
+    image.pixels=new uint8_t[image.size];
+    uint8_t *plane=image.pixels;
+    for (int i=0;i<image.num_planes;i++)
+    {
+        image.plane[i]=plane;
+        plane+=(size_t)image.pitch[i]*image.plane_height[i];
+    }
+}
+
+bool load_jpg(const char *filePath)
+{
+    ByteSource src;
+    if (!src.open(filePath,decoder_options.map_input))
+    {
+        printf("Couldn't open file.\n");
+        return false;
+    }
+    DECODED_IMAGE image;
+    if (!decode_jpg(src,image)) return false;
+    const bool saved=save_image(image)!=NULL;
+    if (!saved) puts("[X] Write file error");
+    free_image(image);
+    return saved;
 }
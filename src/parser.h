@@ -0,0 +1,35 @@
+#ifndef PARSER_H_INCLUDED
+#define PARSER_H_INCLUDED
+
+const int MAX_PLANES=3;
+
+// pixels decoded from a JPEG file
+struct DECODED_IMAGE
+{
+    int width;
+    int height;
+    PixelFormat format;
+    uint8_t *pixels; // every plane, one after the other, top row first
+    size_t size; // bytes
+    int num_planes; // 1 for the packed formats and gray
+    uint8_t *plane[MAX_PLANES];
+    int plane_width[MAX_PLANES]; // in samples, NV12 Cb Cr pairs count as one
+    int plane_height[MAX_PLANES];
+    int pitch[MAX_PLANES]; // bytes from one row to the next
+};
+
+// decode a file and save it with save_image(), as m:\output.bmp by default
+bool load_jpg(const char *filePath);
+// decode a JPEG file already in memory, the image is released with free_image()
+bool decode_jpg(const uint8_t *data, const size_t len, DECODED_IMAGE &image);
+void free_image(DECODED_IMAGE &image);
+// allocate an image of the size of the frame, its planes following the sampling factors for PIXEL_YCBCR
+void alloc_image(DECODED_IMAGE &image, const JPG_DATA &jpg, const PixelFormat format);
+
+// parse the headers up to SOS and leave the source at the entropy-coded data
+// fails for files the decoder doesn't support, or only for invalid ones unless decodable
+bool read_headers(JPG_DATA &jpg, ByteSource &src, const bool decodable=true);
+// release memory allocated while parsing and decoding
+void release_jpg(JPG_DATA &jpg);
+
+#endif // PARSER_H_INCLUDED
@@ -0,0 +1,215 @@
+#include "stdafx.h"
+
+#include "macro.h"
+#include "bytesource.h"
+#include "scan.h"
+#include "cpu.h"
+
+// reference version, one byte at a time
+static size_t unstuff_scan_data_scalar(uint8_t *dst, size_t *dst_len, const uint8_t *src, const size_t len, std::vector<size_t> *restart_offsets)
+{
+    // dst may be the same buffer as src since the output is never longer than the input
+    size_t in=0,out=0;
+    while (in<len)
+    {
+        const uint8_t byte=src[in];
+        if (byte!=0xFF)
+        {
+            dst[out++]=byte;
+            in++;
+            continue;
+        }
+        if (in+1>=len) break; // truncated marker
+        const uint8_t next=src[in+1];
+        if (next==0)
+        {
+            // stuffed zero: produce a 0xFF byte
+            dst[out++]=0xFF;
+            in+=2;
+        }
+        else if (next==0xFF)
+        {
+            // fill byte
+            in++;
+        }
+        else if (next>=0xD0 && next<=0xD7)
+        {
+            // RSTn: keep this mark but drop 0xFF
+            if (restart_offsets!=NULL) restart_offsets->push_back(out);
+            dst[out++]=next;
+            in+=2;
+        }
+        else
+        {
+            break; // EOI or any other marker ends the scan
+        }
+    }
+    *dst_len=out;
+    return in;
+}
+
+// runs without 0xFF go through the copy_until_ff kernel, the rest is handled byte by byte
+static size_t unstuff_scan_data(const CPU_KERNELS &kernels, uint8_t *dst, size_t *dst_len, const uint8_t *src, const size_t len, std::vector<size_t> *restart_offsets)
+{
+    size_t in=0,out=0;
+    while (in<len)
+    {
+        kernels.copy_until_ff(dst,out,src,in,len);
+        if (in>=len) break;
+        const uint8_t byte=src[in];
+        if (byte!=0xFF)
+        {
+            // the tail, shorter than a vector
+            dst[out++]=byte;
+            in++;
+            continue;
+        }
+        if (in+1>=len) break; // truncated marker
+        const uint8_t next=src[in+1];
+        if (next==0)
+        {
+            // stuffed zero: produce a 0xFF byte
+            dst[out++]=0xFF;
+            in+=2;
+        }
+        else if (next==0xFF)
+        {
+            // fill byte
+            in++;
+        }
+        else if (next>=0xD0 && next<=0xD7)
+        {
+            // RSTn: keep this mark but drop 0xFF
+            if (restart_offsets!=NULL) restart_offsets->push_back(out);
+            dst[out++]=next;
+            in+=2;
+        }
+        else
+        {
+            break; // EOI or any other marker ends the scan
+        }
+    }
+    *dst_len=out;
+    return in;
+}
+
+size_t unstuff_scan_data(uint8_t *dst, size_t *dst_len, const uint8_t *src, const size_t len, std::vector<size_t> *restart_offsets)
+{
+    return unstuff_scan_data(*cpu_kernels,dst,dst_len,src,len,restart_offsets);
+}
+
+size_t find_scan_end(const uint8_t *src, const size_t len)
+{
+    size_t pos=0;
+    for (;;)
+    {
+        const uint8_t *next_ff=(const uint8_t*)memchr(&src[pos],0xFF,len-pos);
+        if (next_ff==NULL) return len;
+        pos=next_ff-src;
+        if (pos+1>=len) return pos; // truncated marker
+        const uint8_t next=src[pos+1];
+        if (next==0 || (next>=0xD0 && next<=0xD7))
+            pos+=2; // stuffed zero or RSTn
+        else if (next==0xFF)
+            pos++; // fill byte
+        else
+            return pos;
+    }
+}
+
+bool load_scan_data(ByteSource &src, SCAN_DATA &scan)
+{
+    scan.data=NULL;
+    scan.size=0;
+    scan.restart_offsets.clear();
+
+    const size_t start=src.tell();
+    if (start>src.size())
+    {
+        puts("[X] unable to determine the size of the scan");
+        return false;
+    }
+    const size_t len=src.size()-start;
+
+    scan.data=new uint8_t[len+SCAN_DATA_PADDING];
+    size_t consumed;
+    if (src.isMapped())
+    {
+        consumed=unstuff_scan_data(scan.data,&scan.size,src.mappedData()+start,len,&scan.restart_offsets);
+    }
+    else
+    {
+        if (len>0 && !src.read(scan.data,len))
+        {
+            puts("[X] failed to read the scan");
+            free_scan_data(scan);
+            return false;
+        }
+        // unstuff in place
+        consumed=unstuff_scan_data(scan.data,&scan.size,scan.data,len,&scan.restart_offsets);
+    }
+    memset(&scan.data[scan.size],0,SCAN_DATA_PADDING);
+    // leave the terminating marker for the parser
+    src.seek(start+consumed);
+    return true;
+}
+
+void free_scan_data(SCAN_DATA &scan)
+{
+    delete[] scan.data;
+    scan.data=NULL;
+    scan.size=0;
+    scan.restart_offsets.clear();
+}
+
+bool test_scan()
+{
+    const uint8_t src[]={0x12,0xFF,0x00,0x34,0xFF,0xD0,0x56,0xFF,0xFF,0xD1,0x78,0xFF,0xD9,0x9A};
+    uint8_t dst[sizeof(src)];
+    size_t len;
+    std::vector<size_t> rst;
+    const size_t consumed=unstuff_scan_data(dst,&len,src,sizeof(src),&rst);
+    const uint8_t expected[]={0x12,0xFF,0x34,0xD0,0x56,0xD1,0x78};
+    assert(consumed==11); // stops at EOI
+    assert(len==sizeof(expected) && !memcmp(dst,expected,len));
+    assert(rst.size()==2 && rst[0]==3 && rst[1]==5);
+    assert(find_scan_end(src,sizeof(src))==consumed);
+    assert(find_scan_end(src,12)==11 && find_scan_end(src,11)==11 && find_scan_end(src,4)==4);
+
+    // the kernel of every instruction set must match the scalar version byte for byte
+    const CPU_KERNELS *kernels[ISA_COUNT];
+    const int num_kernels=usable_cpu_kernels(kernels);
+    uint8_t noisy[1000],out1[1000],out2[1000];
+    uint32_t seed=1;
+    for (int round=0;round<50;round++)
+    {
+        for (size_t i=0;i<sizeof(noisy);i++)
+        {
+            seed=seed*1103515245+12345;
+            const uint8_t r=seed>>24;
+            // dense and sparse 0xFFs on alternate rounds
+            noisy[i]=r<(round%2?0x40:0x02)?0xFF:r;
+            if (noisy[i]==0xFF && i+1<sizeof(noisy))
+            {
+                // mostly stuffed zeros, then fill bytes and RSTn, rarely EOI
+                seed=seed*1103515245+12345;
+                const uint8_t m=seed>>24;
+                noisy[++i]=m<0xC0?0:(m<0xE0?0xFF:(m<0xFF?0xD0+(m&7):0xD9));
+            }
+        }
+        const size_t len=sizeof(noisy)-round*7;
+        size_t len1,len2;
+        std::vector<size_t> rst1,rst2;
+        const size_t consumed1=unstuff_scan_data_scalar(out1,&len1,noisy,len,&rst1);
+        for (int k=0;k<num_kernels;k++)
+        {
+            rst2.clear();
+            const size_t consumed2=unstuff_scan_data(*kernels[k],out2,&len2,noisy,len,&rst2);
+            assert(consumed1==consumed2 && len1==len2 && !memcmp(out1,out2,len1) && rst1==rst2);
+            // in place
+            memcpy(out2,noisy,len);
+            assert(unstuff_scan_data(*kernels[k],out2,&len2,out2,len,NULL)==consumed1 && len2==len1 && !memcmp(out1,out2,len1));
+        }
+    }
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef SCAN_H_INCLUDED
+#define SCAN_H_INCLUDED
+
+#include <vector>
+
+// zero bytes kept after the scan data so that cached bit readers never read past the buffer:
+// enough for the longest possible MCU (10 blocks of 64 coefficients, 32 bits each) and a cache refill
+const size_t SCAN_DATA_PADDING=10*64*32/8+8;
+
+// an entropy-coded segment loaded into memory at once
+struct SCAN_DATA
+{
+    uint8_t *data; // byte stuffing removed, RSTn markers reduced to their second byte
+    size_t size; // not including the padding
+    std::vector<size_t> restart_offsets; // position of every RSTn byte in data
+};
+
+// remove byte stuffing up to the first marker other than RSTn
+// returns the number of source bytes consumed, i.e. the position of the terminating marker
+// RSTn positions go to restart_offsets; runs without 0xFF are copied by the copy_until_ff kernel
+size_t unstuff_scan_data(uint8_t *dst, size_t *dst_len, const uint8_t *src, const size_t len, std::vector<size_t> *restart_offsets);
+
+// position of the first marker other than RSTn, or len if there is none
+size_t find_scan_end(const uint8_t *src, const size_t len);
+
+// read the rest of the scan from the source and leave it at the marker following the scan
+// a mapped source is unstuffed straight from the mapping
+bool load_scan_data(ByteSource &src, SCAN_DATA &scan);
+void free_scan_data(SCAN_DATA &scan);
+
+bool test_scan();
+
+#endif // SCAN_H_INCLUDED
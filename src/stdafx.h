@@ -17,6 +17,7 @@
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <new>
 #ifndef __GNUC__
 	#include <assert.h>
 #endif
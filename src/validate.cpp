@@ -0,0 +1,289 @@
+#include "stdafx.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "macro.h"
+#include "jpeg.h"
+#include "bytesource.h"
+#include "bitstream.h"
+#include "bitreader.h"
+#include "huffman.h"
+#include "huffcache.h"
+#include "zigzag.h"
+#include "idct.h"
+#include "decoder.h"
+#include "entropy.h"
+#include "scan.h"
+#include "parser.h"
+#include "validate.h"
+
+static bool set_error(VALIDATION_RESULT &result, const char *error, const int mcu, const size_t offset)
+{
+    result.valid=false;
+    result.error=error;
+    result.mcu=mcu;
+    result.offset=offset;
+    return false;
+}
+
+// decode every MCU of the scan, discarding the coefficients
+template <class HuffDecoder>
+static bool check_scan(const JPG_DATA &jpg, FastBitReader &strm, SCAN_STATE &state)
+{
+    const HuffDecoderSet<HuffDecoder> htree(jpg);
+    const SCAN_TABLES<HuffDecoder> tables(jpg,htree);
+    DiscardBlockSink sink;
+    // zeros are read after the end and often decode, so the MCU that reads
+    // past the end is where the data stops
+    auto next=[&]()
+    {
+        return !strm.cacheEof();
+    };
+    const bool decoded=decode_mcus(jpg,tables,strm,state,sink,next);
+    if (strm.cacheEof())
+    {
+        if (decoded) state.mcu_idx--;
+        state.error=SCAN_TRUNCATED;
+        return false;
+    }
+    return decoded;
+}
+
+static const char* describe_scan_error(const ScanError error)
+{
+    switch (error)
+    {
+    case SCAN_BAD_RESTART:
+        return "RSTn marker missing or out of sequence";
+    case SCAN_TRUNCATED:
+        return "entropy-coded data ends before the last MCU";
+    case SCAN_BAD_CODE:
+    default:
+        return "invalid Huffman code";
+    }
+}
+
+static bool validate_source(ByteSource &src, VALIDATION_RESULT &result)
+{
+    JPG_DATA jpg;
+    memset(&jpg,0,sizeof(jpg));
+    if (!read_headers(jpg,src,false))
+    {
+        release_jpg(jpg);
+        return set_error(result,"invalid or unsupported headers",-1,src.tell());
+    }
+    result.supported=is_supported_file(jpg);
+    init_mcu_layout(jpg);
+
+    const uint8_t *data=src.mappedData();
+    const size_t len=src.size();
+    const size_t start=src.tell();
+    const size_t end=start+find_scan_end(data+start,len-start);
+    size_t data_end=end;
+    while (data_end>start && data[data_end-1]==0xFF) data_end--; // fill bytes before the marker
+
+    FastBitReader strm(data+start,data_end-start);
+    SCAN_STATE state;
+    init_scan_state(state);
+    bool ok;
+    switch (decoder_options.huffman_decoder)
+    {
+    case HUFFMAN_TREE:
+        ok=check_scan<HufTree>(jpg,strm,state);
+        break;
+    case HUFFMAN_LOOKUP:
+    default:
+        ok=check_scan<HufTable>(jpg,strm,state);
+        break;
+    }
+    release_jpg(jpg);
+
+    if (!ok)
+        return set_error(result,describe_scan_error(state.error),state.mcu_idx,start+strm.getReadPos());
+    if (strm.hasBytesLeft())
+        return set_error(result,"data after the last MCU",-1,start+strm.getReadPos());
+    if (end+2>len)
+        return set_error(result,"EOI missing",-1,end);
+    if (data[end+1]!=0xD9)
+        return set_error(result,"unexpected marker after the scan",-1,end);
+    result.valid=true;
+    return true;
+}
+
+bool validate_jpg(const char *path, VALIDATION_RESULT &result)
+{
+    result.valid=false;
+    result.supported=false;
+    result.error=NULL;
+    result.mcu=-1;
+    result.offset=0;
+
+    ByteSource src;
+    if (!src.open(path,true))
+        return set_error(result,"unable to open the file",-1,0);
+    if (src.size()==0)
+        return set_error(result,"empty file",-1,0);
+    // the scan is checked in place, so a file that can't be mapped is read into memory
+    std::vector<uint8_t> buffer;
+    if (!src.isMapped())
+    {
+        buffer.resize(src.size());
+        if (!src.read(buffer.data(),buffer.size()))
+            return set_error(result,"unable to read the file",-1,0);
+        src.open(buffer.data(),buffer.size());
+    }
+    return validate_source(src,result);
+}
+
+int validate_files(const char * const *paths, const int count, const int threads)
+{
+    int num_threads=threads;
+    if (num_threads<=0) num_threads=std::thread::hardware_concurrency();
+    num_threads=max(1,min(num_threads,count));
+
+    // the messages of the parser and the entropy decoder would be interleaved
+    const bool messages=decoder_messages;
+    decoder_messages=false;
+
+    std::atomic<int> next_file(0);
+    std::atomic<int> num_invalid(0);
+    std::atomic<int> num_unsupported(0);
+    const auto worker=[&](const int)
+    {
+        int i;
+        while ((i=next_file.fetch_add(1))<count)
+        {
+            VALIDATION_RESULT result;
+            // one printf per line keeps the lines of different threads apart
+            if (validate_jpg(paths[i],result))
+            {
+                if (result.supported)
+                    printf("[ ] %s: ok\n",paths[i]);
+                else
+                {
+                    num_unsupported++;
+                    printf("[ ] %s: ok, unsupported by the decoder\n",paths[i]);
+                }
+            }else
+            {
+                num_invalid++;
+                if (result.mcu>=0)
+                    printf("[X] %s: %s at MCU %d, byte %lu\n",paths[i],result.error,result.mcu,(unsigned long)result.offset);
+                else
+                    printf("[X] %s: %s at byte %lu\n",paths[i],result.error,(unsigned long)result.offset);
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int i=1;i<num_threads;i++)
+        pool.push_back(std::thread(worker,i));
+    worker(0);
+    for (size_t i=0;i<pool.size();i++)
+        pool[i].join();
+
+    decoder_messages=messages;
+    printf("[ ] %d of %d files valid, %d of them unsupported by the decoder\n",count-num_invalid.load(),count,num_unsupported.load());
+    return num_invalid;
+}
+
+// a baseline file of w*h pixels with the given sampling factors, whose every block is
+// one byte: the only DC code, '0', with a 6-bit difference, then the only AC code, EOB '0'
+static std::vector<uint8_t> make_test_jpg(const int w, const int h, const uint8_t *sampling, const int num_channels, int &mcu_count, int &blocks_per_mcu)
+{
+    std::vector<uint8_t> f={0xFF,0xD8, 0xFF,0xDB,0,67,0};
+    f.insert(f.end(),64,1);
+    const uint8_t sof[]={0xFF,0xC0,0,(uint8_t)(8+3*num_channels),8,(uint8_t)(h>>8),(uint8_t)h,(uint8_t)(w>>8),(uint8_t)w,(uint8_t)num_channels};
+    f.insert(f.end(),sof,sof+sizeof(sof));
+    int hmax=1,vmax=1;
+    blocks_per_mcu=0;
+    for (int i=0;i<num_channels;i++)
+    {
+        f.insert(f.end(),{(uint8_t)(i+1),sampling[i],0});
+        hmax=max(hmax,sampling[i]>>4);
+        vmax=max(vmax,sampling[i]&0xF);
+        blocks_per_mcu+=(sampling[i]>>4)*(sampling[i]&0xF);
+    }
+    if (num_channels==1) hmax=vmax=blocks_per_mcu=1;
+    for (int ac=0;ac<2;ac++)
+    {
+        f.insert(f.end(),{0xFF,0xC4,0,20,(uint8_t)(ac<<4),1});
+        f.insert(f.end(),15,0);
+        f.push_back(ac?0x00:0x06);
+    }
+    f.insert(f.end(),{0xFF,0xDA,0,(uint8_t)(6+2*num_channels),(uint8_t)num_channels});
+    for (int i=0;i<num_channels;i++)
+        f.insert(f.end(),{(uint8_t)(i+1),0});
+    f.insert(f.end(),{0,0x3F,0});
+    mcu_count=((w+8*hmax-1)/(8*hmax))*((h+8*vmax-1)/(8*vmax));
+    // alternating signs keep the DC predictors small
+    for (int i=0;i<mcu_count*blocks_per_mcu;i++)
+        f.push_back((uint8_t)((((i&1)<<5)|(i*7&0x1F))<<1));
+    f.insert(f.end(),{0xFF,0xD9});
+    return f;
+}
+
+static McuLayout test_layout(const std::vector<uint8_t> &file)
+{
+    ByteSource src;
+    src.open(file.data(),file.size());
+    JPG_DATA jpg;
+    memset(&jpg,0,sizeof(jpg));
+    const bool ok=read_headers(jpg,src,false);
+    assert(ok);
+    init_mcu_layout(jpg);
+    const McuLayout layout=jpg.mcu_layout;
+    release_jpg(jpg);
+    return layout;
+}
+
+static bool validate_buffer(const std::vector<uint8_t> &file, VALIDATION_RESULT &result)
+{
+    ByteSource src;
+    src.open(file.data(),file.size());
+    result.error=NULL;
+    result.mcu=-1;
+    return validate_source(src,result);
+}
+
+bool test_validate()
+{
+    static const struct
+    {
+        uint8_t sampling[3];
+        int num_channels;
+        McuLayout layout;
+    }cases[]=
+    {
+        {{0x11},1,MCU_LAYOUT_GRAY},
+        {{0x22},1,MCU_LAYOUT_GRAY}, // one block per MCU in a single component scan
+        {{0x11,0x11,0x11},3,MCU_LAYOUT_444},
+        {{0x22,0x11,0x11},3,MCU_LAYOUT_420},
+        {{0x21,0x11,0x11},3,MCU_LAYOUT_422},
+        {{0x12,0x11,0x11},3,MCU_LAYOUT_GENERIC},
+        {{0x11,0x11},2,MCU_LAYOUT_GENERIC}
+    };
+    const bool messages=decoder_messages;
+    decoder_messages=false;
+    for (size_t i=0;i<sizeof(cases)/sizeof(cases[0]);i++)
+    {
+        int mcu_count,blocks_per_mcu;
+        std::vector<uint8_t> file=make_test_jpg(41,23,cases[i].sampling,cases[i].num_channels,mcu_count,blocks_per_mcu);
+        const McuLayout layout=test_layout(file);
+        assert(layout==cases[i].layout);
+        VALIDATION_RESULT result;
+        bool valid=validate_buffer(file,result);
+        assert(valid);
+        // a block too many or too few is caught by the checks after the last MCU
+        file.insert(file.end()-2,0);
+        valid=validate_buffer(file,result);
+        assert(!valid && result.mcu==-1);
+        file.erase(file.end()-4,file.end()-2);
+        valid=validate_buffer(file,result);
+        assert(!valid && result.mcu==mcu_count-1);
+    }
+    decoder_messages=messages;
+    // the statistics are for the files decoded
+    huffman_cache_clear();
+    return true;
+}
@@ -0,0 +1,24 @@
+#ifndef VALIDATE_H_INCLUDED
+#define VALIDATE_H_INCLUDED
+
+// outcome of checking one file
+struct VALIDATION_RESULT
+{
+    bool valid;
+    bool supported; // the decoder can decode the image, a valid file may still be unsupported
+    const char *error; // what is wrong with the file, NULL if it is valid
+    int mcu; // MCU at which the entropy-coded data is broken, -1 if the error is elsewhere
+    size_t offset; // file offset of the error, within a few bytes for errors in the scan
+};
+
+// Check a file without decoding the image: the headers are parsed, then every Huffman code of
+// the scan is decoded, the RSTn markers must come in sequence and the scan must be followed
+// by EOI. Coefficients are not stored, no image memory is allocated and OpenCL is not used.
+// Any baseline file with 1 to 3 components is checked, including those the decoder rejects.
+bool validate_jpg(const char *path, VALIDATION_RESULT &result);
+// validate files on several threads, 0 for one per core, printing a line for every file
+// returns the number of invalid files, valid files unsupported by the decoder don't count
+int validate_files(const char * const *paths, const int count, const int threads);
+bool test_validate();
+
+#endif // VALIDATE_H_INCLUDED